@@ -0,0 +1,379 @@
+// Incremental index of the capture directory.
+//
+// Keeps one entry per captured image ({name, size, mtime, frame, gps}),
+// ordered by frame number, so listings never have to readdir, stat and sort
+// the whole directory. Entries are added and removed from filesystem events
+// through update(). The index is persisted as an append-only journal in the
+// capture directory, replayed at startup and compacted when it grows stale.
+// At startup the journal is reconciled against a single readdir, only new
+// files are stat'ed.
+
+var fs = require('fs');
+var util = require('util');
+var EventEmitter = require('events').EventEmitter;
+
+var journal_name = '.capture_index';
+var journal_flush_delay = 1000;
+var exif_read_length = 65536;
+
+
+function CaptureIndex(dir, options) {
+  EventEmitter.call(this);
+  options = options || {};
+  this.dir = dir;
+  this.journal = dir + journal_name;
+  this.readGps = options.gps !== false;
+  this.entries = [];
+  this.byName = {};
+  this.journalLines = 0;
+  this.pendingLines = [];
+  this.flushTimer = null;
+  this.ready = false;
+  this.load();
+}
+util.inherits(CaptureIndex, EventEmitter);
+
+
+CaptureIndex.frameNumber = function(name) {
+  var m = name.match(/(\d+)\.jpg$/);
+  return m ? parseInt(m[1], 10) : -1;
+};
+
+
+CaptureIndex.prototype.load = function() {
+  var self = this;
+  fs.readFile(this.journal, 'utf8', function(err, data) {
+    if (!err) {
+      data.split('\n').forEach(function(line) {
+        if (!line)
+          return;
+        self.journalLines++;
+        if (line[0] === '+') {
+          try {
+            self.insert(JSON.parse(line.substr(1)));
+          } catch (e) {
+            // ignore a torn last line
+          }
+        } else if (line[0] === '-') {
+          self.remove(line.substr(1));
+        }
+      });
+    }
+    self.reconcile();
+  });
+};
+
+
+CaptureIndex.prototype.reconcile = function() {
+  var self = this;
+  fs.readdir(this.dir, function(err, files) {
+    if (err) {
+      self.ready = true;
+      self.emit('ready');
+      return;
+    }
+    var present = {};
+    var added = [];
+    files.forEach(function(file) {
+      if (file.substr(-4) !== '.jpg')
+        return;
+      present[file] = true;
+      if (!(file in self.byName))
+        added.push(file);
+    });
+    Object.keys(self.byName).forEach(function(name) {
+      if (!(name in present))
+        self.remove(name);
+    });
+    if (self.journalLines > 2 * self.entries.length + 100)
+      self.compact();
+    self.ready = true;
+    self.emit('ready');
+    added.forEach(function(file) {
+      self.update(file);
+    });
+  });
+};
+
+
+// Called with the name of a file in the capture directory that may have been
+// created, rewritten or deleted.
+CaptureIndex.prototype.update = function(name) {
+  var self = this;
+  if (name.substr(-4) !== '.jpg')
+    return;
+  fs.stat(this.dir + name, function(err, stats) {
+    var entry = self.byName[name];
+    if (err) {
+      if (entry) {
+        self.remove(name);
+        self.log('-' + name);
+        self.emit('remove', entry);
+      }
+      return;
+    }
+    if (!stats.isFile())
+      return;
+    var mtime = stats.mtime.getTime();
+    if (entry && (entry.mtime === mtime) && (entry.size === stats.size))
+      return;
+    entry = {
+      name: name,
+      size: stats.size,
+      mtime: mtime,
+      frame: CaptureIndex.frameNumber(name)
+    };
+    self.insert(entry);
+    self.log('+' + JSON.stringify(entry));
+    self.emit('add', entry);
+    if (self.readGps)
+      self.readExifGps(entry);
+  });
+};
+
+
+// Attach extra data (e.g. attitude) to an entry and persist it.
+CaptureIndex.prototype.annotate = function(name, fields) {
+  var entry = this.byName[name];
+  if (!entry)
+    return;
+  Object.keys(fields).forEach(function(key) {
+    entry[key] = fields[key];
+  });
+  this.log('+' + JSON.stringify(entry));
+};
+
+
+CaptureIndex.prototype.clear = function() {
+  this.entries = [];
+  this.byName = {};
+  this.pendingLines = [];
+  this.journalLines = 0;
+  fs.writeFile(this.journal, '', function() {});
+};
+
+
+CaptureIndex.prototype.count = function() {
+  return this.entries.length;
+};
+
+
+CaptureIndex.prototype.latest = function() {
+  return this.entries.length ? this.entries[this.entries.length - 1] : null;
+};
+
+
+// Page of entries, newest first unless ascending is set.
+CaptureIndex.prototype.page = function(offset, limit, ascending) {
+  var total = this.entries.length;
+  offset = Math.max(0, Math.min(offset || 0, total));
+  limit = Math.max(0, Math.min(limit || total, total - offset));
+  var images;
+  if (ascending) {
+    images = this.entries.slice(offset, offset + limit);
+  } else {
+    images = this.entries.slice(total - offset - limit, total - offset).reverse();
+  }
+  return { total: total, offset: offset, images: images };
+};
+
+
+// Entries with from <= frame <= to, oldest first. Either bound may be null.
+CaptureIndex.prototype.frameRange = function(from, to) {
+  var start = (from === null) ? 0 : this.bisect(from);
+  var end = (to === null) ? this.entries.length : this.bisect(to + 1);
+  return this.entries.slice(start, end);
+};
+
+
+// Entries modified at or after time (ms since epoch), oldest first.
+CaptureIndex.prototype.since = function(time) {
+  return this.entries.filter(function(entry) { return entry.mtime >= time; });
+};
+
+
+// First position whose frame is >= frame.
+CaptureIndex.prototype.bisect = function(frame) {
+  var lo = 0;
+  var hi = this.entries.length;
+  while (lo < hi) {
+    var mid = (lo + hi) >>> 1;
+    if (this.entries[mid].frame < frame)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+};
+
+
+CaptureIndex.prototype.insert = function(entry) {
+  var old = this.byName[entry.name];
+  if (old) {
+    if (old.frame === entry.frame) {
+      this.entries[this.indexOf(old)] = entry;
+      this.byName[entry.name] = entry;
+      return;
+    }
+    this.remove(entry.name);
+  }
+  this.byName[entry.name] = entry;
+  // timelapse frames nearly always arrive in order
+  var last = this.latest();
+  if (!last || (entry.frame > last.frame) ||
+      ((entry.frame === last.frame) && (entry.name > last.name))) {
+    this.entries.push(entry);
+  } else {
+    var i = this.bisect(entry.frame);
+    while ((i < this.entries.length) && (this.entries[i].frame === entry.frame) &&
+           (this.entries[i].name < entry.name))
+      i++;
+    this.entries.splice(i, 0, entry);
+  }
+};
+
+
+CaptureIndex.prototype.remove = function(name) {
+  var entry = this.byName[name];
+  if (!entry)
+    return;
+  delete this.byName[name];
+  this.entries.splice(this.indexOf(entry), 1);
+};
+
+
+CaptureIndex.prototype.indexOf = function(entry) {
+  var i = this.bisect(entry.frame);
+  while ((i < this.entries.length) && (this.entries[i] !== entry))
+    i++;
+  return i;
+};
+
+
+CaptureIndex.prototype.log = function(line) {
+  var self = this;
+  this.pendingLines.push(line);
+  if (this.flushTimer)
+    return;
+  // batch journal writes, the SD card does not like one per frame
+  this.flushTimer = setTimeout(function() {
+    self.flushTimer = null;
+    var data = self.pendingLines.join('\n') + '\n';
+    self.journalLines += self.pendingLines.length;
+    self.pendingLines = [];
+    fs.appendFile(self.journal, data, function(err) {
+      if (err)
+        console.log('Failed to write capture index: ' + err);
+    });
+  }, journal_flush_delay);
+};
+
+
+CaptureIndex.prototype.compact = function() {
+  var self = this;
+  var tmp = this.journal + '~';
+  var data = this.entries.map(function(entry) {
+    return '+' + JSON.stringify(entry) + '\n';
+  }).join('');
+  fs.writeFile(tmp, data, function(err) {
+    if (!err)
+      fs.rename(tmp, self.journal, function() {});
+  });
+  this.journalLines = this.entries.length;
+};
+
+
+// Reads GPSLatitude/GPSLongitude/GPSAltitude as written by raspistill -gpsdexif.
+CaptureIndex.prototype.readExifGps = function(entry) {
+  var self = this;
+  fs.open(this.dir + entry.name, 'r', function(err, fd) {
+    if (err)
+      return;
+    var buf = new Buffer(exif_read_length);
+    fs.read(fd, buf, 0, buf.length, 0, function(err, bytesRead) {
+      fs.close(fd, function() {});
+      if (err)
+        return;
+      var gps = parseExifGps(buf.slice(0, bytesRead));
+      if (gps && (self.byName[entry.name] === entry))
+        self.annotate(entry.name, { gps: gps });
+    });
+  });
+};
+
+
+function parseExifGps(buf) {
+  // find the Exif APP1 segment
+  var pos = 2;
+  if ((buf.length < 4) || (buf.readUInt16BE(0) !== 0xFFD8))
+    return null;
+  while (pos + 4 <= buf.length) {
+    var marker = buf.readUInt16BE(pos);
+    var length = buf.readUInt16BE(pos + 2);
+    if ((marker === 0xFFE1) && (buf.toString('ascii', pos + 4, pos + 8) === 'Exif'))
+      break;
+    if ((marker & 0xFF00) !== 0xFF00)
+      return null;
+    pos += 2 + length;
+  }
+  var tiff = pos + 10;
+  if (tiff + 8 > buf.length)
+    return null;
+  var le = buf.toString('ascii', tiff, tiff + 2) === 'II';
+  var u16 = function(off) { return le ? buf.readUInt16LE(tiff + off) : buf.readUInt16BE(tiff + off); };
+  var u32 = function(off) { return le ? buf.readUInt32LE(tiff + off) : buf.readUInt32BE(tiff + off); };
+  var inRange = function(off, len) { return tiff + off + len <= buf.length; };
+
+  var readIfd = function(off) {
+    var tags = {};
+    if (!inRange(off, 2))
+      return tags;
+    var n = u16(off);
+    for (var i = 0; i < n; i++) {
+      var e = off + 2 + i * 12;
+      if (!inRange(e, 12))
+        break;
+      tags[u16(e)] = { type: u16(e + 2), count: u32(e + 4), value: e + 8 };
+    }
+    return tags;
+  };
+  var rationals = function(tag) {
+    var off = u32(tag.value);
+    var values = [];
+    for (var i = 0; i < tag.count; i++) {
+      if (!inRange(off + i * 8, 8))
+        return null;
+      var den = u32(off + i * 8 + 4);
+      values.push(den ? u32(off + i * 8) / den : 0);
+    }
+    return values;
+  };
+  var degrees = function(tag, ref, negative) {
+    var v = tag && rationals(tag);
+    if (!v || (v.length < 3))
+      return null;
+    var deg = v[0] + v[1] / 60 + v[2] / 3600;
+    if (ref && (String.fromCharCode(buf[tiff + ref.value]) === negative))
+      deg = -deg;
+    return deg;
+  };
+
+  var ifd0 = readIfd(u32(4));
+  if (!(0x8825 in ifd0))
+    return null;
+  var gpsIfd = readIfd(u32(ifd0[0x8825].value));
+  var lat = degrees(gpsIfd[2], gpsIfd[1], 'S');
+  var lon = degrees(gpsIfd[4], gpsIfd[3], 'W');
+  if ((lat === null) || (lon === null))
+    return null;
+  var gps = { lat: lat, lon: lon };
+  if (6 in gpsIfd) {
+    var alt = rationals(gpsIfd[6]);
+    if (alt)
+      gps.alt = alt[0];
+  }
+  return gps;
+}
+
+
+module.exports = CaptureIndex;
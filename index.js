@@ -8,16 +8,63 @@ var path = require('path');
 var spawn = require('child_process').spawn;
 var exec = require('child_process').exec;
 var bodyParser = require('body-parser');
+var CaptureIndex = require('./capture_index');
+var Telemetry = require('./telemetry');
 
 var proc;
-var pollTimer;
+var mjpegProc;
+var mjpegReady = false;
+var previewProc;
+var disparityProc;
+var tarStreamProc;
+var previewRequests = {};
+var previewRequestId = 0;
+var captureEmitTimer;
+var lastCaptureEmit = 0;
+var latestStreamImage = null;
 var mode = 'test';
-var prevModTime;
 var stream_dir = '/tmp/';
 var capture_partition = '/storage';
 var capture_dir = capture_partition + '/photos/';
-var streamPollInterval = 5000;
-var capturePollInterval = 20000;
+var stream_image = 'image_stream.jpg';
+var captureNotifyInterval = 20000;
+var imageListPageSize = 60;
+var watchRetryInterval = 5000;
+var mjpeg_stream_bin = path.join(__dirname, 'bin', 'mjpeg_stream');
+var mjpeg_stream_port = 8080;
+var jpeg_preview_bin = path.join(__dirname, 'bin', 'jpeg_preview');
+var preview_dir = '/tmp/previews';
+// preview variants, the largest is the full width of one eye
+var preview_widths = [320, 640, 1280, 2592];
+// Requires raspistill built with raspistill_shm_frame.patch
+var stream_via_shm = false;
+var stream_shm_name = '/rpi-stereo-cam-stream';
+// Live disparity map of the stream frames (file streaming only)
+var stream_disparity = false;
+var stereo_disparity_bin = path.join(__dirname, 'bin', 'stereo_disparity');
+var disparity_image = 'image_disparity.jpg';
+var tar_stream_bin = path.join(__dirname, 'bin', 'tar_stream');
+var tar_stream_port = 8081;
+// Requires raspistill built with raspistill_write_behind.patch
+var capture_write_behind = false;
+var capture_writer_stats = '/tmp/raspistill_writer.stats';
+// Requires raspistill built with raspistill_timing.patch
+var capture_timing = false;
+var capture_timing_log = '/tmp/raspistill_timing.log';
+var capture_timing_summary = '/tmp/raspistill_timing.summary';
+// Requires raspistill built with raspistill_exif_template.patch
+var capture_exif_template = false;
+// Requires raspistill built with raspistill_session_log.patch
+var capture_session_log = false;
+var capture_session_imu = '/tmp/rpi-stereo-cam-sensors.sock';
+var session_query_bin = path.join(__dirname, 'bin', 'session_query');
+// Live attitude, pressure and GPS fix pushed to browsers as binary messages.
+// Requires test_iio_sensors -s (and gpsd for the fix)
+var telemetry_relay = false;
+var telemetry_socket = capture_session_imu;
+var telemetry_max_rate = 30;
+var telemetry;
+var telemetryRate = 0;
 var raspistill_args = {
   "tl"  : 1000,
   "be"  : null,
@@ -36,13 +83,35 @@ var raspistill_args = {
 };
 var stream_args = {
   "q"   : 10,
-  "o"   : stream_dir + "image_stream.jpg"
+  "o"   : stream_dir + stream_image
 };
+if (stream_via_shm) {
+  // frames go to shared memory only, the JPEG on stdout is discarded
+  stream_args = {
+    "q"   : 10,
+    "shm" : stream_shm_name,
+    "o"   : "-"
+  };
+}
 var capture_args = {
   "q"   : 100,
   "ts"  : null,
   "o"   : capture_dir + "image_%d.jpg"
 };
+if (capture_write_behind) {
+  // queue a few frames so a slow SD card flush does not delay the next capture
+  capture_args["wq"] = 4;
+  capture_args["ws"] = 10;
+  capture_args["wst"] = capture_writer_stats;
+}
+if (capture_timing) {
+  capture_args["tmg"] = capture_timing_log;
+  capture_args["tms"] = capture_timing_summary;
+}
+if (capture_exif_template)
+  capture_args["xt"] = null;
+if (capture_session_log)
+  capture_args["imu"] = capture_session_imu;
 
 
 app.use(bodyParser.json());
@@ -102,10 +171,62 @@ app.get('/capture/:file', function(req, res) {
 });
 
 
+// Downscaled copy of a stream or capture image, generated on first request
+// and cached by bin/jpeg_preview. Falls back to the full size image.
+app.get('/preview/:width/:dir/:file', function(req, res) {
+  var dirs = { stream: stream_dir, capture: capture_dir };
+  var width = parseInt(req.params.width, 10);
+  // the name goes into a line of the jpeg_preview protocol
+  if (/[\x00-\x1f\x7f\/]/.test(req.params.file)) {
+    res.status(400);
+    return res.send('Bad file name');
+  }
+  if (!(req.params.dir in dirs) || (preview_widths.indexOf(width) < 0)) {
+    res.status(404);
+    return res.send('File not found');
+  }
+  var static_file = dirs[req.params.dir] + req.params.file;
+  requestPreview(static_file, width, function(err, preview_file) {
+    if (!err)
+      return res.sendfile(preview_file);
+    fs.exists(static_file, function(exists) {
+      if (exists)
+        return res.sendfile(static_file);
+      res.status(404);
+      return res.send('File not found');
+    });
+  });
+});
+
+
+// Served by bin/tar_stream when available, which supports resuming with
+// Range requests. since=<frame|unix time> limits the archive to new images,
+// until=<frame> to the images up to that frame.
 app.get('/download', function(req, res) {
+  var query = req.url.indexOf('?') >= 0 ? req.url.substr(req.url.indexOf('?')) : '';
+  if (tarStreamProc) {
+    var host = (req.headers.host || 'localhost').split(':')[0];
+    return res.redirect('http://' + host + ':' + tar_stream_port + '/download' + query);
+  }
+  var since = parseInt(req.query.since, 10);
+  var until = parseInt(req.query.until, 10);
+  var included = null;
+  if (!isNaN(since) || !isNaN(until)) {
+    included = {};
+    var images;
+    if (since >= 1000000000) {
+      images = captureIndex.since(since * 1000 + 1000);
+      if (!isNaN(until))
+        images = images.filter(function(entry) { return entry.frame <= until; });
+    } else {
+      images = captureIndex.frameRange(isNaN(since) ? null : since + 1, isNaN(until) ? null : until);
+    }
+    images.forEach(function(entry) { included[entry.name] = true; });
+  }
   var pack = tar.pack(capture_dir, {
     ignore: function(name) {
-      return name.substr(-4) !== '.jpg';
+      var base = path.basename(name);
+      return (base.substr(-4) !== '.jpg') || (included && !(base in included));
     }
   });
   var d = new Date().toISOString().slice(0, 19).replace(/[-T:]/g, "");
@@ -116,13 +237,76 @@ app.get('/download', function(req, res) {
 });
 
 
+app.get('/timing', function(req, res) {
+  // lateness and latency histograms of the current capture
+  fs.readFile(capture_timing_summary, 'utf8', function(err, data) {
+    if (err)
+      return res.status(404).send('No capture timing available\n');
+    res.setHeader('content-type', 'text/plain');
+    res.send(data);
+  });
+});
+
+
+app.get('/session', function(req, res) {
+  // ?from=&to= (unix time), ?first=&last= (frame), ?bbox=south,west,north,east
+  var args = ['-j'];
+  var isNum = function(v) { return (v !== undefined) && !isNaN(parseFloat(v)); };
+  if (isNum(req.query.from) || isNum(req.query.to))
+    args.push('-t', (parseFloat(req.query.from) || 0) + (isNum(req.query.to) ? ',' + parseFloat(req.query.to) : ''));
+  if (isNum(req.query.first) || isNum(req.query.last))
+    args.push('-f', (parseInt(req.query.first, 10) || 0) + (isNum(req.query.last) ? ',' + parseInt(req.query.last, 10) : ''));
+  if (req.query.bbox) {
+    var box = String(req.query.bbox).split(',').map(parseFloat);
+    if ((box.length !== 4) || box.some(isNaN))
+      return res.status(400).send('bbox is south,west,north,east\n');
+    args.push('-b', box.join(','));
+  }
+  fs.readdir(capture_dir, function(err, files) {
+    var logs = (files || []).filter(function(file) {
+      return /^session_.*\.log$/.test(file);
+    }).sort().map(function(file) { return capture_dir + file; });
+    res.setHeader('content-type', 'application/x-ndjson');
+    if (!logs.length)
+      return res.end();
+    var query = spawn(session_query_bin, args.concat(logs),
+                      { stdio: ['ignore', 'pipe', 'inherit'] });
+    query.on('error', function(err) {
+      console.log('Failed to run session_query: ' + err);
+      res.end();
+    });
+    query.stdout.pipe(res);
+  });
+});
+
+
 app.get('/', function(req, res) {
   res.sendfile(__dirname + '/index.html');
 });
 
 
 exec("kill `pidof raspistill`");
+exec("kill `pidof mjpeg_stream`");
+exec("kill `pidof jpeg_preview`");
+exec("kill `pidof stereo_disparity`");
+exec("kill `pidof tar_stream`");
 process.on('exit', killChild);
+process.on('exit', stopMjpegStream);
+process.on('exit', stopDisparity);
+process.on('exit', stopPreviewGenerator);
+process.on('exit', stopTarStream);
+startPreviewGenerator();
+startTarStream();
+
+var captureIndex = new CaptureIndex(capture_dir);
+captureIndex.on('add', on_capture_added);
+watchDirectory(stream_dir, on_stream_file);
+watchDirectory(capture_dir, function(filename) { captureIndex.update(filename); });
+
+if (telemetry_relay) {
+  telemetry = new Telemetry(telemetry_socket, { gpsd: true, retryInterval: watchRetryInterval });
+  telemetry.on('update', emit_telemetry);
+}
 
 var sockets = {};
 io.on('connection', function(socket) {
@@ -131,12 +315,19 @@ io.on('connection', function(socket) {
 
   socket.on('disconnect', function() {
     delete sockets[socket.id];
+    update_telemetry_rate();
 
     console.log("Total clients connected : ", numClients());
     if (numClients() === 0) {
       stopStreaming();
     }
   });
+  socket.on('viewport', function(width) {
+    socket.viewportWidth = parseInt(width, 10) || 0;
+  });
+  socket.on('telemetry', function(rate) {
+    set_telemetry_rate(socket, rate);
+  });
   socket.on('start-stream', function() {
     startStreaming(socket);
   });
@@ -150,9 +341,11 @@ io.on('connection', function(socket) {
   });
   socket.on('images', function(data) {
     if (data === 'ls')
-      listImages();
+      listImages({}, socket);
     else if (data === 'rm')
       deleteImages();
+    else if (data && (data.cmd === 'ls'))
+      listImages(data, socket);
   });
 });
 
@@ -163,43 +356,60 @@ http.listen(3000, function() {
 
 
 function emit_latest_image(socket) {
-  emit_mode();
-  if (mode === 'test') {
-    fs.readdir(stream_dir, function(err, files) {
-      if (!err) {
-        var latest = files.filter(function(file) { return file === 'image_stream.jpg'; }).pop();
-        if (latest) {
-          var currModTime = fs.statSync(stream_dir + latest).mtime.getTime();
-          if (currModTime != prevModTime) {
-            prevModTime = currModTime;
-            if (socket)
-              io.to(socket.id).emit('liveStream', 'stream/'+latest+'?_t=' + (Math.random() * 100000));
-            else
-              io.sockets.emit('liveStream', 'stream/'+latest+'?_t=' + (Math.random() * 100000));
-          }
-        }
-      }
-    });
-  } else if (mode === 'capture') {
-    fs.readdir(capture_dir, function(err, files) {
-      if (!err) {
-        var latest = files.filter(function(file) { return file.substr(-4) === '.jpg'; }).sort().pop();
-        if (latest) {
-          var currModTime = fs.statSync(capture_dir + latest).mtime.getTime();
-          if (currModTime != prevModTime) {
-            prevModTime = currModTime;
-            if (socket)
-              io.to(socket.id).emit('liveStream', 'capture/'+latest+'?_t=' + (Math.random() * 100000));
-            else
-              io.sockets.emit('liveStream', 'capture/'+latest+'?_t=' + (Math.random() * 100000));
-          }
-        }
-      }
-    });
+  emit_mode(socket);
+  if ((mode === 'test') && mjpegReady) {
+    emit_mjpeg_stream(socket);
+  } else if ((mode === 'test') && latestStreamImage) {
+    emit_live_image('stream', latestStreamImage, socket);
+  } else if ((mode === 'capture') && captureIndex.latest()) {
+    emit_live_image('capture', captureIndex.latest(), socket);
   }
 }
 
 
+// Each client gets the smallest preview variant that covers its viewport.
+function emit_live_image(dir, image, socket) {
+  var targets = socket ? [socket] : Object.keys(sockets).map(function(id) { return sockets[id]; });
+  targets.forEach(function(s) {
+    var url = dir + '/' + image.name;
+    var width = previewWidth(s.viewportWidth);
+    if (previewProc && width)
+      url = 'preview/' + width + '/' + url;
+    io.to(s.id).emit('liveStream', url + '?_t=' + image.mtime);
+  });
+}
+
+
+function previewWidth(viewport_width) {
+  if (!viewport_width)
+    return preview_widths[1];
+  for (var i = 0; i < preview_widths.length; i++) {
+    if (preview_widths[i] >= viewport_width)
+      return preview_widths[i];
+  }
+  // full resolution requested
+  return 0;
+}
+
+
+function emit_mjpeg_stream(socket) {
+  var stream = { port: mjpeg_stream_port, path: '/stream.mjpg' };
+  if (socket)
+    io.to(socket.id).emit('mjpegStream', stream);
+  else
+    io.sockets.emit('mjpegStream', stream);
+}
+
+
+function emit_disparity(seq, socket) {
+  var url = 'stream/' + disparity_image + '?_t=' + seq;
+  if (socket)
+    io.to(socket.id).emit('disparity', url);
+  else
+    io.sockets.emit('disparity', url);
+}
+
+
 function emit_mode(socket) {
   if (socket)
     io.to(socket.id).emit('mode', mode);
@@ -208,6 +418,55 @@ function emit_mode(socket) {
 }
 
 
+// The sensor stream is subscribed at the fastest rate any client asked for.
+// Each update is packed once and the same message goes to every client that
+// is due one at its own rate. A client whose last message has not been
+// written out yet is skipped, it gets the next update instead of a backlog.
+function emit_telemetry() {
+  var now = Date.now();
+  var slack = telemetryRate ? 250 / telemetryRate : 0;
+  var message = null;
+  Object.keys(sockets).forEach(function(id) {
+    var s = sockets[id];
+    if (!s.telemetryRate || (now + slack < s.telemetryDue) || !socket_drained(s))
+      return;
+    message = message || telemetry.encode();
+    s.emit('telemetry', message);
+    s.telemetryDue = Math.max(s.telemetryDue, now - slack) + 1000 / s.telemetryRate;
+  });
+}
+
+
+function socket_drained(socket) {
+  var conn = socket.conn;
+  return conn && conn.transport && conn.transport.writable &&
+         !(conn.writeBuffer && conn.writeBuffer.length);
+}
+
+
+function set_telemetry_rate(socket, rate) {
+  if (!telemetry)
+    return;
+  socket.telemetryRate = Math.max(0, Math.min(parseInt(rate, 10) || 0, telemetry_max_rate));
+  socket.telemetryDue = 0;
+  update_telemetry_rate();
+}
+
+
+function update_telemetry_rate() {
+  if (!telemetry)
+    return;
+  var rate = 0;
+  Object.keys(sockets).forEach(function(id) {
+    rate = Math.max(rate, sockets[id].telemetryRate || 0);
+  });
+  if (rate !== telemetryRate) {
+    telemetryRate = rate;
+    telemetry.setRate(rate);
+  }
+}
+
+
 function emit_cam_config(socket) {
   if (socket)
     io.to(socket.id).emit('current-cam-config', raspistill_args);
@@ -216,10 +475,12 @@ function emit_cam_config(socket) {
 }
 
 
-function emit_image_list(images, socket) {
+function emit_image_list(page, socket) {
   var image_list = {};
   image_list.dir = 'capture';
-  image_list.images = images;
+  image_list.images = page.images.map(function(entry) { return entry.name; });
+  image_list.total = page.total;
+  image_list.offset = page.offset;
   if (socket)
     io.to(socket.id).emit('image-list', image_list);
   else
@@ -261,6 +522,12 @@ function serializeRaspistillArgs(optional_args) {
 }
 
 
+function spawnRaspistill(optional_args) {
+  return spawn('raspistill', serializeRaspistillArgs(optional_args),
+               { stdio: ['ignore', 'ignore', 'ignore'] });
+}
+
+
 function update_cam_config(new_config) {
   if (mode === 'test') {
     var different = false;
@@ -274,7 +541,7 @@ function update_cam_config(new_config) {
       console.log(JSON.stringify(serializeRaspistillArgs(stream_args)));
       emit_cam_config();
       killChild();
-      proc = spawn('raspistill', serializeRaspistillArgs(stream_args));
+      proc = spawnRaspistill(stream_args);
     }
   } else {
     responseString = 'Not allowed';
@@ -286,17 +553,20 @@ function start_stop_capture(action) {
   if ((action === 'start') && (mode === 'test')) {
     console.log('Capturing ...');
     killChild();
+    if (capture_session_log)
+      capture_args["sl"] = capture_dir + 'session_' +
+        new Date().toISOString().slice(0, 19).replace(/[-T:]/g, "") + '.log';
     console.log(JSON.stringify(serializeRaspistillArgs(capture_args)));
-    proc = spawn('raspistill', serializeRaspistillArgs(capture_args));
+    proc = spawnRaspistill(capture_args);
     mode = 'capture';
   } else if ((action === 'stop') && (mode === 'capture')) {
     console.log('Stopped capturing');
     killChild();
     console.log(JSON.stringify(serializeRaspistillArgs(stream_args)));
-    proc = spawn('raspistill', serializeRaspistillArgs(stream_args));
+    proc = spawnRaspistill(stream_args);
     mode = 'test';
   }
-  emit_mode();
+  emit_latest_image();
 }
 
 
@@ -321,15 +591,24 @@ function diskfree(drive, callback) {
 }
 
 
-function listImages() {
-  fs.readdir(capture_dir, function(err, files) {
-    if (!err) {
-      var images = files.filter(function(file) { return file.substr(-4) === '.jpg'; }).sort();
-      if (images)
-        emit_image_list(images);
-    }
-  });
-  emit_diskfree();
+// Newest first, one page at a time: { offset, limit } or { from, to } frames.
+function listImages(query, socket) {
+  var page;
+  var offset = parseInt(query.offset, 10) || 0;
+  var limit = Math.min(parseInt(query.limit, 10) || imageListPageSize, 1000);
+  if (('from' in query) || ('to' in query)) {
+    // paged the same way as the whole index, newest first
+    var images = captureIndex.frameRange(
+      ('from' in query) ? parseInt(query.from, 10) : null,
+      ('to' in query) ? parseInt(query.to, 10) : null);
+    offset = Math.max(0, Math.min(offset, images.length));
+    page = { total: images.length, offset: offset,
+             images: images.reverse().slice(offset, offset + limit) };
+  } else {
+    page = captureIndex.page(offset, limit);
+  }
+  emit_image_list(page, socket);
+  emit_diskfree(socket);
 }
 
 
@@ -360,7 +639,8 @@ function deleteImages(){
             if (err) {
               console.log(err);
             } else {
-              emit_image_list([]);
+              captureIndex.clear();
+              emit_image_list(captureIndex.page(0, 0));
               emit_diskfree();
             }
           });
@@ -383,15 +663,186 @@ function killChild() {
 }
 
 
+function startMjpegStream() {
+  if (mjpegProc)
+    return;
+  var args = ['-p', mjpeg_stream_port];
+  if (stream_via_shm)
+    args = args.concat(['-m', stream_shm_name]);
+  else
+    args = args.concat(['-d', stream_dir, '-f', stream_image]);
+  mjpegProc = spawn(mjpeg_stream_bin, args, { stdio: ['ignore', 'pipe', 'inherit'] });
+  mjpegProc.on('error', function(err) {
+    console.log('MJPEG streamer not available, polling for frames');
+    mjpegProc = null;
+    mjpegReady = false;
+  });
+  mjpegProc.on('exit', function() {
+    mjpegProc = null;
+    mjpegReady = false;
+  });
+  // frame ready hook: "frame <seq> <size>" per frame
+  var pending = '';
+  mjpegProc.stdout.on('data', function(data) {
+    pending += data.toString();
+    var lines = pending.split('\n');
+    pending = lines.pop();
+    if (lines.length && !mjpegReady) {
+      mjpegReady = true;
+      if (mode === 'test')
+        emit_mjpeg_stream();
+    }
+  });
+}
+
+
+// bin/jpeg_preview reads "<id> <width> <path>" requests on stdin and
+// answers "<id> ok <preview path>" or "<id> error <message>" on stdout.
+function startPreviewGenerator() {
+  if (previewProc)
+    return;
+  previewProc = spawn(jpeg_preview_bin, ['-d', preview_dir], { stdio: ['pipe', 'pipe', 'inherit'] });
+  previewProc.on('error', function(err) {
+    console.log('JPEG preview generator not available, serving full size images');
+    previewProc = null;
+    failPreviewRequests();
+  });
+  previewProc.on('exit', function() {
+    previewProc = null;
+    failPreviewRequests();
+  });
+  // EPIPE once it has died, which would otherwise be thrown
+  previewProc.stdin.on('error', function(err) {
+    failPreviewRequests();
+  });
+  var pending = '';
+  previewProc.stdout.on('data', function(data) {
+    pending += data.toString();
+    var lines = pending.split('\n');
+    pending = lines.pop();
+    lines.forEach(function(line) {
+      var m = line.match(/^(\d+) (ok|error) (.*)$/);
+      if (!m || !(m[1] in previewRequests))
+        return;
+      var callback = previewRequests[m[1]];
+      delete previewRequests[m[1]];
+      if (m[2] === 'ok')
+        callback(null, m[3]);
+      else
+        callback(new Error(m[3]));
+    });
+  });
+}
+
+
+function stopPreviewGenerator() {
+  if (previewProc) {
+    previewProc.kill();
+    previewProc = null;
+  }
+}
+
+
+function failPreviewRequests() {
+  var requests = previewRequests;
+  previewRequests = {};
+  Object.keys(requests).forEach(function(id) {
+    requests[id](new Error('preview generator exited'));
+  });
+}
+
+
+function requestPreview(file, width, callback) {
+  if (!previewProc)
+    return callback(new Error('preview generator not running'));
+  if (/[\x00-\x1f\x7f]/.test(file))
+    return callback(new Error('bad file name'));
+  var id = ++previewRequestId;
+  previewRequests[id] = callback;
+  previewProc.stdin.write(id + ' ' + width + ' ' + file + '\n');
+}
+
+
+// bin/stereo_disparity prints "disparity <seq> <ms>" for every map it writes
+function startDisparity() {
+  if (disparityProc || !stream_disparity || stream_via_shm)
+    return;
+  // stderr gets a line for every frame that fails to decode, and an unread
+  // pipe would block the engine once full
+  disparityProc = spawn(stereo_disparity_bin,
+                        ['-d', stream_dir, '-f', stream_image, '-o', stream_dir + disparity_image],
+                        { stdio: ['ignore', 'pipe', 'ignore'] });
+  disparityProc.on('error', function(err) {
+    console.log('Stereo disparity engine not available');
+    disparityProc = null;
+  });
+  disparityProc.on('exit', function() {
+    disparityProc = null;
+  });
+  var pending = '';
+  disparityProc.stdout.on('data', function(data) {
+    pending += data.toString();
+    var lines = pending.split('\n');
+    pending = lines.pop();
+    if (lines.length && (mode === 'test')) {
+      var m = lines[lines.length - 1].match(/^disparity (\d+)/);
+      if (m)
+        emit_disparity(m[1]);
+    }
+  });
+}
+
+
+function stopDisparity() {
+  if (disparityProc) {
+    disparityProc.kill();
+    disparityProc = null;
+  }
+}
+
+
+function startTarStream() {
+  if (tarStreamProc)
+    return;
+  tarStreamProc = spawn(tar_stream_bin, ['-d', capture_dir, '-p', tar_stream_port],
+                        { stdio: ['ignore', 'ignore', 'inherit'] });
+  tarStreamProc.on('error', function(err) {
+    console.log('Archive server not available, downloads are not resumable');
+    tarStreamProc = null;
+  });
+  tarStreamProc.on('exit', function() {
+    tarStreamProc = null;
+  });
+}
+
+
+function stopTarStream() {
+  if (tarStreamProc) {
+    tarStreamProc.kill();
+    tarStreamProc = null;
+  }
+}
+
+
+function stopMjpegStream() {
+  if (mjpegProc) {
+    mjpegProc.kill();
+    mjpegProc = null;
+  }
+  mjpegReady = false;
+}
+
+
 function stopStreaming() {
   if (Object.keys(sockets).length == 0) {
-    if (pollTimer) {
-      console.log('stop poll timer');
-      clearInterval(pollTimer);
-      pollTimer = null;
+    if (captureEmitTimer) {
+      clearTimeout(captureEmitTimer);
+      captureEmitTimer = null;
     }
     if (mode === 'test') {
       killChild();
+      stopMjpegStream();
+      stopDisparity();
       app.set('pollDir', false);
     }
   }
@@ -404,23 +855,76 @@ function startStreaming(socket) {
     emit_mode(socket);
     emit_cam_config(socket);
     emit_latest_image(socket);
-    if (!pollTimer) {
-      console.log('start poll timer');
-      if (mode === 'capture')
-        pollTimer = setInterval(emit_latest_image, capturePollInterval);
-      else if (mode === 'test')
-        pollTimer = setInterval(emit_latest_image, streamPollInterval);
-    }
     return;
   }
 
   // start new poll
   app.set('pollDir', true);
   mode = 'test';
-  proc = spawn('raspistill', serializeRaspistillArgs(stream_args));
+  startMjpegStream();
+  startDisparity();
+  proc = spawnRaspistill(stream_args);
 
-  console.log('Polling directories for changes...');
-  pollTimer = setInterval(emit_latest_image, streamPollInterval);
   emit_mode();
   emit_cam_config();
 }
+
+
+// Frame discovery is driven by inotify (fs.watch) events on the stream and
+// capture directories rather than by rescanning them.
+function watchDirectory(dir, onFile) {
+  var watcher;
+  var retry = function() {
+    setTimeout(function() { watchDirectory(dir, onFile); }, watchRetryInterval);
+  };
+  try {
+    watcher = fs.watch(dir, function(event, filename) {
+      if (filename)
+        onFile(filename);
+    });
+  } catch (err) {
+    console.log('Unable to watch ' + dir + ', retrying');
+    retry();
+    return;
+  }
+  watcher.on('error', function() {
+    watcher.close();
+    retry();
+  });
+}
+
+
+function on_stream_file(filename) {
+  if (filename !== stream_image)
+    return;
+  fs.stat(stream_dir + filename, function(err, stats) {
+    if (err)
+      return;
+    var mtime = stats.mtime.getTime();
+    if (latestStreamImage && (latestStreamImage.mtime === mtime))
+      return;
+    latestStreamImage = { name: filename, mtime: mtime };
+    if (app.get('pollDir') && (mode === 'test') && !mjpegReady)
+      emit_latest_image();
+  });
+}
+
+
+function on_capture_added(entry) {
+  if ((entry === captureIndex.latest()) && app.get('pollDir') && (mode === 'capture'))
+    schedule_capture_emit();
+}
+
+
+// Full resolution captures are large, so rate limit how often they are
+// pushed to browsers while still reacting to the first new frame at once.
+function schedule_capture_emit() {
+  if (captureEmitTimer)
+    return;
+  var wait = Math.max(0, lastCaptureEmit + captureNotifyInterval - Date.now());
+  captureEmitTimer = setTimeout(function() {
+    captureEmitTimer = null;
+    lastCaptureEmit = Date.now();
+    emit_latest_image();
+  }, wait);
+}
@@ -0,0 +1,659 @@
+/*
+ * JPEG preview generator.
+ *
+ * Produces reduced size copies of captured and streamed JPEGs so browsers do
+ * not have to download full size 5184x1944 side-by-side frames just to show
+ * them on screen. Decoding uses libjpeg DCT domain scaling (1/2, 1/4, 1/8),
+ * which skips most of the IDCT work, followed by a box filter down to the
+ * exact requested width.
+ *
+ * Requests are read from stdin, one per line:
+ *
+ *     <id> <width> <source path>
+ *
+ * and answered on stdout, in completion order, with:
+ *
+ *     <id> ok <preview path>
+ *     <id> error <message>
+ *
+ * Previews are cached in the cache directory under a name derived from the
+ * source name, its mtime and the width, so a rewritten source (e.g. the live
+ * stream image) never returns a stale preview. Older previews of the same
+ * source and width are removed once a new one is written. Requests are served by a pool
+ * of worker threads; identical requests in flight are merged.
+ *
+ * The cache is capped at -m MB: when a new preview takes it over, the least
+ * recently used previews are removed until it is down to three quarters of
+ * the cap. A cache hit touches the preview's mtime to mark it used.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+
+
+#define MAX_WORKERS             8
+#define MAX_MERGED_REQUESTS     16
+#define MAX_LINE_LENGTH         4096
+#define MIN_WIDTH               16
+#define MAX_WIDTH               8192
+#define CACHE_ENTRIES_STEP      256
+
+
+struct job
+{
+    char *source;
+    int width;
+    char *cache_path;
+    char *ids[MAX_MERGED_REQUESTS];
+    int num_ids;
+    int in_progress;
+    struct job *next;
+};
+
+
+struct cache_entry
+{
+    char *name;
+    off_t size;
+    struct timespec mtime;
+};
+
+
+struct jpeg_error_handler
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+
+
+static const char *progname = "";
+static const char *cache_dir = "/tmp/previews";
+static int quality = 75;
+static int num_workers = 0;
+static int terminated = 0;
+static long cache_max_mb = 64;
+static off_t cache_bytes = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct job *queue_head = NULL;
+
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_error_handler *err = (struct jpeg_error_handler *)cinfo->err;
+    longjmp(err->setjmp_buffer, 1);
+}
+
+
+/*
+ * Pick the largest DCT scale denominator that still decodes at least
+ * target_width pixels wide.
+ */
+static int dct_scale_denom(int source_width, int target_width)
+{
+    int denom = 8;
+    while ((denom > 1) && ((source_width + denom - 1) / denom < target_width))
+        denom /= 2;
+    return denom;
+}
+
+
+/*
+ * Box filter one row of packed pixels down to out_width. Each output pixel
+ * averages the input pixels that fall within its footprint.
+ */
+static void downscale_row(const JSAMPLE *in, int in_width,
+                          unsigned int *acc, int out_width, int components)
+{
+    int x;
+    for (x = 0; x < out_width; x++)
+    {
+        int x0 = x * in_width / out_width;
+        int x1 = (x + 1) * in_width / out_width;
+        int c;
+        if (x1 <= x0)
+            x1 = x0 + 1;
+        for (c = 0; c < components; c++)
+        {
+            unsigned int sum = 0;
+            int i;
+            for (i = x0; i < x1; i++)
+                sum += in[i * components + c];
+            acc[x * components + c] += sum / (x1 - x0);
+        }
+    }
+}
+
+
+static int make_preview(const char *source, const char *dest, int width)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_handler jerr;
+    FILE *in = NULL;
+    // modified after setjmp, so must not live in registers
+    FILE * volatile out = NULL;
+    JSAMPLE * volatile row = NULL;
+    JSAMPLE * volatile out_row = NULL;
+    unsigned int * volatile acc = NULL;
+    char *tmp_path = NULL;
+    volatile int ret = -1;
+
+    in = fopen(source, "rb");
+    if (in == NULL)
+        return -errno;
+    if (asprintf(&tmp_path, "%s.%d.tmp", dest, (int)pthread_self()) < 0)
+    {
+        fclose(in);
+        return -ENOMEM;
+    }
+
+    dinfo.err = jpeg_std_error(&jerr.pub);
+    cinfo.err = &jerr.pub;
+    jerr.pub.error_exit = jpeg_error_exit;
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+    if (setjmp(jerr.setjmp_buffer))
+        goto error_ret;
+
+    jpeg_stdio_src(&dinfo, in);
+    jpeg_read_header(&dinfo, TRUE);
+    if (width > dinfo.image_width)
+        width = dinfo.image_width;
+    dinfo.scale_num = 1;
+    dinfo.scale_denom = dct_scale_denom(dinfo.image_width, width);
+    dinfo.dct_method = JDCT_IFAST;
+    dinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&dinfo);
+
+    int in_width = dinfo.output_width;
+    int in_height = dinfo.output_height;
+    int components = dinfo.output_components;
+    int height = (int)((long)in_height * width / in_width);
+    if (height < 1)
+        height = 1;
+
+    row = malloc(in_width * components);
+    out_row = malloc(width * components);
+    acc = calloc(width * components, sizeof(unsigned int));
+    if (!row || !out_row || !acc)
+        goto error_ret;
+
+    out = fopen(tmp_path, "wb");
+    if (out == NULL)
+        goto error_ret;
+    jpeg_stdio_dest(&cinfo, out);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = components;
+    cinfo.in_color_space = dinfo.out_color_space;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    int y = 0;
+    int rows_in_acc = 0;
+    while (dinfo.output_scanline < dinfo.output_height)
+    {
+        JSAMPROW rows[1] = { row };
+        int in_y = dinfo.output_scanline;
+        jpeg_read_scanlines(&dinfo, rows, 1);
+        downscale_row(row, in_width, acc, width, components);
+        rows_in_acc++;
+        // emit an output row once the input rows of its footprint are in
+        if (((long)(in_y + 1) * height / in_height > y) || (in_y + 1 == in_height))
+        {
+            int i;
+            for (i = 0; i < width * components; i++)
+            {
+                out_row[i] = acc[i] / rows_in_acc;
+                acc[i] = 0;
+            }
+            rows_in_acc = 0;
+            JSAMPROW orows[1] = { out_row };
+            if (y < height)
+                jpeg_write_scanlines(&cinfo, orows, 1);
+            y++;
+        }
+    }
+    // pad in case rounding left us short
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW orows[1] = { out_row };
+        jpeg_write_scanlines(&cinfo, orows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_finish_decompress(&dinfo);
+
+    if (fclose(out) == 0)
+    {
+        out = NULL;
+        if (rename(tmp_path, dest) == 0)
+            ret = 0;
+    }
+
+error_ret:
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+    if (out)
+        fclose(out);
+    if (ret != 0)
+        unlink(tmp_path);
+    fclose(in);
+    free(tmp_path);
+    free(row);
+    free(out_row);
+    free(acc);
+    return ret;
+}
+
+
+static char *preview_path(const char *source, const struct timespec *mtime, int width)
+{
+    const char *base = strrchr(source, '/');
+    char *path;
+
+    base = base ? base + 1 : source;
+    if (asprintf(&path, "%s/%s.%ld%09ld.%d.jpg", cache_dir, base,
+                 (long)mtime->tv_sec, (long)mtime->tv_nsec, width) < 0)
+        return NULL;
+    return path;
+}
+
+
+/* Remove cached previews of source at width other than keep_path. */
+static void remove_stale_previews(const char *source, const char *keep_path, int width)
+{
+    const char *base = strrchr(source, '/');
+    const char *keep = strrchr(keep_path, '/');
+    char suffix[32];
+    struct dirent *ent;
+    DIR *dir;
+
+    base = base ? base + 1 : source;
+    keep = keep ? keep + 1 : keep_path;
+    snprintf(suffix, sizeof(suffix), ".%d.jpg", width);
+
+    dir = opendir(cache_dir);
+    if (dir == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        size_t base_len = strlen(base);
+        size_t name_len = strlen(ent->d_name);
+        size_t suffix_len = strlen(suffix);
+        const char *p;
+
+        if ((name_len <= base_len + 1 + suffix_len) ||
+            (strncmp(ent->d_name, base, base_len) != 0) ||
+            (ent->d_name[base_len] != '.') ||
+            (strcmp(ent->d_name + name_len - suffix_len, suffix) != 0) ||
+            (strcmp(ent->d_name, keep) == 0))
+            continue;
+        // only the mtime may sit between the base name and the suffix
+        for (p = ent->d_name + base_len + 1; p < ent->d_name + name_len - suffix_len; p++)
+        {
+            if ((*p < '0') || (*p > '9'))
+                break;
+        }
+        if (p == ent->d_name + name_len - suffix_len)
+            unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+    closedir(dir);
+}
+
+
+static int compare_cache_entries(const void *a, const void *b)
+{
+    const struct cache_entry *ea = a;
+    const struct cache_entry *eb = b;
+
+    if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+        return (ea->mtime.tv_sec < eb->mtime.tv_sec) ? -1 : 1;
+    if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+        return (ea->mtime.tv_nsec < eb->mtime.tv_nsec) ? -1 : 1;
+    return 0;
+}
+
+
+/*
+ * Sum the previews in the cache and, if they exceed the cap, remove the
+ * least recently used down to three quarters of it. Sets cache_bytes,
+ * called with cache_lock held.
+ */
+static void trim_cache(void)
+{
+    const off_t max_bytes = (off_t)cache_max_mb * 1024 * 1024;
+    struct cache_entry *entries = NULL;
+    int num_entries = 0;
+    int max_entries = 0;
+    struct dirent *ent;
+    off_t total = 0;
+    DIR *dir;
+    int i;
+
+    dir = opendir(cache_dir);
+    if (dir == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        struct stat st;
+
+        // in progress previews end in .tmp and are left alone
+        if ((len < 5) || (strcmp(ent->d_name + len - 4, ".jpg") != 0))
+            continue;
+        if ((fstatat(dirfd(dir), ent->d_name, &st, 0) != 0) || !S_ISREG(st.st_mode))
+            continue;
+        total += st.st_size;
+        if (num_entries == max_entries)
+        {
+            struct cache_entry *grown;
+            grown = realloc(entries, (max_entries + CACHE_ENTRIES_STEP) * sizeof(struct cache_entry));
+            if (grown == NULL)
+                break;
+            entries = grown;
+            max_entries += CACHE_ENTRIES_STEP;
+        }
+        entries[num_entries].name = strdup(ent->d_name);
+        if (entries[num_entries].name == NULL)
+            break;
+        entries[num_entries].size = st.st_size;
+        entries[num_entries].mtime = st.st_mtim;
+        num_entries++;
+    }
+
+    if (total > max_bytes)
+    {
+        qsort(entries, num_entries, sizeof(struct cache_entry), compare_cache_entries);
+        for (i = 0; (i < num_entries) && (total > max_bytes / 4 * 3); i++)
+        {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0)
+                total -= entries[i].size;
+        }
+    }
+    closedir(dir);
+    for (i = 0; i < num_entries; i++)
+        free(entries[i].name);
+    free(entries);
+    cache_bytes = total;
+}
+
+
+/* Account for a new preview, trimming the cache if it is now over the cap. */
+static void add_to_cache(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    cache_bytes += st.st_size;
+    // stale previews removed since the last scan are still counted, so
+    // this may scan early but never misses going over
+    if (cache_bytes > (off_t)cache_max_mb * 1024 * 1024)
+        trim_cache();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+static void reply(struct job *job, const char *status, const char *message)
+{
+    int i;
+
+    pthread_mutex_lock(&output_lock);
+    for (i = 0; i < job->num_ids; i++)
+        fprintf(stdout, "%s %s %s\n", job->ids[i], status, message);
+    fflush(stdout);
+    pthread_mutex_unlock(&output_lock);
+}
+
+
+static void free_job(struct job *job)
+{
+    int i;
+    for (i = 0; i < job->num_ids; i++)
+        free(job->ids[i]);
+    free(job->source);
+    free(job->cache_path);
+    free(job);
+}
+
+
+static void *worker_thread(void *arg)
+{
+    while (1)
+    {
+        struct job *job;
+
+        pthread_mutex_lock(&queue_lock);
+        while (!terminated)
+        {
+            for (job = queue_head; job != NULL; job = job->next)
+            {
+                if (!job->in_progress)
+                    break;
+            }
+            if (job)
+                break;
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        if (terminated)
+        {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        job->in_progress = 1;
+        pthread_mutex_unlock(&queue_lock);
+
+        int ret = make_preview(job->source, job->cache_path, job->width);
+
+        // unlink from the queue before replying so no new ids get merged in
+        pthread_mutex_lock(&queue_lock);
+        struct job **pp;
+        for (pp = &queue_head; *pp != job; pp = &(*pp)->next)
+            ;
+        *pp = job->next;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (ret == 0)
+        {
+            remove_stale_previews(job->source, job->cache_path, job->width);
+            add_to_cache(job->cache_path);
+            reply(job, "ok", job->cache_path);
+        }
+        else
+            reply(job, "error", "preview failed");
+        free_job(job);
+    }
+    return NULL;
+}
+
+
+static void handle_request(char *line)
+{
+    char *id;
+    char *width_str;
+    char *source;
+    char *saveptr = NULL;
+    struct stat st;
+    struct job *job;
+    struct job single = { .num_ids = 1 };
+    int width;
+
+    id = strtok_r(line, " ", &saveptr);
+    width_str = strtok_r(NULL, " ", &saveptr);
+    source = strtok_r(NULL, "\n", &saveptr);
+    if (!id || !width_str || !source)
+        return;
+
+    single.ids[0] = id;
+    width = atoi(width_str);
+    if ((width < MIN_WIDTH) || (width > MAX_WIDTH))
+    {
+        reply(&single, "error", "bad width");
+        return;
+    }
+    if (stat(source, &st) != 0)
+    {
+        reply(&single, "error", "not found");
+        return;
+    }
+
+    char *cache_path = preview_path(source, &st.st_mtim, width);
+    if (cache_path == NULL)
+    {
+        reply(&single, "error", "out of memory");
+        return;
+    }
+    if (access(cache_path, R_OK) == 0)
+    {
+        // mark it recently used for the cache cap
+        utimensat(AT_FDCWD, cache_path, NULL, 0);
+        reply(&single, "ok", cache_path);
+        free(cache_path);
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    for (job = queue_head; job != NULL; job = job->next)
+    {
+        if ((strcmp(job->cache_path, cache_path) == 0) &&
+            (job->num_ids < MAX_MERGED_REQUESTS))
+        {
+            job->ids[job->num_ids++] = strdup(id);
+            pthread_mutex_unlock(&queue_lock);
+            free(cache_path);
+            return;
+        }
+    }
+    job = calloc(1, sizeof(struct job));
+    if (job == NULL)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        free(cache_path);
+        reply(&single, "error", "out of memory");
+        return;
+    }
+    job->source = strdup(source);
+    job->width = width;
+    job->cache_path = cache_path;
+    job->ids[0] = strdup(id);
+    job->num_ids = 1;
+    // append so requests are served in order
+    struct job **pp;
+    for (pp = &queue_head; *pp != NULL; pp = &(*pp)->next)
+        ;
+    *pp = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+
+//------------------------------------------------------------------------------
+
+void syntax(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -d <dir>      Preview cache directory (default %s)\n", cache_dir);
+    fprintf(stderr, " -m <MB>       Size cap of the preview cache (default %ld)\n", cache_max_mb);
+    fprintf(stderr, " -q <quality>  JPEG quality of previews (default %d)\n", quality);
+    fprintf(stderr, " -w <workers>  Number of worker threads (default: number of CPUs)\n");
+    fprintf(stderr, " -h            display this information\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Requests are read from stdin as \"<id> <width> <source path>\" lines.\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    pthread_t workers[MAX_WORKERS];
+    char line[MAX_LINE_LENGTH];
+    int opt;
+    int i;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "d:m:q:w:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': cache_dir = optarg; if (strlen(cache_dir) == 0) syntax(); break;
+            case 'm': cache_max_mb = atol(optarg); if (cache_max_mb < 1) syntax(); break;
+            case 'q': quality = atoi(optarg); if ((quality < 1) || (quality > 100)) syntax(); break;
+            case 'w': num_workers = atoi(optarg); if (num_workers < 1) syntax(); break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+
+    if (num_workers == 0)
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1)
+        num_workers = 1;
+    if (num_workers > MAX_WORKERS)
+        num_workers = MAX_WORKERS;
+
+    if ((mkdir(cache_dir, 0755) != 0) && (errno != EEXIST))
+    {
+        fprintf(stderr, "Failed to create %s\n", cache_dir);
+        return -errno;
+    }
+    // previews left by an earlier run count towards the cap
+    trim_cache();
+
+    for (i = 0; i < num_workers; i++)
+    {
+        int ret = pthread_create(&workers[i], NULL, worker_thread, NULL);
+        if (ret != 0)
+        {
+            fprintf(stderr, "Failed to start worker thread\n");
+            // without any worker requests would wait forever
+            if (i == 0)
+                return -ret;
+            num_workers = i;
+            break;
+        }
+    }
+
+    while (fgets(line, sizeof(line), stdin) != NULL)
+        handle_request(line);
+
+    // stdin closed, finish outstanding work then exit
+    pthread_mutex_lock(&queue_lock);
+    while (queue_head != NULL)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        usleep(10000);
+        pthread_mutex_lock(&queue_lock);
+    }
+    terminated = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    return 0;
+}
@@ -0,0 +1,751 @@
+/*
+ * MJPEG live view server.
+ *
+ * Watches the raspistill stream output file with inotify and serves every
+ * finished frame as multipart/x-mixed-replace MJPEG to any number of HTTP
+ * clients. raspistill writes to <file>~ and renames it into place, so the
+ * file descriptor opened on IN_MOVED_TO always refers to a complete JPEG that
+ * is never modified again. Each frame is reference counted and sent to all
+ * clients straight from the page cache with sendfile(). A client that is
+ * still busy sending an older frame simply skips to the latest one when it
+ * is done.
+ *
+ * With -m, frames are instead taken from the shared memory slot published by
+ * raspistill -shm (see shm_frame.h). A reader thread copies each new frame
+ * once into an anonymous memory file, so it is served exactly like a file
+ * frame and never touches the filesystem.
+ *
+ * For every new frame a line "frame <seq> <size>" is written to stdout, which
+ * the web UI uses as its frame ready notification.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "shm_frame.h"
+
+
+#define MAX_CLIENTS             16
+#define MAX_REQUEST_LENGTH      1024
+#define MAX_HEADER_LENGTH       256
+#define BOUNDARY                "rpistereocamframe"
+
+
+struct frame
+{
+    int refcount;
+    int fd;
+    off_t size;
+    unsigned int seq;
+};
+
+
+enum client_state
+{
+    CLIENT_FREE = 0,
+    CLIENT_READ_REQUEST,
+    CLIENT_WAIT_FRAME,
+    CLIENT_SEND_HEADER,
+    CLIENT_SEND_BODY,
+    CLIENT_SEND_TRAILER,
+};
+
+
+struct client
+{
+    int fd;
+    enum client_state state;
+    int single_shot;
+    char request[MAX_REQUEST_LENGTH];
+    int request_length;
+    char header[MAX_HEADER_LENGTH];
+    int header_length;
+    int header_offset;
+    struct frame *frame;
+    off_t body_offset;
+    unsigned int last_seq;
+    unsigned long frames_sent;
+    unsigned long frames_skipped;
+};
+
+
+static int terminated = 0;
+static const char *progname = "";
+static const char *stream_dir = "/tmp";
+static const char *stream_file = "image_stream.jpg";
+static int port = 8080;
+static const char *shm_name = NULL;
+static int frame_pipe[2] = {-1, -1};
+static struct frame *current_frame = NULL;
+static unsigned int frame_seq = 0;
+static struct client clients[MAX_CLIENTS];
+
+
+static void handle_terminate_signal(int sig)
+{
+    if ((sig == SIGTERM) || (sig == SIGINT))
+        terminated = 1;
+}
+
+
+static struct frame *frame_get(struct frame *frame)
+{
+    if (frame)
+        frame->refcount++;
+    return frame;
+}
+
+
+static void frame_put(struct frame *frame)
+{
+    if (frame && (--frame->refcount == 0))
+    {
+        close(frame->fd);
+        free(frame);
+    }
+}
+
+
+static void publish_frame(int fd)
+{
+    struct stat st;
+    struct frame *frame;
+
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+    {
+        close(fd);
+        return;
+    }
+    frame = malloc(sizeof(struct frame));
+    if (frame == NULL)
+    {
+        close(fd);
+        return;
+    }
+    frame->refcount = 1;
+    frame->fd = fd;
+    frame->size = st.st_size;
+    frame->seq = ++frame_seq;
+
+    frame_put(current_frame);
+    current_frame = frame;
+
+    fprintf(stdout, "frame %u %ld\n", frame->seq, (long)frame->size);
+    fflush(stdout);
+}
+
+
+static void load_frame(void)
+{
+    char *path;
+    int fd;
+
+    if (asprintf(&path, "%s/%s", stream_dir, stream_file) < 0)
+        return;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd != -1)
+        publish_frame(fd);
+}
+
+
+static void handle_inotify(int inotify_fd)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int new_frame = 0;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        char *ptr;
+        for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            if (event->len && (strcmp(event->name, stream_file) == 0))
+                new_frame = 1;
+        }
+    }
+    // Coalesce a burst of events into one frame
+    if (new_frame)
+        load_frame();
+}
+
+
+static int create_frame_fd(void)
+{
+    int fd = -1;
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "mjpeg_frame", 1 /* MFD_CLOEXEC */);
+#endif
+    if (fd == -1)
+        fd = open("/dev/shm", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    return fd;
+}
+
+
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t len = write(fd, data, length);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += len;
+        length -= len;
+    }
+    return 0;
+}
+
+
+static struct shm_frame_header *map_shm_frame(void)
+{
+    struct shm_frame_header *header;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1)
+        return NULL;
+    if ((fstat(fd, &st) != 0) || (st.st_size < SHM_FRAME_DATA_OFFSET))
+    {
+        close(fd);
+        return NULL;
+    }
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+        return NULL;
+    if ((header->magic != SHM_FRAME_MAGIC) ||
+        (header->version != SHM_FRAME_VERSION) ||
+        (header->num_slots > SHM_FRAME_NUM_SLOTS) ||
+        (SHM_FRAME_DATA_OFFSET + (off_t)header->num_slots * header->slot_size > st.st_size))
+    {
+        munmap(header, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+
+static void *shm_reader_thread(void *arg)
+{
+    struct shm_frame_header *header = NULL;
+    uint32_t last_seq = 0;
+
+    while (!terminated)
+    {
+        struct timespec timeout = { 1, 0 };
+
+        if (header == NULL)
+        {
+            // raspistill may not have created the shared memory yet
+            header = map_shm_frame();
+            if (header == NULL)
+            {
+                nanosleep(&timeout, NULL);
+                continue;
+            }
+            fprintf(stderr, "Reading frames from shared memory %s\n", shm_name);
+        }
+
+        uint32_t seq = header->seq;
+        if (seq == last_seq)
+        {
+            syscall(SYS_futex, &header->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+            continue;
+        }
+        __sync_synchronize();
+
+        uint32_t slot = header->latest;
+        if (slot >= header->num_slots)
+            continue;
+        uint32_t slot_seq = header->slots[slot].seq;
+        uint32_t length = header->slots[slot].length;
+        if ((slot_seq == 0) || (length == 0) || (length > header->slot_size))
+        {
+            last_seq = seq;
+            continue;
+        }
+
+        int fd = create_frame_fd();
+        if (fd == -1)
+        {
+            fprintf(stderr, "Failed to create frame buffer: %s\n", strerror(errno));
+            last_seq = seq;
+            continue;
+        }
+        const char *data = (const char *)header + SHM_FRAME_DATA_OFFSET + (size_t)slot * header->slot_size;
+        int ret = write_all(fd, data, length);
+        __sync_synchronize();
+        if ((ret < 0) || (header->slots[slot].seq != slot_seq))
+        {
+            // torn read, the writer lapped us; pick up the newer frame
+            close(fd);
+            continue;
+        }
+        last_seq = seq;
+        if (write(frame_pipe[1], &fd, sizeof(fd)) != sizeof(fd))
+            close(fd);
+    }
+    return NULL;
+}
+
+
+static void handle_frame_pipe(void)
+{
+    int fd;
+    int latest = -1;
+
+    while (read(frame_pipe[0], &fd, sizeof(fd)) == sizeof(fd))
+    {
+        if (latest != -1)
+            close(latest);
+        latest = fd;
+    }
+    if (latest != -1)
+        publish_frame(latest);
+}
+
+
+//------------------------------------------------------------------------------
+
+
+static void client_close(struct client *client)
+{
+    if (client->fd != -1)
+        close(client->fd);
+    frame_put(client->frame);
+    memset(client, 0, sizeof(struct client));
+    client->fd = -1;
+}
+
+
+static void client_start_frame(struct client *client)
+{
+    if ((current_frame == NULL) || (current_frame->seq == client->last_seq))
+    {
+        client->state = CLIENT_WAIT_FRAME;
+        return;
+    }
+
+    if (client->last_seq && (current_frame->seq > client->last_seq + 1))
+        client->frames_skipped += current_frame->seq - client->last_seq - 1;
+    client->frame = frame_get(current_frame);
+    client->last_seq = current_frame->seq;
+    client->body_offset = 0;
+    client->header_offset = 0;
+    if (client->single_shot)
+        client->header_length = snprintf(client->header, sizeof(client->header),
+                                         "HTTP/1.0 200 OK\r\n"
+                                         "Content-Type: image/jpeg\r\n"
+                                         "Content-Length: %ld\r\n"
+                                         "Cache-Control: no-cache\r\n"
+                                         "Connection: close\r\n"
+                                         "\r\n",
+                                         (long)client->frame->size);
+    else
+        client->header_length = snprintf(client->header, sizeof(client->header),
+                                         "--" BOUNDARY "\r\n"
+                                         "Content-Type: image/jpeg\r\n"
+                                         "Content-Length: %ld\r\n"
+                                         "\r\n",
+                                         (long)client->frame->size);
+    client->state = CLIENT_SEND_HEADER;
+}
+
+
+static void client_parse_request(struct client *client)
+{
+    char method[8];
+    char path[256];
+
+    if (sscanf(client->request, "%7s %255s", method, path) != 2)
+    {
+        client_close(client);
+        return;
+    }
+    if (strcmp(method, "GET") != 0)
+    {
+        client_close(client);
+        return;
+    }
+
+    if (strncmp(path, "/snapshot.jpg", strlen("/snapshot.jpg")) == 0)
+    {
+        client->single_shot = 1;
+        client_start_frame(client);
+        return;
+    }
+
+    client->single_shot = 0;
+    client->header_length = snprintf(client->header, sizeof(client->header),
+                                     "HTTP/1.0 200 OK\r\n"
+                                     "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n"
+                                     "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+                                     "Pragma: no-cache\r\n"
+                                     "Access-Control-Allow-Origin: *\r\n"
+                                     "Connection: close\r\n"
+                                     "\r\n");
+    client->header_offset = 0;
+    client->state = CLIENT_SEND_HEADER;
+}
+
+
+static void client_read(struct client *client)
+{
+    ssize_t len;
+
+    len = read(client->fd, client->request + client->request_length,
+               sizeof(client->request) - 1 - client->request_length);
+    if (len <= 0)
+    {
+        if ((len == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+            client_close(client);
+        return;
+    }
+    if (client->state != CLIENT_READ_REQUEST)
+        return; // ignore anything sent after the request
+    client->request_length += len;
+    client->request[client->request_length] = 0;
+    if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n"))
+        client_parse_request(client);
+    else if (client->request_length >= sizeof(client->request) - 1)
+        client_close(client);
+}
+
+
+static void client_write(struct client *client)
+{
+    ssize_t len;
+
+    while (1)
+    {
+        switch (client->state)
+        {
+            case CLIENT_SEND_HEADER:
+                len = write(client->fd, client->header + client->header_offset,
+                            client->header_length - client->header_offset);
+                if (len < 0)
+                    goto write_error;
+                client->header_offset += len;
+                if (client->header_offset < client->header_length)
+                    return;
+                if (client->frame)
+                    client->state = CLIENT_SEND_BODY;
+                else
+                    client_start_frame(client);
+                break;
+
+            case CLIENT_SEND_BODY:
+                len = sendfile(client->fd, client->frame->fd, &client->body_offset,
+                               client->frame->size - client->body_offset);
+                if (len < 0)
+                    goto write_error;
+                if (len == 0)
+                {
+                    // frame file truncated underneath us
+                    client_close(client);
+                    return;
+                }
+                if (client->body_offset < client->frame->size)
+                    return;
+                frame_put(client->frame);
+                client->frame = NULL;
+                client->frames_sent++;
+                if (client->single_shot)
+                {
+                    client_close(client);
+                    return;
+                }
+                client->header_length = snprintf(client->header, sizeof(client->header), "\r\n");
+                client->header_offset = 0;
+                client->state = CLIENT_SEND_TRAILER;
+                break;
+
+            case CLIENT_SEND_TRAILER:
+                len = write(client->fd, client->header + client->header_offset,
+                            client->header_length - client->header_offset);
+                if (len < 0)
+                    goto write_error;
+                client->header_offset += len;
+                if (client->header_offset < client->header_length)
+                    return;
+                // Jump to the most recent frame, skipping any in between
+                client_start_frame(client);
+                break;
+
+            default:
+                return;
+        }
+    }
+
+write_error:
+    if ((errno != EAGAIN) && (errno != EINTR))
+        client_close(client);
+}
+
+
+static void accept_clients(int listen_fd)
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        int i;
+        for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            if (clients[i].state == CLIENT_FREE)
+                break;
+        }
+        if (i >= MAX_CLIENTS)
+        {
+            close(fd);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        clients[i].fd = fd;
+        clients[i].state = CLIENT_READ_REQUEST;
+    }
+}
+
+
+static int open_listen_socket(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -errno;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+        (listen(fd, MAX_CLIENTS) == -1))
+    {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+
+//------------------------------------------------------------------------------
+
+void syntax(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -d <dir>      Directory raspistill writes the stream to (default %s)\n", stream_dir);
+    fprintf(stderr, " -f <file>     Stream file name (default %s)\n", stream_file);
+    fprintf(stderr, " -m <name>     Read frames from raspistill shared memory <name> instead (e.g. %s)\n", SHM_FRAME_DEFAULT_NAME);
+    fprintf(stderr, " -p <port>     HTTP port (default %d)\n", port);
+    fprintf(stderr, " -h            display this information\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Serves /stream.mjpg (MJPEG) and /snapshot.jpg (latest frame).\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    int opt;
+    int listen_fd;
+    int inotify_fd = -1;
+    pthread_t shm_thread;
+    int i;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "d:f:m:p:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': stream_dir = optarg; if (strlen(stream_dir) == 0) syntax(); break;
+            case 'f': stream_file = optarg; if (strlen(stream_file) == 0) syntax(); break;
+            case 'm': shm_name = optarg; if (strlen(shm_name) == 0) syntax(); break;
+            case 'p': port = atoi(optarg); if ((port <= 0) || (port > 65535)) syntax(); break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    signal(SIGINT, handle_terminate_signal);
+    signal(SIGTERM, handle_terminate_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (shm_name)
+    {
+        if (pipe2(frame_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+        {
+            ret = -errno;
+            fprintf(stderr, "Failed to create frame pipe\n");
+            return ret;
+        }
+        // the reader thread blocks on the write end only if we stop reading
+        fcntl(frame_pipe[1], F_SETFL, 0);
+        if (pthread_create(&shm_thread, NULL, shm_reader_thread, NULL) != 0)
+        {
+            fprintf(stderr, "Failed to start shared memory reader\n");
+            return -1;
+        }
+    }
+    else
+    {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1)
+        {
+            ret = -errno;
+            fprintf(stderr, "Failed to initialise inotify\n");
+            return ret;
+        }
+        if (inotify_add_watch(inotify_fd, stream_dir, IN_MOVED_TO | IN_CLOSE_WRITE) == -1)
+        {
+            ret = -errno;
+            fprintf(stderr, "Failed to watch %s\n", stream_dir);
+            goto error_close_inotify;
+        }
+    }
+
+    listen_fd = open_listen_socket(port);
+    if (listen_fd < 0)
+    {
+        ret = listen_fd;
+        fprintf(stderr, "Failed to listen on port %d\n", port);
+        goto error_close_inotify;
+    }
+    if (shm_name)
+        fprintf(stderr, "Serving shared memory %s on port %d\n", shm_name, port);
+    else
+    {
+        fprintf(stderr, "Serving %s/%s on port %d\n", stream_dir, stream_file, port);
+        load_frame();
+    }
+
+    while (!terminated)
+    {
+        struct pollfd fds[2 + MAX_CLIENTS];
+        unsigned int seq_before = frame_seq;
+        int nfds = 0;
+
+        fds[nfds].fd = shm_name ? frame_pipe[0] : inotify_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        fds[nfds].fd = listen_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            struct client *client = &clients[i];
+            fds[nfds].fd = client->fd;
+            fds[nfds].events = 0;
+            if (client->state != CLIENT_FREE)
+                fds[nfds].events |= POLLIN;
+            if ((client->state == CLIENT_SEND_HEADER) ||
+                (client->state == CLIENT_SEND_BODY) ||
+                (client->state == CLIENT_SEND_TRAILER))
+                fds[nfds].events |= POLLOUT;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ret = -errno;
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && shm_name)
+            handle_frame_pipe();
+        else if (fds[0].revents & POLLIN)
+            handle_inotify(inotify_fd);
+        if (fds[1].revents & POLLIN)
+            accept_clients(listen_fd);
+
+        for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            struct client *client = &clients[i];
+            short revents = fds[2 + i].revents;
+            if ((client->state == CLIENT_FREE) || (fds[2 + i].fd != client->fd))
+                continue;
+            if (revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                client_close(client);
+                continue;
+            }
+            if (revents & POLLIN)
+                client_read(client);
+            if ((client->state != CLIENT_FREE) && (revents & POLLOUT))
+                client_write(client);
+        }
+
+        // Wake up clients waiting for a frame
+        if (frame_seq != seq_before)
+        {
+            for (i = 0; i < MAX_CLIENTS; i++)
+            {
+                if (clients[i].state == CLIENT_WAIT_FRAME)
+                {
+                    client_start_frame(&clients[i]);
+                    client_write(&clients[i]);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        client_close(&clients[i]);
+    frame_put(current_frame);
+    current_frame = NULL;
+    close(listen_fd);
+
+error_close_inotify:
+    if (shm_name)
+    {
+        terminated = 1;
+        pthread_join(shm_thread, NULL);
+        close(frame_pipe[0]);
+        close(frame_pipe[1]);
+    }
+    else
+        close(inotify_fd);
+    return ret;
+}
@@ -0,0 +1,93 @@
+#ifndef _SESSION_LOG_H_
+#define _SESSION_LOG_H_
+
+#include <stdint.h>
+
+
+/*
+ * Capture session metadata log written by raspistill -sl (see
+ * raspistill_session_log.patch, which carries an identical copy of this
+ * layout in RaspiSessionLog.h).
+ *
+ * One file per capture session: a SESSION_LOG_HEADER_SIZE byte header
+ * followed by fixed size records, one per frame, in capture order. The
+ * writer fills a record in place through its mapping and only then bumps
+ * header.count, so a reader mapping the file sees count complete records.
+ * time_us never decreases within a file (if the clock is stepped back, e.g.
+ * by ntpd after boot, the writer holds the previous value), so records are
+ * sorted by time as well as by frame.
+ *
+ * The header also holds a sparse index, one struct session_log_block per
+ * SESSION_LOG_BLOCK_RECORDS records, giving the time of the first record
+ * and the bounding box of the fixes in the block. Time lookups bisect the
+ * blocks and then the records of one block; location lookups skip every
+ * block whose box misses. Records past max_blocks blocks are not indexed.
+ *
+ * All values are in host (little endian) byte order.
+ */
+
+#define SESSION_LOG_MAGIC               0x474C5352  // "RSLG"
+#define SESSION_LOG_VERSION             1
+#define SESSION_LOG_HEADER_SIZE         65536
+#define SESSION_LOG_BLOCK_OFFSET        4096
+#define SESSION_LOG_BLOCK_RECORDS       4096
+#define SESSION_LOG_MAX_BLOCKS          ((SESSION_LOG_HEADER_SIZE - SESSION_LOG_BLOCK_OFFSET) / sizeof(struct session_log_block))
+
+#define SESSION_LOG_GPS_2D              (1 << 0)    // latitude, longitude
+#define SESSION_LOG_GPS_3D              (1 << 1)    // altitude
+#define SESSION_LOG_GPS_TIME            (1 << 2)
+#define SESSION_LOG_GPS_SPEED           (1 << 3)
+#define SESSION_LOG_GPS_TRACK           (1 << 4)
+#define SESSION_LOG_ATTITUDE            (1 << 5)    // roll, pitch, yaw
+
+
+struct session_log_record
+{
+    uint32_t frame;
+    uint32_t flags;             // SESSION_LOG_*
+    int64_t time_us;            // CLOCK_REALTIME when the capture was triggered
+    int64_t trigger_us;         // CLOCK_MONOTONIC
+    int64_t encoded_us;         // CLOCK_MONOTONIC
+    int64_t closed_us;          // CLOCK_MONOTONIC
+    double gps_time;            // unix time of the fix
+    double latitude;            // degrees
+    double longitude;           // degrees
+    double altitude;            // m
+    float speed;                // m/s
+    float track;                // degrees
+    float roll;                 // degrees
+    float pitch;                // degrees
+    float yaw;                  // degrees
+    uint32_t reserved0;
+    int64_t attitude_ns;        // CLOCK_MONOTONIC sample time of the attitude
+    uint8_t reserved[24];
+};
+
+
+struct session_log_block
+{
+    int64_t first_time_us;
+    float min_latitude;
+    float max_latitude;
+    float min_longitude;
+    float max_longitude;
+    uint32_t gps_records;       // records with SESSION_LOG_GPS_2D, box is unset if 0
+    uint32_t reserved;
+};
+
+
+struct session_log_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t block_records;
+    uint32_t max_blocks;
+    int64_t created_us;         // CLOCK_REALTIME
+    volatile uint32_t count;    // complete records
+    uint32_t writer_pid;
+};
+
+
+#endif // _SESSION_LOG_H_
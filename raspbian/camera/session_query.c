@@ -0,0 +1,402 @@
+/*
+ * Capture session log query tool.
+ *
+ * Prints the records of one or more session logs (see session_log.h) that
+ * match a time range, a frame range and/or a bounding box, one per line as
+ * text or JSON. The logs are mapped, not read, and only the pages of the
+ * records that can match are touched, so this is cheap even on logs of
+ * millions of frames, and safe to run while raspistill is appending.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "session_log.h"
+
+
+#define BBOX_MARGIN             0.0001      // degrees
+
+
+struct query
+{
+    int64_t from_us;
+    int64_t to_us;              // inclusive
+    long first_frame;
+    long last_frame;            // inclusive
+    int bbox;
+    double south, west, north, east;
+};
+
+
+struct session_map
+{
+    const char *path;
+    void *addr;
+    size_t size;
+    const struct session_log_header *header;
+    const struct session_log_block *blocks;
+    const struct session_log_record *records;
+    uint32_t count;
+    uint32_t indexed_blocks;
+};
+
+
+static const char *progname = "";
+static int json = 0;
+static int count_only = 0;
+static int info_only = 0;
+
+
+static int map_session(const char *path, struct session_map *map)
+{
+    struct stat st;
+    const struct session_log_header *header;
+    uint32_t blocks;
+    int fd;
+
+    memset(map, 0, sizeof(*map));
+    map->path = path;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    if ((fstat(fd, &st) != 0) || (st.st_size < SESSION_LOG_HEADER_SIZE))
+    {
+        fprintf(stderr, "%s is not a session log\n", path);
+        close(fd);
+        return -EINVAL;
+    }
+    map->size = st.st_size;
+    map->addr = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map->addr == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+        map->addr = NULL;
+        return -errno;
+    }
+
+    header = map->addr;
+    if ((header->magic != SESSION_LOG_MAGIC) || (header->version != SESSION_LOG_VERSION) ||
+        (header->header_size != SESSION_LOG_HEADER_SIZE) ||
+        (header->record_size != sizeof(struct session_log_record)) ||
+        (header->block_records != SESSION_LOG_BLOCK_RECORDS))
+    {
+        fprintf(stderr, "%s is not a version %d session log\n", path, SESSION_LOG_VERSION);
+        munmap(map->addr, map->size);
+        map->addr = NULL;
+        return -EINVAL;
+    }
+    map->header = header;
+    map->blocks = (const struct session_log_block *)((const char *)map->addr + SESSION_LOG_BLOCK_OFFSET);
+    map->records = (const struct session_log_record *)((const char *)map->addr + SESSION_LOG_HEADER_SIZE);
+
+    // records past the end of our mapping are left for the next run
+    map->count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    if (map->count > (map->size - SESSION_LOG_HEADER_SIZE) / sizeof(struct session_log_record))
+        map->count = (map->size - SESSION_LOG_HEADER_SIZE) / sizeof(struct session_log_record);
+    blocks = (map->count + SESSION_LOG_BLOCK_RECORDS - 1) / SESSION_LOG_BLOCK_RECORDS;
+    map->indexed_blocks = (blocks < header->max_blocks) ? blocks : header->max_blocks;
+    return 0;
+}
+
+
+static void unmap_session(struct session_map *map)
+{
+    if (map->addr)
+        munmap(map->addr, map->size);
+    map->addr = NULL;
+}
+
+
+// First record with time_us >= time_us
+static uint32_t lower_bound_time(const struct session_map *map, int64_t time_us)
+{
+    uint32_t lo = 0;
+    uint32_t hi = map->indexed_blocks;
+
+    // last indexed block starting before time_us
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (map->blocks[mid].first_time_us < time_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return 0;
+    hi = (lo < map->indexed_blocks) ? lo * SESSION_LOG_BLOCK_RECORDS : map->count;
+    lo = (lo - 1) * SESSION_LOG_BLOCK_RECORDS;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (map->records[mid].time_us < time_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+// First record with frame >= frame
+static uint32_t lower_bound_frame(const struct session_map *map, long frame)
+{
+    uint32_t lo = 0;
+    uint32_t hi = map->count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if ((long)map->records[mid].frame < frame)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+// Block boxes are floats, widen them by more than their rounding error
+static int block_in_bbox(const struct session_log_block *block, const struct query *query)
+{
+    return block->gps_records &&
+           (block->max_latitude + BBOX_MARGIN >= query->south) &&
+           (block->min_latitude - BBOX_MARGIN <= query->north) &&
+           (block->max_longitude + BBOX_MARGIN >= query->west) &&
+           (block->min_longitude - BBOX_MARGIN <= query->east);
+}
+
+
+static int record_in_bbox(const struct session_log_record *record, const struct query *query)
+{
+    return (record->flags & SESSION_LOG_GPS_2D) &&
+           (record->latitude >= query->south) && (record->latitude <= query->north) &&
+           (record->longitude >= query->west) && (record->longitude <= query->east);
+}
+
+
+static void print_record(const struct session_log_record *r)
+{
+    if (json)
+    {
+        printf("{\"frame\":%u,\"time\":%.6f,\"trigger_ms\":%.3f,\"encoded_ms\":%.3f,\"closed_ms\":%.3f",
+               r->frame, r->time_us / 1e6, r->trigger_us / 1e3, r->encoded_us / 1e3, r->closed_us / 1e3);
+        if (r->flags & SESSION_LOG_GPS_TIME)
+            printf(",\"gps_time\":%.3f", r->gps_time);
+        if (r->flags & SESSION_LOG_GPS_2D)
+            printf(",\"lat\":%.7f,\"lon\":%.7f", r->latitude, r->longitude);
+        if (r->flags & SESSION_LOG_GPS_3D)
+            printf(",\"alt\":%.1f", r->altitude);
+        if (r->flags & SESSION_LOG_GPS_SPEED)
+            printf(",\"speed\":%.2f", r->speed);
+        if (r->flags & SESSION_LOG_GPS_TRACK)
+            printf(",\"track\":%.2f", r->track);
+        if (r->flags & SESSION_LOG_ATTITUDE)
+            printf(",\"roll\":%.2f,\"pitch\":%.2f,\"yaw\":%.2f", r->roll, r->pitch, r->yaw);
+        printf("}\n");
+    }
+    else
+    {
+        // unset values print as "-" so the columns stay put
+        printf("%u %.6f", r->frame, r->time_us / 1e6);
+        if (r->flags & SESSION_LOG_GPS_2D)
+            printf(" %.7f %.7f", r->latitude, r->longitude);
+        else
+            printf(" - -");
+        if (r->flags & SESSION_LOG_GPS_3D)
+            printf(" %.1f", r->altitude);
+        else
+            printf(" -");
+        if (r->flags & SESSION_LOG_ATTITUDE)
+            printf(" %.2f %.2f %.2f\n", r->roll, r->pitch, r->yaw);
+        else
+            printf(" - - -\n");
+    }
+}
+
+
+static void print_info(const struct session_map *map)
+{
+    printf("%s: %u records, %u indexed blocks, created %.0f, writer pid %u\n",
+           map->path, map->count, map->indexed_blocks,
+           map->header->created_us / 1e6, map->header->writer_pid);
+    if (map->count)
+    {
+        const struct session_log_record *first = &map->records[0];
+        const struct session_log_record *last = &map->records[map->count - 1];
+        printf("  frames %u-%u, time %.3f-%.3f\n", first->frame, last->frame,
+               first->time_us / 1e6, last->time_us / 1e6);
+    }
+}
+
+
+static long query_session(const struct session_map *map, const struct query *query)
+{
+    uint32_t start = 0;
+    uint32_t end = map->count;
+    uint32_t i;
+    long matched = 0;
+
+    if (query->from_us > INT64_MIN)
+        start = lower_bound_time(map, query->from_us);
+    if (query->to_us < INT64_MAX)
+        end = lower_bound_time(map, query->to_us + 1);
+    if (query->first_frame > 0)
+    {
+        uint32_t n = lower_bound_frame(map, query->first_frame);
+        if (n > start)
+            start = n;
+    }
+    if (query->last_frame >= 0)
+    {
+        uint32_t n = lower_bound_frame(map, query->last_frame + 1);
+        if (n < end)
+            end = n;
+    }
+
+    i = start;
+    while (i < end)
+    {
+        uint32_t block = i / SESSION_LOG_BLOCK_RECORDS;
+        if (query->bbox && (block < map->indexed_blocks) &&
+            !block_in_bbox(&map->blocks[block], query))
+        {
+            i = (block + 1) * SESSION_LOG_BLOCK_RECORDS;
+            continue;
+        }
+        if (!query->bbox || record_in_bbox(&map->records[i], query))
+        {
+            matched++;
+            if (!count_only)
+                print_record(&map->records[i]);
+        }
+        i++;
+    }
+    return matched;
+}
+
+
+static int parse_range(const char *arg, double *from, double *to)
+{
+    char *end;
+
+    *from = strtod(arg, &end);
+    if (end == arg)
+        return -1;
+    if (*end == '\0')
+        return 0;
+    if (*end != ',')
+        return -1;
+    arg = end + 1;
+    *to = strtod(arg, &end);
+    return ((end == arg) || (*end != '\0')) ? -1 : 0;
+}
+
+
+void syntax(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options] <session log>...\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -t <from>[,<to>]      Records from unix time <from> to <to> (seconds)\n");
+    fprintf(stderr, " -f <first>[,<last>]   Records of frames <first> to <last>\n");
+    fprintf(stderr, " -b <s>,<w>,<n>,<e>    Records with a fix inside the box (degrees)\n");
+    fprintf(stderr, " -j                    Print JSON, one object per line\n");
+    fprintf(stderr, " -c                    Only print the number of matching records\n");
+    fprintf(stderr, " -i                    Print a summary of each log\n");
+    fprintf(stderr, " -h                    display this information\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Text lines are: frame time latitude longitude altitude roll pitch yaw\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct query query;
+    double from, to;
+    long matched = 0;
+    int ret = 0;
+    int opt;
+    int i;
+
+    progname = argv[0];
+    memset(&query, 0, sizeof(query));
+    query.from_us = INT64_MIN;
+    query.to_us = INT64_MAX;
+    query.first_frame = -1;
+    query.last_frame = -1;
+
+    while ((opt = getopt(argc, argv, "t:f:b:jcih")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                from = 0;
+                to = -1;
+                if (parse_range(optarg, &from, &to))
+                    syntax();
+                query.from_us = (int64_t)(from * 1e6);
+                if (to >= 0)
+                    query.to_us = (int64_t)(to * 1e6);
+                break;
+            case 'f':
+                from = 0;
+                to = -1;
+                if (parse_range(optarg, &from, &to))
+                    syntax();
+                query.first_frame = (long)from;
+                query.last_frame = (long)to;
+                break;
+            case 'b':
+                if (sscanf(optarg, "%lf,%lf,%lf,%lf", &query.south, &query.west,
+                           &query.north, &query.east) != 4)
+                    syntax();
+                query.bbox = 1;
+                break;
+            case 'j': json = 1; break;
+            case 'c': count_only = 1; break;
+            case 'i': info_only = 1; break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+    if (optind >= argc)
+        syntax();
+
+    for (i = optind; i < argc; i++)
+    {
+        struct session_map map;
+        if (map_session(argv[i], &map) != 0)
+        {
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        if (info_only)
+            print_info(&map);
+        else
+            matched += query_session(&map, &query);
+        unmap_session(&map);
+    }
+    if (count_only && !info_only)
+        printf("%ld\n", matched);
+    return ret;
+}
@@ -0,0 +1,52 @@
+#ifndef _SHM_FRAME_H_
+#define _SHM_FRAME_H_
+
+#include <stdint.h>
+
+
+/*
+ * Latest-frame handoff from raspistill (see raspistill_shm_frame.patch,
+ * which carries an identical copy of this layout in RaspiShmFrame.h).
+ *
+ * The POSIX shared memory object starts with a struct shm_frame_header,
+ * followed at SHM_FRAME_DATA_OFFSET by num_slots slots of slot_size bytes.
+ * The writer always fills the slot that is not the latest one, then
+ * publishes it by setting slots[n].seq, latest and finally seq, and wakes
+ * readers with FUTEX_WAKE on seq. A slot being written has seq 0.
+ *
+ * Readers wait on seq, copy slot[latest] and then re-check slots[n].seq. If
+ * it changed, the writer lapped the reader and the copy must be discarded.
+ */
+
+#define SHM_FRAME_MAGIC                 0x4D464A52  // "RJFM"
+#define SHM_FRAME_VERSION               1
+#define SHM_FRAME_DEFAULT_NAME          "/rpi-stereo-cam-stream"
+#define SHM_FRAME_NUM_SLOTS             2
+#define SHM_FRAME_SLOT_SIZE             (8 * 1024 * 1024)
+#define SHM_FRAME_DATA_OFFSET           4096
+#define SHM_FRAME_TOTAL_SIZE            (SHM_FRAME_DATA_OFFSET + SHM_FRAME_NUM_SLOTS * SHM_FRAME_SLOT_SIZE)
+
+
+struct shm_frame_slot
+{
+    volatile uint32_t seq;
+    uint32_t length;
+    uint64_t timestamp_us;      // CLOCK_REALTIME when the frame was completed
+};
+
+
+struct shm_frame_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t num_slots;
+    volatile uint32_t seq;      // sequence number of the latest frame, futex word
+    volatile uint32_t latest;   // slot holding the latest frame
+    uint32_t writer_pid;
+    uint32_t reserved;
+    struct shm_frame_slot slots[SHM_FRAME_NUM_SLOTS];
+};
+
+
+#endif // _SHM_FRAME_H_
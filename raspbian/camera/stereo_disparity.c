@@ -0,0 +1,923 @@
+/*
+ * Stereo disparity preview.
+ *
+ * raspistill -3d sbs writes both eyes side by side into one JPEG. This tool
+ * splits such a frame and computes a block matching disparity map at preview
+ * resolution, using either the sum of absolute differences (SAD) or the
+ * hamming distance between 5x5 census transforms as the matching cost.
+ *
+ * The frame is decoded straight to luma with libjpeg DCT domain scaling, so
+ * at the default 320 pixel eye width only 1/8 of the IDCT work is done. For
+ * every row and disparity the per pixel costs are added to running column
+ * sums over the window height (SSE2/NEON kernels, scalar otherwise), then
+ * summed horizontally and reduced winner-takes-all. The rows are split into
+ * bands across a pool of worker threads.
+ *
+ * Live mode (default) watches the raspistill stream file with inotify, like
+ * mjpeg_stream, and writes the disparity of the latest frame to an output
+ * JPEG, printing "disparity <seq> <ms>" on stdout for each one. Batch mode
+ * (-b) processes every JPEG in a directory such as the capture directory.
+ *
+ * The output is a greyscale JPEG, brighter is nearer. Pixels without a valid
+ * match (image borders) are black.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <jpeglib.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2 1
+#endif
+
+
+#define MAX_THREADS             8
+#define MAX_DISPARITIES         128
+#define MAX_WINDOW              15
+#define CENSUS_BITS             24
+#define SAD_INVALID_COST        255
+
+
+enum match_cost
+{
+    COST_SAD,
+    COST_CENSUS,
+};
+
+
+struct stereo_frame
+{
+    uint8_t *data;              // full side-by-side luma image
+    int width;                  // width of one eye
+    int height;
+    int stride;
+    const uint8_t *left;
+    const uint8_t *right;
+    uint32_t *census_left;
+    uint32_t *census_right;
+    uint8_t *disparity;         // width x height
+};
+
+
+struct worker
+{
+    pthread_t thread;
+    int index;
+    uint16_t *column_sums;      // num_disparities x width
+    uint32_t *best_cost;
+    uint8_t *best_disparity;
+};
+
+
+struct jpeg_error_handler
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+
+
+static const char *progname = "";
+static const char *stream_dir = "/tmp";
+static const char *stream_file = "image_stream.jpg";
+static const char *output_path = "/tmp/image_disparity.jpg";
+static const char *batch_dir = NULL;
+static const char *batch_output_dir = NULL;
+static int eye_width = 320;
+static int num_disparities = 32;
+static int window = 9;
+static enum match_cost cost = COST_SAD;
+static int swap_eyes = 0;
+static int num_threads = 0;
+static volatile sig_atomic_t terminated = 0;
+
+// thread pool, one band of rows per worker per frame
+static struct worker workers[MAX_THREADS];
+static struct stereo_frame *pool_frame = NULL;
+static unsigned int pool_generation = 0;
+static int pool_pending = 0;
+static int pool_census_pending = 0;
+static int pool_exit = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+
+static void handle_terminate_signal(int sig)
+{
+    terminated = 1;
+}
+
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+//------------------------------------------------------------------------------
+// JPEG input and output
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_error_handler *handler = (struct jpeg_error_handler *)cinfo->err;
+    longjmp(handler->setjmp_buffer, 1);
+}
+
+
+/* Largest DCT scaling that keeps one eye at least target_width wide. */
+static int dct_scale_denom(int sbs_width, int target_width)
+{
+    int denom;
+    for (denom = 8; denom > 1; denom /= 2)
+    {
+        if (sbs_width / 2 / denom >= target_width)
+            break;
+    }
+    return denom;
+}
+
+
+static int load_frame(const char *path, struct stereo_frame *frame)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_handler jerr;
+    FILE *in;
+    volatile int ret = -1;
+
+    in = fopen(path, "rb");
+    if (in == NULL)
+        return -errno;
+
+    dinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jpeg_create_decompress(&dinfo);
+    if (setjmp(jerr.setjmp_buffer))
+        goto error_ret;
+
+    jpeg_stdio_src(&dinfo, in);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = JCS_GRAYSCALE;
+    dinfo.scale_num = 1;
+    dinfo.scale_denom = dct_scale_denom(dinfo.image_width, eye_width);
+    dinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&dinfo);
+
+    if ((frame->data == NULL) ||
+        (frame->stride != dinfo.output_width) ||
+        (frame->height != dinfo.output_height))
+    {
+        free(frame->data);
+        free(frame->census_left);
+        free(frame->census_right);
+        free(frame->disparity);
+        frame->stride = dinfo.output_width;
+        frame->width = dinfo.output_width / 2;
+        frame->height = dinfo.output_height;
+        frame->data = malloc(frame->stride * frame->height);
+        frame->census_left = calloc(frame->width * frame->height, sizeof(uint32_t));
+        frame->census_right = calloc(frame->width * frame->height, sizeof(uint32_t));
+        frame->disparity = malloc(frame->width * frame->height);
+        if (!frame->data || !frame->census_left || !frame->census_right || !frame->disparity)
+        {
+            // the next frame retries the allocation
+            free(frame->data);
+            free(frame->census_left);
+            free(frame->census_right);
+            free(frame->disparity);
+            frame->data = NULL;
+            frame->census_left = frame->census_right = NULL;
+            frame->disparity = NULL;
+            jpeg_abort_decompress(&dinfo);
+            goto error_ret;
+        }
+    }
+    while (dinfo.output_scanline < dinfo.output_height)
+    {
+        JSAMPROW row[1] = { frame->data + dinfo.output_scanline * frame->stride };
+        jpeg_read_scanlines(&dinfo, row, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+
+    frame->left = frame->data;
+    frame->right = frame->data + frame->width;
+    if (swap_eyes)
+    {
+        frame->left = frame->data + frame->width;
+        frame->right = frame->data;
+    }
+    ret = 0;
+
+error_ret:
+    jpeg_destroy_decompress(&dinfo);
+    fclose(in);
+    return ret;
+}
+
+
+static int save_disparity(const char *path, const struct stereo_frame *frame)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_handler jerr;
+    // modified after setjmp, so must not live in registers
+    uint8_t * volatile row = NULL;
+    FILE * volatile out = NULL;
+    char *tmp_path = NULL;
+    volatile int ret = -1;
+    int x;
+
+    if (asprintf(&tmp_path, "%s~", path) < 0)
+        return -ENOMEM;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jpeg_create_compress(&cinfo);
+    if (setjmp(jerr.setjmp_buffer))
+        goto error_ret;
+
+    row = malloc(frame->width);
+    out = fopen(tmp_path, "wb");
+    if (!row || !out)
+        goto error_ret;
+    jpeg_stdio_dest(&cinfo, out);
+    cinfo.image_width = frame->width;
+    cinfo.image_height = frame->height;
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        const uint8_t *disparity = frame->disparity + cinfo.next_scanline * frame->width;
+        JSAMPROW rows[1] = { row };
+        for (x = 0; x < frame->width; x++)
+            row[x] = disparity[x] * 255 / (num_disparities - 1);
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    if (fclose(out) == 0)
+    {
+        out = NULL;
+        if (rename(tmp_path, path) == 0)
+            ret = 0;
+    }
+
+error_ret:
+    jpeg_destroy_compress(&cinfo);
+    if (out)
+        fclose(out);
+    if (ret != 0)
+        unlink(tmp_path);
+    free(tmp_path);
+    free(row);
+    return ret;
+}
+
+
+//------------------------------------------------------------------------------
+// Matching kernels
+
+/* 5x5 census transform, one bit per neighbour darker than the centre. */
+static void census_transform(const uint8_t *image, int stride, int width,
+                             int y0, int y1, int height, uint32_t *census)
+{
+    int x, y, dx, dy;
+
+    for (y = y0; y < y1; y++)
+    {
+        uint32_t *out = census + y * width;
+        if ((y < 2) || (y >= height - 2))
+        {
+            memset(out, 0, width * sizeof(uint32_t));
+            continue;
+        }
+        out[0] = out[1] = out[width - 2] = out[width - 1] = 0;
+        for (x = 2; x < width - 2; x++)
+        {
+            const uint8_t *p = image + y * stride + x;
+            uint8_t centre = *p;
+            uint32_t bits = 0;
+            for (dy = -2; dy <= 2; dy++)
+            {
+                for (dx = -2; dx <= 2; dx++)
+                {
+                    if ((dx == 0) && (dy == 0))
+                        continue;
+                    bits = (bits << 1) | (p[dy * stride + dx] < centre);
+                }
+            }
+            out[x] = bits;
+        }
+    }
+}
+
+
+/*
+ * Add (or subtract) the SAD cost of one image row at disparity d to the
+ * column sums. Pixels without a counterpart in the right image get the
+ * maximum cost.
+ */
+static void accumulate_sad(uint16_t *sums, const uint8_t *left, const uint8_t *right,
+                           int width, int d, int subtract)
+{
+    uint16_t invalid = subtract ? (uint16_t)-SAD_INVALID_COST : SAD_INVALID_COST;
+    int x;
+
+    for (x = 0; x < d; x++)
+        sums[x] += invalid;
+#if defined(USE_NEON)
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t diff = vabdq_u8(vld1q_u8(left + x), vld1q_u8(right + x - d));
+        uint16x8_t lo = vld1q_u16(sums + x);
+        uint16x8_t hi = vld1q_u16(sums + x + 8);
+        if (subtract)
+        {
+            lo = vsubw_u8(lo, vget_low_u8(diff));
+            hi = vsubw_u8(hi, vget_high_u8(diff));
+        }
+        else
+        {
+            lo = vaddw_u8(lo, vget_low_u8(diff));
+            hi = vaddw_u8(hi, vget_high_u8(diff));
+        }
+        vst1q_u16(sums + x, lo);
+        vst1q_u16(sums + x + 8, hi);
+    }
+#elif defined(USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(left + x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(right + x - d));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+        __m128i lo = _mm_loadu_si128((const __m128i *)(sums + x));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(sums + x + 8));
+        if (subtract)
+        {
+            lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(diff, zero));
+            hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(diff, zero));
+        }
+        else
+        {
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(diff, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(diff, zero));
+        }
+        _mm_storeu_si128((__m128i *)(sums + x), lo);
+        _mm_storeu_si128((__m128i *)(sums + x + 8), hi);
+    }
+#endif
+    for (; x < width; x++)
+    {
+        int diff = abs((int)left[x] - (int)right[x - d]);
+        if (subtract)
+            sums[x] -= diff;
+        else
+            sums[x] += diff;
+    }
+}
+
+
+/* As accumulate_sad, with the census hamming distance as cost. */
+static void accumulate_census(uint16_t *sums, const uint32_t *left, const uint32_t *right,
+                              int width, int d, int subtract)
+{
+    uint16_t invalid = subtract ? (uint16_t)-CENSUS_BITS : CENSUS_BITS;
+    int x;
+
+    for (x = 0; x < d; x++)
+        sums[x] += invalid;
+#if defined(USE_NEON)
+    for (; x + 8 <= width; x += 8)
+    {
+        uint32x4_t xor_lo = veorq_u32(vld1q_u32(left + x), vld1q_u32(right + x - d));
+        uint32x4_t xor_hi = veorq_u32(vld1q_u32(left + x + 4), vld1q_u32(right + x - d + 4));
+        uint16x4_t count_lo = vmovn_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(xor_lo)))));
+        uint16x4_t count_hi = vmovn_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(xor_hi)))));
+        uint16x8_t count = vcombine_u16(count_lo, count_hi);
+        uint16x8_t s = vld1q_u16(sums + x);
+        s = subtract ? vsubq_u16(s, count) : vaddq_u16(s, count);
+        vst1q_u16(sums + x, s);
+    }
+#elif defined(USE_SSE2)
+    // SSE2 has no byte popcount or shuffle, count the bits of each 32 bit
+    // lane by summing ever wider fields instead
+    const __m128i m1 = _mm_set1_epi32(0x55555555);
+    const __m128i m2 = _mm_set1_epi32(0x33333333);
+    const __m128i m4 = _mm_set1_epi32(0x0f0f0f0f);
+    const __m128i m6 = _mm_set1_epi32(0x3f);
+    __m128i v[2];
+    int i;
+    for (; x + 8 <= width; x += 8)
+    {
+        for (i = 0; i < 2; i++)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(left + x + 4 * i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(right + x - d + 4 * i));
+            __m128i c = _mm_xor_si128(a, b);
+            c = _mm_sub_epi32(c, _mm_and_si128(_mm_srli_epi32(c, 1), m1));
+            c = _mm_add_epi32(_mm_and_si128(c, m2), _mm_and_si128(_mm_srli_epi32(c, 2), m2));
+            c = _mm_and_si128(_mm_add_epi32(c, _mm_srli_epi32(c, 4)), m4);
+            c = _mm_add_epi32(c, _mm_srli_epi32(c, 8));
+            v[i] = _mm_and_si128(_mm_add_epi32(c, _mm_srli_epi32(c, 16)), m6);
+        }
+        // counts are at most 32, so the signed pack does not saturate
+        __m128i count = _mm_packs_epi32(v[0], v[1]);
+        __m128i s = _mm_loadu_si128((const __m128i *)(sums + x));
+        s = subtract ? _mm_sub_epi16(s, count) : _mm_add_epi16(s, count);
+        _mm_storeu_si128((__m128i *)(sums + x), s);
+    }
+#endif
+    for (; x < width; x++)
+    {
+        int distance = __builtin_popcount(left[x] ^ right[x - d]);
+        if (subtract)
+            sums[x] -= distance;
+        else
+            sums[x] += distance;
+    }
+}
+
+
+static void accumulate_row(const struct stereo_frame *frame, uint16_t *column_sums,
+                           int y, int subtract)
+{
+    int d;
+
+    // replicate the top and bottom rows outside the image
+    if (y < 0)
+        y = 0;
+    if (y >= frame->height)
+        y = frame->height - 1;
+
+    for (d = 0; d < num_disparities; d++)
+    {
+        uint16_t *sums = column_sums + d * frame->width;
+        if (cost == COST_CENSUS)
+            accumulate_census(sums,
+                              frame->census_left + y * frame->width,
+                              frame->census_right + y * frame->width,
+                              frame->width, d, subtract);
+        else
+            accumulate_sad(sums,
+                           frame->left + y * frame->stride,
+                           frame->right + y * frame->stride,
+                           frame->width, d, subtract);
+    }
+}
+
+
+/* Sum the column sums over the window width and keep the best disparity. */
+static void select_disparity(const struct stereo_frame *frame, struct worker *worker, int y)
+{
+    const int radius = window / 2;
+    const int width = frame->width;
+    uint8_t *out = frame->disparity + y * width;
+    int x, d;
+
+    for (x = 0; x < width; x++)
+    {
+        worker->best_cost[x] = UINT32_MAX;
+        worker->best_disparity[x] = 0;
+    }
+    for (d = 0; d < num_disparities; d++)
+    {
+        const uint16_t *sums = worker->column_sums + d * width;
+        uint32_t sum = 0;
+        for (x = 0; x < window; x++)
+            sum += sums[x];
+        for (x = radius; x < width - radius; x++)
+        {
+            if (sum < worker->best_cost[x])
+            {
+                worker->best_cost[x] = sum;
+                worker->best_disparity[x] = d;
+            }
+            if (x + radius + 1 < width)
+                sum += sums[x + radius + 1] - sums[x - radius];
+        }
+    }
+    for (x = 0; x < width; x++)
+    {
+        // the window must lie within both eyes
+        if ((x < radius) || (x >= width - radius) ||
+            (x - worker->best_disparity[x] < radius))
+            out[x] = 0;
+        else
+            out[x] = worker->best_disparity[x];
+    }
+}
+
+
+static void match_band(struct stereo_frame *frame, struct worker *worker)
+{
+    const int radius = window / 2;
+    int y0 = frame->height * worker->index / num_threads;
+    int y1 = frame->height * (worker->index + 1) / num_threads;
+    int y;
+
+    if (cost == COST_CENSUS)
+    {
+        census_transform(frame->left, frame->stride, frame->width,
+                         y0, y1, frame->height, frame->census_left);
+        census_transform(frame->right, frame->stride, frame->width,
+                         y0, y1, frame->height, frame->census_right);
+    }
+    // the window overlaps the neighbouring bands' census rows
+    if (cost == COST_CENSUS)
+    {
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_census_pending == 0)
+            pthread_cond_broadcast(&pool_done);
+        while (pool_census_pending > 0)
+            pthread_cond_wait(&pool_done, &pool_lock);
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    memset(worker->column_sums, 0, num_disparities * frame->width * sizeof(uint16_t));
+    for (y = y0 - radius; y < y0 + radius; y++)
+        accumulate_row(frame, worker->column_sums, y, 0);
+    for (y = y0; y < y1; y++)
+    {
+        accumulate_row(frame, worker->column_sums, y + radius, 0);
+        select_disparity(frame, worker, y);
+        accumulate_row(frame, worker->column_sums, y - radius, 1);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Thread pool
+
+static void *worker_thread(void *arg)
+{
+    struct worker *worker = arg;
+    unsigned int generation = 0;
+
+    while (1)
+    {
+        struct stereo_frame *frame;
+
+        pthread_mutex_lock(&pool_lock);
+        while (!pool_exit && (pool_generation == generation))
+            pthread_cond_wait(&pool_start, &pool_lock);
+        if (pool_exit)
+        {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        generation = pool_generation;
+        frame = pool_frame;
+        pthread_mutex_unlock(&pool_lock);
+
+        match_band(frame, worker);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_pending == 0)
+            pthread_cond_broadcast(&pool_done);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+
+/* Called with the workers idle. */
+static int resize_workers(int width)
+{
+    static int buffer_width = 0;
+    int i;
+
+    if (width <= buffer_width)
+        return 0;
+    for (i = 0; i < num_threads; i++)
+    {
+        struct worker *worker = &workers[i];
+        free(worker->column_sums);
+        free(worker->best_cost);
+        free(worker->best_disparity);
+        worker->column_sums = malloc(num_disparities * width * sizeof(uint16_t));
+        worker->best_cost = malloc(width * sizeof(uint32_t));
+        worker->best_disparity = malloc(width);
+        if (!worker->column_sums || !worker->best_cost || !worker->best_disparity)
+        {
+            buffer_width = 0;
+            return -ENOMEM;
+        }
+    }
+    buffer_width = width;
+    return 0;
+}
+
+
+static int start_workers(void)
+{
+    int i;
+
+    for (i = 0; i < num_threads; i++)
+    {
+        struct worker *worker = &workers[i];
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0)
+        {
+            num_threads = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static void stop_workers(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_exit = 1;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 0; i < num_threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].column_sums);
+        free(workers[i].best_cost);
+        free(workers[i].best_disparity);
+    }
+}
+
+
+static int compute_disparity(struct stereo_frame *frame)
+{
+    if (resize_workers(frame->width) != 0)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_frame = frame;
+    pool_pending = num_threads;
+    pool_census_pending = num_threads;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_start);
+    while (pool_pending > 0)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+
+//------------------------------------------------------------------------------
+
+static int process_file(const char *source, const char *dest, struct stereo_frame *frame)
+{
+    int ret;
+
+    ret = load_frame(source, frame);
+    if (ret != 0)
+    {
+        fprintf(stderr, "Failed to load %s\n", source);
+        return ret;
+    }
+    if (frame->width < window + num_disparities)
+    {
+        fprintf(stderr, "%s is too small to match\n", source);
+        return -1;
+    }
+    ret = compute_disparity(frame);
+    if (ret != 0)
+        return ret;
+    ret = save_disparity(dest, frame);
+    if (ret != 0)
+        fprintf(stderr, "Failed to write %s\n", dest);
+    return ret;
+}
+
+
+static int run_batch(struct stereo_frame *frame)
+{
+    struct dirent *ent;
+    DIR *dir;
+    int count = 0;
+
+    if (batch_output_dir == NULL)
+    {
+        if (asprintf((char **)&batch_output_dir, "%s/disparity", batch_dir) < 0)
+            return -ENOMEM;
+    }
+    if ((mkdir(batch_output_dir, 0755) != 0) && (errno != EEXIST))
+    {
+        fprintf(stderr, "Failed to create %s\n", batch_output_dir);
+        return -errno;
+    }
+
+    dir = opendir(batch_dir);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\n", batch_dir);
+        return -errno;
+    }
+    while (!terminated && ((ent = readdir(dir)) != NULL))
+    {
+        size_t len = strlen(ent->d_name);
+        struct stat source_st, dest_st;
+        char *source, *dest;
+
+        if ((len < 5) || (strcmp(ent->d_name + len - 4, ".jpg") != 0))
+            continue;
+        if ((asprintf(&source, "%s/%s", batch_dir, ent->d_name) < 0) ||
+            (asprintf(&dest, "%s/%.*s_disparity.jpg", batch_output_dir, (int)(len - 4), ent->d_name) < 0))
+            break;
+        // skip frames that are already done
+        if ((stat(source, &source_st) == 0) && S_ISREG(source_st.st_mode) &&
+            ((stat(dest, &dest_st) != 0) || (dest_st.st_mtime < source_st.st_mtime)))
+        {
+            int64_t start = monotonic_ms();
+            if (process_file(source, dest, frame) == 0)
+            {
+                count++;
+                fprintf(stdout, "%s %d ms\n", dest, (int)(monotonic_ms() - start));
+                fflush(stdout);
+            }
+        }
+        free(source);
+        free(dest);
+    }
+    closedir(dir);
+    fprintf(stderr, "Processed %d frames\n", count);
+    return 0;
+}
+
+
+static int run_live(struct stereo_frame *frame)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    unsigned int seq = 0;
+    char *source;
+    int inotify_fd;
+    int ret = 0;
+
+    if (asprintf(&source, "%s/%s", stream_dir, stream_file) < 0)
+        return -ENOMEM;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+    {
+        ret = -errno;
+        fprintf(stderr, "Failed to initialise inotify\n");
+        goto error_ret;
+    }
+    if (inotify_add_watch(inotify_fd, stream_dir, IN_MOVED_TO | IN_CLOSE_WRITE) == -1)
+    {
+        ret = -errno;
+        fprintf(stderr, "Failed to watch %s\n", stream_dir);
+        goto error_close_inotify;
+    }
+    fprintf(stderr, "Watching %s, writing %s\n", source, output_path);
+
+    while (!terminated)
+    {
+        struct pollfd fds[1] = { { .fd = inotify_fd, .events = POLLIN } };
+        int new_frame = 0;
+        ssize_t len;
+
+        if (poll(fds, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ret = -errno;
+            break;
+        }
+        // drain the queue so a slow frame skips straight to the latest one
+        while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+        {
+            char *ptr;
+            for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len)
+            {
+                const struct inotify_event *event = (const struct inotify_event *)ptr;
+                if (event->len && (strcmp(event->name, stream_file) == 0))
+                    new_frame = 1;
+            }
+        }
+        if (new_frame)
+        {
+            int64_t start = monotonic_ms();
+            if (process_file(source, output_path, frame) == 0)
+            {
+                fprintf(stdout, "disparity %u %d\n", ++seq, (int)(monotonic_ms() - start));
+                fflush(stdout);
+            }
+        }
+    }
+
+error_close_inotify:
+    close(inotify_fd);
+error_ret:
+    free(source);
+    return ret;
+}
+
+
+void syntax(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -d <dir>      Directory raspistill writes the stream to (default %s)\n", stream_dir);
+    fprintf(stderr, " -f <file>     Stream file name (default %s)\n", stream_file);
+    fprintf(stderr, " -o <file>     Live disparity output (default %s)\n", output_path);
+    fprintf(stderr, " -b <dir>      Batch mode, process every .jpg in <dir>\n");
+    fprintf(stderr, " -O <dir>      Batch output directory (default <dir>/disparity)\n");
+    fprintf(stderr, " -w <width>    Minimum width of one eye to match at (default %d)\n", eye_width);
+    fprintf(stderr, " -n <count>    Number of disparities, multiple of 16 (default %d)\n", num_disparities);
+    fprintf(stderr, " -k <size>     Odd block size, 3 to %d (default %d)\n", MAX_WINDOW, window);
+    fprintf(stderr, " -c            Census transform cost instead of SAD\n");
+    fprintf(stderr, " -s            Swap eyes (right eye is on the left of the frame)\n");
+    fprintf(stderr, " -t <threads>  Number of worker threads (default: number of CPUs)\n");
+    fprintf(stderr, " -h            display this information\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct stereo_frame frame = { 0 };
+    int ret;
+    int opt;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "d:f:o:b:O:w:n:k:cst:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': stream_dir = optarg; if (strlen(stream_dir) == 0) syntax(); break;
+            case 'f': stream_file = optarg; if (strlen(stream_file) == 0) syntax(); break;
+            case 'o': output_path = optarg; if (strlen(output_path) == 0) syntax(); break;
+            case 'b': batch_dir = optarg; if (strlen(batch_dir) == 0) syntax(); break;
+            case 'O': batch_output_dir = optarg; if (strlen(batch_output_dir) == 0) syntax(); break;
+            case 'w': eye_width = atoi(optarg); if ((eye_width < 64) || (eye_width > 4096)) syntax(); break;
+            case 'n': num_disparities = atoi(optarg);
+                      if ((num_disparities < 16) || (num_disparities > MAX_DISPARITIES) || (num_disparities % 16)) syntax();
+                      break;
+            case 'k': window = atoi(optarg); if ((window < 3) || (window > MAX_WINDOW) || !(window & 1)) syntax(); break;
+            case 'c': cost = COST_CENSUS; break;
+            case 's': swap_eyes = 1; break;
+            case 't': num_threads = atoi(optarg); if (num_threads < 1) syntax(); break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+
+    if (num_threads == 0)
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    signal(SIGINT, handle_terminate_signal);
+    signal(SIGTERM, handle_terminate_signal);
+
+    ret = start_workers();
+    if (ret != 0)
+    {
+        fprintf(stderr, "Failed to start worker threads\n");
+        stop_workers();
+        return ret;
+    }
+
+    if (batch_dir)
+        ret = run_batch(&frame);
+    else
+        ret = run_live(&frame);
+
+    stop_workers();
+    free(frame.data);
+    free(frame.census_left);
+    free(frame.census_right);
+    free(frame.disparity);
+    return ret;
+}
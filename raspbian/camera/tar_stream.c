@@ -0,0 +1,779 @@
+/*
+ * Capture archive server.
+ *
+ * Serves the captured images as an uncompressed tar over HTTP without
+ * touching userspace buffers for the file data: tar headers and padding are
+ * generated here and the file bodies are sent straight from the page cache
+ * with sendfile().
+ *
+ *     GET /download                 all images
+ *     GET /download?since=<n>       images after frame n, or modified after
+ *                                   unix time n if n >= 1000000000
+ *     GET /download?until=<n>       images up to and including frame n,
+ *                                   combines with since
+ *
+ * The archive layout is deterministic: images are ordered by frame number
+ * and every header field is derived from the file name, size and mtime, so
+ * the same request always produces the same bytes. That makes Range requests
+ * safe to resume with. X-Last-Frame is the last frame in the archive, or
+ * until when given. A resume passes it back as until= so frames captured
+ * since are left out and the ETag, which covers the layout and the last
+ * frame, still matches its If-Range; a stale If-Range gets the whole
+ * archive again. The next incremental sync passes X-Last-Frame as since=.
+ * HEAD returns just the size.
+ *
+ * The listing is read on the poll loop, so other clients stall while a
+ * request scans the directory; that time grows with the number of images.
+ *
+ * A file that is deleted or truncated while being sent is padded with zeros
+ * so the archive length never changes mid transfer.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+#define MAX_CLIENTS             4
+#define MAX_REQUEST_LENGTH      2048
+#define MAX_HEADER_LENGTH       512
+#define TAR_BLOCK               512
+#define TAR_NAME_LENGTH         100
+#define SINCE_TIMESTAMP_MIN     1000000000L
+
+
+struct archive_entry
+{
+    char name[TAR_NAME_LENGTH];
+    off_t size;
+    time_t mtime;
+    long frame;
+    off_t offset;               // of the entry's tar header in the archive
+};
+
+
+enum client_state
+{
+    CLIENT_FREE = 0,
+    CLIENT_READ_REQUEST,
+    CLIENT_SEND_HEADER,
+    CLIENT_SEND_ARCHIVE,
+};
+
+
+struct client
+{
+    int fd;
+    enum client_state state;
+    char request[MAX_REQUEST_LENGTH];
+    int request_length;
+    char header[MAX_HEADER_LENGTH];
+    int header_length;
+    int header_offset;
+    int head_only;
+    struct archive_entry *entries;
+    int num_entries;
+    off_t archive_size;
+    off_t pos;                  // next archive byte to send
+    off_t end;                  // one past the last byte to send
+    int entry;                  // entry containing pos
+    int file_fd;                // body of entries[entry], -1 closed, -2 gone
+    int block_entry;            // entry whose header is in block
+    char block[TAR_BLOCK];
+};
+
+
+static int terminated = 0;
+static const char *progname = "";
+static const char *capture_dir = "/storage/photos";
+static int port = 8081;
+static struct client clients[MAX_CLIENTS];
+static const char zeros[16 * TAR_BLOCK];
+
+
+static void handle_terminate_signal(int sig)
+{
+    if ((sig == SIGTERM) || (sig == SIGINT))
+        terminated = 1;
+}
+
+
+static off_t padded_size(off_t size)
+{
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+
+static long frame_number(const char *name)
+{
+    const char *ext = name + strlen(name) - 4;
+    const char *p = ext;
+
+    while ((p > name) && (p[-1] >= '0') && (p[-1] <= '9'))
+        p--;
+    return (p < ext) ? strtol(p, NULL, 10) : -1;
+}
+
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct archive_entry *ea = a;
+    const struct archive_entry *eb = b;
+
+    if (ea->frame != eb->frame)
+        return (ea->frame < eb->frame) ? -1 : 1;
+    return strcmp(ea->name, eb->name);
+}
+
+
+//------------------------------------------------------------------------------
+// Archive layout
+
+/* List the images passing the since and until filters, ordered and laid
+ * out. until < 0 takes every frame. */
+static int build_archive(struct client *client, long since, long until)
+{
+    struct archive_entry *entries = NULL;
+    int num_entries = 0;
+    int max_entries = 0;
+    struct dirent *ent;
+    off_t offset = 0;
+    DIR *dir;
+    int i;
+
+    dir = opendir(capture_dir);
+    if (dir == NULL)
+        return -errno;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        struct stat st;
+
+        if ((len < 5) || (len >= TAR_NAME_LENGTH) || (strcmp(ent->d_name + len - 4, ".jpg") != 0))
+            continue;
+        if ((fstatat(dirfd(dir), ent->d_name, &st, 0) != 0) || !S_ISREG(st.st_mode))
+            continue;
+        long frame = frame_number(ent->d_name);
+        if (since >= SINCE_TIMESTAMP_MIN)
+        {
+            if (st.st_mtime <= since)
+                continue;
+        }
+        else if ((since >= 0) && (frame <= since))
+            continue;
+        if ((until >= 0) && (frame > until))
+            continue;
+
+        if (num_entries == max_entries)
+        {
+            struct archive_entry *grown;
+            max_entries = max_entries ? max_entries * 2 : 256;
+            grown = realloc(entries, max_entries * sizeof(struct archive_entry));
+            if (grown == NULL)
+            {
+                free(entries);
+                closedir(dir);
+                return -ENOMEM;
+            }
+            entries = grown;
+        }
+        struct archive_entry *entry = &entries[num_entries++];
+        strcpy(entry->name, ent->d_name);
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+        entry->frame = frame;
+    }
+    closedir(dir);
+
+    qsort(entries, num_entries, sizeof(struct archive_entry), compare_entries);
+    for (i = 0; i < num_entries; i++)
+    {
+        entries[i].offset = offset;
+        offset += TAR_BLOCK + padded_size(entries[i].size);
+    }
+
+    client->entries = entries;
+    client->num_entries = num_entries;
+    // two zero blocks end the archive
+    client->archive_size = offset + 2 * TAR_BLOCK;
+    return 0;
+}
+
+
+/* FNV-1a over everything the archive bytes depend on, and the last frame
+ * so a resume with until=<last frame> gets the same tag. */
+static uint64_t archive_etag(const struct client *client, long last_frame)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *p;
+    int i;
+
+    for (p = (const unsigned char *)&last_frame; p < (const unsigned char *)(&last_frame + 1); p++)
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+    for (i = 0; i < client->num_entries; i++)
+    {
+        const struct archive_entry *entry = &client->entries[i];
+        const unsigned char *p;
+        int64_t values[2] = { entry->size, entry->mtime };
+
+        for (p = (const unsigned char *)entry->name; *p; p++)
+            hash = (hash ^ *p) * 0x100000001b3ULL;
+        for (p = (const unsigned char *)values; p < (const unsigned char *)(values + 2); p++)
+            hash = (hash ^ *p) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+static void tar_header(const struct archive_entry *entry, char *block)
+{
+    unsigned int sum = 0;
+    int i;
+
+    memset(block, 0, TAR_BLOCK);
+    memcpy(block, entry->name, strlen(entry->name));
+    snprintf(block + 100, 8, "%07o", 0644);
+    snprintf(block + 108, 8, "%07o", 0);
+    snprintf(block + 116, 8, "%07o", 0);
+    snprintf(block + 124, 12, "%011llo", (unsigned long long)entry->size);
+    snprintf(block + 136, 12, "%011llo", (unsigned long long)entry->mtime);
+    block[156] = '0';
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    // checksum is computed with its own field set to spaces
+    memset(block + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)block[i];
+    snprintf(block + 148, 7, "%06o", sum);
+}
+
+
+/* Index of the entry containing archive offset pos, num_entries if none. */
+static int find_entry(const struct client *client, off_t pos)
+{
+    int lo = 0;
+    int hi = client->num_entries;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        const struct archive_entry *entry = &client->entries[mid];
+        if (pos < entry->offset)
+            hi = mid;
+        else if (pos >= entry->offset + TAR_BLOCK + padded_size(entry->size))
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return client->num_entries;
+}
+
+
+//------------------------------------------------------------------------------
+// HTTP
+
+static void client_close(struct client *client)
+{
+    if (client->fd != -1)
+        close(client->fd);
+    if (client->file_fd >= 0)
+        close(client->file_fd);
+    free(client->entries);
+    memset(client, 0, sizeof(struct client));
+    client->fd = -1;
+    client->file_fd = -1;
+}
+
+
+static void client_respond(struct client *client, const char *status)
+{
+    client->header_length = snprintf(client->header, sizeof(client->header),
+                                     "HTTP/1.1 %s\r\n"
+                                     "Content-Length: 0\r\n"
+                                     "Connection: close\r\n"
+                                     "\r\n",
+                                     status);
+    client->header_offset = 0;
+    client->head_only = 1;
+    client->state = CLIENT_SEND_HEADER;
+}
+
+
+/* Value of query parameter name as a number, or -1 if it is not there.
+ * query points at the '?', parameters are separated by '&'. */
+static long query_param(const char *query, const char *name)
+{
+    size_t name_len = strlen(name);
+
+    while (query)
+    {
+        query++;
+        if ((strncmp(query, name, name_len) == 0) && (query[name_len] == '='))
+            return strtol(query + name_len + 1, NULL, 10);
+        query = strchr(query, '&');
+    }
+    return -1;
+}
+
+
+/* Value of request header name, copied into value, or NULL. */
+static const char *request_header(const struct client *client, const char *name,
+                                  char *value, size_t size)
+{
+    const char *line = strstr(client->request, "\n");
+    size_t name_len = strlen(name);
+
+    while (line && line[1])
+    {
+        line++;
+        if ((strncasecmp(line, name, name_len) == 0) && (line[name_len] == ':'))
+        {
+            const char *p = line + name_len + 1;
+            size_t len = 0;
+            while (*p == ' ')
+                p++;
+            while (p[len] && (p[len] != '\r') && (p[len] != '\n') && (len < size - 1))
+                len++;
+            memcpy(value, p, len);
+            value[len] = 0;
+            return value;
+        }
+        line = strstr(line, "\n");
+    }
+    return NULL;
+}
+
+
+static void client_parse_request(struct client *client)
+{
+    char method[8];
+    char path[512];
+    char range[128];
+    char value[128];
+    char etag[24];
+    const char *query;
+    long since;
+    long until;
+    long last_frame;
+    off_t start, end;
+    int partial = 0;
+
+    if (sscanf(client->request, "%7s %511s", method, path) != 2)
+    {
+        client_close(client);
+        return;
+    }
+    if (strcmp(method, "HEAD") == 0)
+        client->head_only = 1;
+    else if (strcmp(method, "GET") != 0)
+    {
+        client_respond(client, "405 Method Not Allowed");
+        return;
+    }
+    if (strncmp(path, "/download", strlen("/download")) != 0)
+    {
+        client_respond(client, "404 Not Found");
+        return;
+    }
+    query = strchr(path, '?');
+    since = query_param(query, "since");
+    until = query_param(query, "until");
+
+    if (build_archive(client, since, until) != 0)
+    {
+        client_respond(client, "500 Internal Server Error");
+        return;
+    }
+    if (until >= 0)
+        last_frame = until;
+    else
+        last_frame = client->num_entries ? client->entries[client->num_entries - 1].frame : since;
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)archive_etag(client, last_frame));
+
+    start = 0;
+    end = client->archive_size - 1;
+    if (request_header(client, "Range", range, sizeof(range)) &&
+        // a stale If-Range means the archive changed, so send all of it
+        (!request_header(client, "If-Range", value, sizeof(value)) || (strcmp(value, etag) == 0)))
+    {
+        long long range_start, range_end;
+        if (sscanf(range, "bytes=%lld-%lld", &range_start, &range_end) == 2)
+            partial = 1;
+        else if (sscanf(range, "bytes=%lld-", &range_start) == 1)
+        {
+            range_end = end;
+            partial = 1;
+        }
+        if (partial)
+        {
+            if (range_end > end)
+                range_end = end;
+            if ((range_start < 0) || (range_start > range_end))
+            {
+                client->header_length = snprintf(client->header, sizeof(client->header),
+                                                 "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                                 "Content-Range: bytes */%lld\r\n"
+                                                 "Content-Length: 0\r\n"
+                                                 "Connection: close\r\n"
+                                                 "\r\n",
+                                                 (long long)client->archive_size);
+                client->header_offset = 0;
+                client->head_only = 1;
+                client->state = CLIENT_SEND_HEADER;
+                return;
+            }
+            start = range_start;
+            end = range_end;
+        }
+    }
+
+    client->header_length = snprintf(client->header, sizeof(client->header),
+                                     "HTTP/1.1 %s\r\n"
+                                     "Content-Type: application/x-tar\r\n"
+                                     "Content-Length: %lld\r\n"
+                                     "Accept-Ranges: bytes\r\n"
+                                     "ETag: %s\r\n"
+                                     "X-Last-Frame: %ld\r\n"
+                                     "Content-Disposition: attachment; filename=images_%ld-%ld.tar\r\n"
+                                     "Connection: close\r\n",
+                                     partial ? "206 Partial Content" : "200 OK",
+                                     (long long)(end - start + 1),
+                                     etag,
+                                     last_frame,
+                                     client->num_entries ? client->entries[0].frame : 0,
+                                     client->num_entries ? client->entries[client->num_entries - 1].frame : 0);
+    if (partial)
+        client->header_length += snprintf(client->header + client->header_length,
+                                          sizeof(client->header) - client->header_length,
+                                          "Content-Range: bytes %lld-%lld/%lld\r\n",
+                                          (long long)start, (long long)end,
+                                          (long long)client->archive_size);
+    client->header_length += snprintf(client->header + client->header_length,
+                                      sizeof(client->header) - client->header_length,
+                                      "\r\n");
+    client->header_offset = 0;
+    client->pos = start;
+    client->end = end + 1;
+    client->entry = find_entry(client, start);
+    client->block_entry = -1;
+    client->state = CLIENT_SEND_HEADER;
+}
+
+
+static void client_read(struct client *client)
+{
+    ssize_t len;
+
+    len = read(client->fd, client->request + client->request_length,
+               sizeof(client->request) - 1 - client->request_length);
+    if (len <= 0)
+    {
+        if ((len == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+            client_close(client);
+        return;
+    }
+    if (client->state != CLIENT_READ_REQUEST)
+        return; // ignore anything sent after the request
+    client->request_length += len;
+    client->request[client->request_length] = 0;
+    if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n"))
+        client_parse_request(client);
+    else if (client->request_length >= sizeof(client->request) - 1)
+        client_close(client);
+}
+
+
+/* Send as much of the archive as the socket takes, returns -errno on error. */
+static ssize_t client_send_archive(struct client *client)
+{
+    while (client->pos < client->end)
+    {
+        off_t limit = client->end - client->pos;
+        ssize_t len;
+
+        if (client->entry >= client->num_entries)
+        {
+            // end of archive marker
+            len = write(client->fd, zeros, (limit < sizeof(zeros)) ? limit : sizeof(zeros));
+        }
+        else
+        {
+            const struct archive_entry *entry = &client->entries[client->entry];
+            off_t rel = client->pos - entry->offset;
+
+            if (rel >= TAR_BLOCK + padded_size(entry->size))
+            {
+                if (client->file_fd >= 0)
+                    close(client->file_fd);
+                client->file_fd = -1;
+                client->entry++;
+                continue;
+            }
+            if (rel < TAR_BLOCK)
+            {
+                off_t n = TAR_BLOCK - rel;
+                if (client->block_entry != client->entry)
+                {
+                    tar_header(entry, client->block);
+                    client->block_entry = client->entry;
+                }
+                len = write(client->fd, client->block + rel, (limit < n) ? limit : n);
+            }
+            else if (rel < TAR_BLOCK + entry->size)
+            {
+                off_t offset = rel - TAR_BLOCK;
+                off_t n = entry->size - offset;
+                if (limit < n)
+                    n = limit;
+                if (client->file_fd == -1)
+                {
+                    char *path;
+                    if (asprintf(&path, "%s/%s", capture_dir, entry->name) < 0)
+                        return -ENOMEM;
+                    client->file_fd = open(path, O_RDONLY | O_CLOEXEC);
+                    free(path);
+                    if (client->file_fd == -1)
+                        client->file_fd = -2;
+                }
+                if (client->file_fd >= 0)
+                {
+                    len = sendfile(client->fd, client->file_fd, &offset, n);
+                    if (len == 0)
+                    {
+                        // truncated underneath us, keep the promised length
+                        close(client->file_fd);
+                        client->file_fd = -2;
+                        continue;
+                    }
+                }
+                else
+                    len = write(client->fd, zeros, (n < sizeof(zeros)) ? n : sizeof(zeros));
+            }
+            else
+            {
+                off_t n = TAR_BLOCK + padded_size(entry->size) - rel;
+                len = write(client->fd, zeros, (limit < n) ? limit : n);
+            }
+        }
+        if (len < 0)
+            return -errno;
+        client->pos += len;
+    }
+    return 0;
+}
+
+
+static void client_write(struct client *client)
+{
+    ssize_t len;
+
+    if (client->state == CLIENT_SEND_HEADER)
+    {
+        len = write(client->fd, client->header + client->header_offset,
+                    client->header_length - client->header_offset);
+        if (len < 0)
+            goto write_error;
+        client->header_offset += len;
+        if (client->header_offset < client->header_length)
+            return;
+        if (client->head_only)
+        {
+            client_close(client);
+            return;
+        }
+        client->state = CLIENT_SEND_ARCHIVE;
+    }
+    if (client->state == CLIENT_SEND_ARCHIVE)
+    {
+        len = client_send_archive(client);
+        if (len < 0)
+        {
+            errno = -len;
+            goto write_error;
+        }
+        client_close(client);
+    }
+    return;
+
+write_error:
+    if ((errno != EAGAIN) && (errno != EINTR))
+        client_close(client);
+}
+
+
+static void accept_clients(int listen_fd)
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        int i;
+        for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            if (clients[i].state == CLIENT_FREE)
+                break;
+        }
+        if (i >= MAX_CLIENTS)
+        {
+            close(fd);
+            continue;
+        }
+        clients[i].fd = fd;
+        clients[i].state = CLIENT_READ_REQUEST;
+    }
+}
+
+
+static int open_listen_socket(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -errno;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+        (listen(fd, MAX_CLIENTS) == -1))
+    {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+
+//------------------------------------------------------------------------------
+
+void syntax(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -d <dir>      Capture directory (default %s)\n", capture_dir);
+    fprintf(stderr, " -p <port>     HTTP port (default %d)\n", port);
+    fprintf(stderr, " -h            display this information\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Serves /download[?since=<frame|unix time>][&until=<frame>] as a tar archive.\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    int opt;
+    int listen_fd;
+    int i;
+
+    progname = argv[0];
+
+    while ((opt = getopt(argc, argv, "d:p:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': capture_dir = optarg; if (strlen(capture_dir) == 0) syntax(); break;
+            case 'p': port = atoi(optarg); if ((port <= 0) || (port > 65535)) syntax(); break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        clients[i].fd = -1;
+        clients[i].file_fd = -1;
+    }
+
+    signal(SIGINT, handle_terminate_signal);
+    signal(SIGTERM, handle_terminate_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = open_listen_socket(port);
+    if (listen_fd < 0)
+    {
+        fprintf(stderr, "Failed to listen on port %d\n", port);
+        return listen_fd;
+    }
+    fprintf(stderr, "Serving %s on port %d\n", capture_dir, port);
+
+    while (!terminated)
+    {
+        struct pollfd fds[1 + MAX_CLIENTS];
+        int nfds = 0;
+
+        fds[nfds].fd = listen_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            struct client *client = &clients[i];
+            fds[nfds].fd = client->fd;
+            fds[nfds].events = 0;
+            if (client->state != CLIENT_FREE)
+                fds[nfds].events |= POLLIN;
+            if ((client->state == CLIENT_SEND_HEADER) ||
+                (client->state == CLIENT_SEND_ARCHIVE))
+                fds[nfds].events |= POLLOUT;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ret = -errno;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            accept_clients(listen_fd);
+
+        for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            struct client *client = &clients[i];
+            short revents = fds[1 + i].revents;
+            if ((client->state == CLIENT_FREE) || (fds[1 + i].fd != client->fd))
+                continue;
+            if (revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                client_close(client);
+                continue;
+            }
+            if (revents & POLLIN)
+                client_read(client);
+            if ((client->state != CLIENT_FREE) && (revents & POLLOUT))
+                client_write(client);
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        client_close(&clients[i]);
+    close(listen_fd);
+    return ret;
+}
@@ -43,35 +43,6 @@ static void vector_normalize(struct sensor_axis_t *a)
 }
 
 
-static void get_pitch_roll(struct sensor_axis_t *accel, double *roll, double *pitch)
-{
-    /* roll: Rotation around the longitudinal axis (the plane body, 'X axis'). -90<=roll<=90    */
-    /* roll is positive and increasing when moving downward                                     */
-    /*                                                                                          */
-    /*                                 y                                                        */
-    /*             roll = atan(-----------------)                                               */
-    /*                          sqrt(x^2 + z^2)                                                 */
-    /* where:  x, y, z are returned value from accelerometer sensor                             */
-
-    /* pitch: Rotation around the lateral axis (the wing span, 'Y axis'). -180<=pitch<=180)     */
-    /* pitch is positive and increasing when moving upwards                                     */
-    /*                                                                                          */
-    /*                                 x                                                        */
-    /*            pitch = atan(-----------------)                                               */
-    /*                          sqrt(y^2 + z^2)                                                 */
-    /* where:  x, y, z are returned value from accelerometer sensor                             */
-//#ifdef RESTRICT_PITCH
-//    *roll = to_degrees(atan2(accel->y, accel->z));
-//    *pitch = to_degrees(atan(accel->x / sqrt(accel->y * accel->y + accel->z * accel->z)));
-//#else
-//    *roll = to_degrees(atan(accel->y / sqrt(accel->x * accel->x + accel->z * accel->z)));
-//    *pitch = to_degrees(atan2(accel->x, accel->z));
-//#endif
-    *roll = to_degrees(atan(accel->y / sqrt(accel->x * accel->x + accel->z * accel->z)));
-    *pitch = to_degrees(atan(accel->x / sqrt(accel->y * accel->y + accel->z * accel->z)));
-}
-
-
 static void get_yaw(struct sensor_axis_t *magn, double roll, double pitch, double *yaw)
 {
     /* Sensor rotates around Z-axis                                                           */
@@ -133,55 +104,71 @@ static double heading(struct sensor_axis_t *magn,
 //}
 
 
-void orientation_show(struct sensor_axis_t *accel,
-                      struct sensor_axis_t *gyro,
-                      struct sensor_axis_t *magn,
-                      double magnetic_declination_mrad,
-                      int pressure,
-                      double temperature)
+void orientation_compute_batch(const struct ahrs_batch *batch,
+                               double magnetic_declination_mrad,
+                               struct orientation_batch *out)
 {
+    const double *restrict ax = batch->accel_x;
+    const double *restrict ay = batch->accel_y;
+    const double *restrict az = batch->accel_z;
+    const double *restrict mx = batch->magn_x;
+    const double *restrict my = batch->magn_y;
+    const double *restrict mz = batch->magn_z;
+    double *restrict roll = out->roll;
+    double *restrict pitch = out->pitch;
+    double *restrict yaw = out->yaw;
+    double roll_tan[AHRS_BATCH_MAX];
+    double pitch_tan[AHRS_BATCH_MAX];
+    double xh[AHRS_BATCH_MAX];
+    double yh[AHRS_BATCH_MAX];
     double magnetic_declination_degrees = to_degrees(magnetic_declination_mrad/1000);
-    double roll;
-    double pitch;
-    //double yaw_raw;
-    double yaw;
-
-
-    get_pitch_roll(accel, &roll, &pitch);
-
-    //struct sensor_axis_t from = {1,0,0};
-    //yaw = heading(magn, accel, &from) + magnetic_declination_degrees;
-    //if (yaw < 0.0)
-    //    yaw += 360.0;
-
-
-
-
-    // Euler method heading
-    double rollRadians = to_radians(roll);
-    double pitchRadians = to_radians(pitch);
-    double cosRoll = (float)cos((-1)*rollRadians);
-    double sinRoll = (float)sin((-1)*rollRadians);
-    double cosPitch = (float)cos(pitchRadians);
-    double sinPitch = (float)sin(pitchRadians);
-    /* The tilt compensation algorithm                            */
-    /* Xh = X.cosPitch + Z.sinPitch                               */
-    /* Yh = X.sinRoll.sinPitch + Y.cosRoll - Z.sinRoll.cosPitch   */
-    double Xh = magn->x * cosPitch + magn->z * sinPitch;
-    double Yh = magn->x * sinRoll * sinPitch + magn->y * cosRoll - magn->z * sinRoll * cosPitch;
-    yaw = to_degrees(atan2(Yh, Xh)) + magnetic_declination_degrees;
-    if (yaw < 0.0)
-        yaw += 360.0;
-
-
+    int n = batch->count < AHRS_BATCH_MAX ? batch->count : AHRS_BATCH_MAX;
+    int i;
+
+    // roll = atan(y / sqrt(x^2 + z^2)), pitch = atan(x / sqrt(y^2 + z^2))
+    // from the accel vector, then the magnetometer is tilt compensated:
+    //     Xh = X.cosPitch + Z.sinPitch
+    //     Yh = X.sinRoll.sinPitch + Y.cosRoll - Z.sinRoll.cosPitch
+    // with the sines and cosines of -roll and pitch taken straight from
+    // the accel vector instead of going through atan() and back:
+    //     sin(roll)  = y / |a|    cos(roll)  = sqrt(x^2 + z^2) / |a|
+    //     sin(pitch) = x / |a|    cos(pitch) = sqrt(y^2 + z^2) / |a|
+    // With -fno-math-errno (see the Makefile) sqrt is inlined, so this
+    // loop has no calls or branches and vectorizes.
+    for (i = 0; i < n; i++)
+    {
+        double xx = ax[i] * ax[i];
+        double yy = ay[i] * ay[i];
+        double zz = az[i] * az[i];
+        double inv_norm = 1.0 / sqrt(xx + yy + zz);
+        double roll_h = sqrt(xx + zz);
+        double pitch_h = sqrt(yy + zz);
+        double cosRoll = roll_h * inv_norm;
+        double sinRoll = -ay[i] * inv_norm;     // of -roll
+        double cosPitch = pitch_h * inv_norm;
+        double sinPitch = ax[i] * inv_norm;
+        roll_tan[i] = ay[i] / roll_h;
+        pitch_tan[i] = ax[i] / pitch_h;
+        xh[i] = mx[i] * cosPitch + mz[i] * sinPitch;
+        yh[i] = mx[i] * sinRoll * sinPitch + my[i] * cosRoll - mz[i] * sinRoll * cosPitch;
+    }
 
-    static int print_rate_divider = 0;
-    print_rate_divider++;
-    if (print_rate_divider >= 6)
+    for (i = 0; i < n; i++)
     {
-        print_rate_divider = 0;
-        fprintf(stdout, "% 7.2f % 7.2f % 7.2f ", roll, pitch, yaw);
-        fprintf(stdout, "%8d %6.1f", pressure, temperature);
-        fprintf(stdout, "\n");
+        double y = to_degrees(atan2(yh[i], xh[i])) + magnetic_declination_degrees;
+        roll[i] = to_degrees(atan(roll_tan[i]));
+        pitch[i] = to_degrees(atan(pitch_tan[i]));
+        yaw[i] = y < 0.0 ? y + 360.0 : y;
     }
+    out->count = n;
+}
+
+
+void orientation_show(struct orientation_t *orientation,
+                      int pressure,
+                      double temperature)
+{
+    fprintf(stdout, "% 7.2f % 7.2f % 7.2f ", orientation->roll, orientation->pitch, orientation->yaw);
+    fprintf(stdout, "%8d %6.1f", pressure, temperature);
+    fprintf(stdout, "\n");
 }
@@ -10,10 +10,53 @@ struct sensor_axis_t
 };
 
 
-void orientation_show(struct sensor_axis_t *accel,
-                      struct sensor_axis_t *gyro,
-                      struct sensor_axis_t *magn,
-                      double magnetic_declination_mrad,
+struct orientation_t
+{
+    double roll;
+    double pitch;
+    double yaw;
+};
+
+
+#define AHRS_BATCH_MAX      128
+
+
+/*
+ * A batch of aligned samples, one row per index, in structure of arrays
+ * form so that orientation_compute_batch() runs over plain arrays.
+ */
+struct ahrs_batch
+{
+    int count;
+    double accel_x[AHRS_BATCH_MAX];
+    double accel_y[AHRS_BATCH_MAX];
+    double accel_z[AHRS_BATCH_MAX];
+    double magn_x[AHRS_BATCH_MAX];
+    double magn_y[AHRS_BATCH_MAX];
+    double magn_z[AHRS_BATCH_MAX];
+    double gyro_x[AHRS_BATCH_MAX];
+    double gyro_y[AHRS_BATCH_MAX];
+    double gyro_z[AHRS_BATCH_MAX];
+};
+
+
+struct orientation_batch
+{
+    int count;
+    double roll[AHRS_BATCH_MAX];
+    double pitch[AHRS_BATCH_MAX];
+    double yaw[AHRS_BATCH_MAX];
+};
+
+
+/* Orientation of every row of batch: roll and pitch from the accelerometer,
+ * tilt compensated magnetic heading as yaw. */
+void orientation_compute_batch(const struct ahrs_batch *batch,
+                               double magnetic_declination_mrad,
+                               struct orientation_batch *out);
+
+/* Print one orientation, the caller picks which rows to show. */
+void orientation_show(struct orientation_t *orientation,
                       int pressure,
                       double temperature);
 
@@ -0,0 +1,1035 @@
+/*
+ * Fit calibration offsets and scales from recorded samples and write them
+ * in the format read_calibration_from_file() parses.
+ *
+ * Samples are either text files of three columns, as written by
+ * test_iio_sensors -M/-A/-G, or binary captures from generic_buffer -o
+ * (raw or decoded, single or multi device; the device whose name matches
+ * the sensor is used).
+ *
+ * Magnetometer and accelerometer samples are fitted with an axis aligned
+ * ellipsoid, as the scripts in calibration/ do, but robustly so that
+ * samples taken during a magnetic disturbance or a jolt do not drag the
+ * fit:
+ *
+ *  ransac  Ellipsoids through random minimal sets of 6 samples are scored
+ *          by the number of samples within -e of their surface (relative
+ *          radius error). Hypotheses are drawn in batches by -j threads
+ *          until the best consensus is found with 99% confidence, then the
+ *          fit is refined by least squares on its inliers.
+ *  irls    Least squares reweighted with Tukey's biweight of the radius
+ *          error, scaled by its median absolute deviation. Cheaper, but
+ *          starts from the plain fit, so it only copes with scattered
+ *          outliers, not with a long disturbance.
+ *  lsq     Plain least squares, what the scripts compute.
+ *
+ * The gyroscope offset is the median of each axis, the sensor is expected
+ * to be still for most of the recording. Every sensor is fitted on its own
+ * thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <endian.h>
+#include <math.h>
+#include "calib.h"
+
+
+#define STANDARD_GRAVITY        9.80665
+#define NUM_PARAMS              6
+#define RANSAC_BATCH            32
+#define RANSAC_MIN_HYPOTHESES   256
+#define RANSAC_MAX_HYPOTHESES   100000
+#define RANSAC_CONFIDENCE       0.99
+#define RANSAC_REFINE_PASSES    3
+#define IRLS_ITERATIONS         30
+#define TUKEY_C                 4.685
+#define MAX_THREADS             16
+
+// Binary capture layout of generic_buffer.c
+#define BIN_MAGIC               "IIOB"
+#define BIN_VERSION             2
+#define BIN_FORMAT_DECODED      1
+#define BIN_TYPE_INT64          2
+#define BIN_NAME_LENGTH         32
+#define BIN_MAX_DEVICES         8
+#define BIN_MAX_CHANNELS        8
+#define BIN_MAX_SCAN_SIZE       1024
+
+struct bin_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t format;
+    uint32_t num_devices;
+    uint32_t record_size;
+};
+
+struct bin_device
+{
+    char name[BIN_NAME_LENGTH];
+    char trigger[BIN_NAME_LENGTH];
+    uint32_t num_channels;
+    uint32_t scan_size;
+    int32_t timestamp;
+    uint32_t reserved;
+};
+
+struct bin_channel
+{
+    char name[BIN_NAME_LENGTH];
+    uint64_t mask;
+    float scale;
+    float offset;
+    uint32_t location;
+    uint8_t bytes;
+    uint8_t bits_used;
+    uint8_t shift;
+    uint8_t be;
+    uint8_t is_signed;
+    uint8_t type;
+    uint8_t reserved[6];
+};
+
+
+enum fit_method
+{
+    FIT_LSQ,
+    FIT_IRLS,
+    FIT_RANSAC,
+};
+
+
+struct samples
+{
+    int n;
+    int size;
+    double *v[3];
+};
+
+
+struct ellipsoid
+{
+    double offset[3];
+    double radius[3];
+};
+
+
+struct fit_job
+{
+    const char *name;
+    const char *path;
+    const char *device_match;   // part of the IIO device name in captures
+    char channel_index_to_axis_map[3];
+    double target_radius;       // 0 for the gyroscope
+    struct calibration_data *calibration;
+    struct samples samples;
+    int inliers;
+    double rms;
+    int ret;
+    pthread_t thread;
+    int threaded;
+};
+
+
+struct ransac_state
+{
+    const struct samples *samples;
+    pthread_mutex_t lock;
+    int next;
+    int needed;
+    int tried;
+    int valid;
+    int best_inliers;
+    int best_hypothesis;
+    struct ellipsoid best;
+};
+
+
+static struct calibration_data accel_calibration =
+{
+    .x_offset = 0.0, .y_offset = 0.0, .z_offset = 0.0,
+    .x_scale  = 1.0, .y_scale  = 1.0, .z_scale  = 1.0
+};
+static struct calibration_data magn_calibration =
+{
+    .x_offset = 0.0, .y_offset = 0.0, .z_offset = 0.0,
+    .x_scale  = 1.0, .y_scale  = 1.0, .z_scale  = 1.0
+};
+static struct calibration_data gyro_calibration =
+{
+    .x_offset = 0.0, .y_offset = 0.0, .z_offset = 0.0,
+    .x_scale  = 1.0, .y_scale  = 1.0, .z_scale  = 1.0
+};
+static double magnetic_declination_mrad = 0.0;
+
+static struct fit_job jobs[] =
+{
+    {
+        .name = "magn",
+        .device_match = "magn",
+        .channel_index_to_axis_map = {'x', 'z', 'y'},
+        .target_radius = 1.0,
+        .calibration = &magn_calibration,
+    },
+    {
+        .name = "accel",
+        .device_match = "accel",
+        .channel_index_to_axis_map = {'x', 'y', 'z'},
+        .target_radius = STANDARD_GRAVITY,
+        .calibration = &accel_calibration,
+    },
+    {
+        .name = "gyro",
+        .device_match = "l3gd20",
+        .channel_index_to_axis_map = {'x', 'y', 'z'},
+        .target_radius = 0.0,
+        .calibration = &gyro_calibration,
+    },
+};
+
+static enum fit_method method = FIT_RANSAC;
+static double threshold = 0.05;
+static int num_threads = 1;
+static int max_hypotheses = RANSAC_MAX_HYPOTHESES;
+static unsigned int seed = 1;
+static const char *progname = "";
+
+#define NUM_JOBS    (sizeof(jobs)/sizeof(jobs[0]))
+
+
+static int add_sample(struct samples *samples, const double *v)
+{
+    int k;
+    if (samples->n == samples->size)
+    {
+        int size = samples->size ? 2 * samples->size : 4096;
+        for (k = 0; k < 3; k++)
+        {
+            double *p = realloc(samples->v[k], size * sizeof(double));
+            if (p == NULL)
+                return -ENOMEM;
+            samples->v[k] = p;
+        }
+        samples->size = size;
+    }
+    for (k = 0; k < 3; k++)
+        samples->v[k][samples->n] = v[k];
+    samples->n++;
+    return 0;
+}
+
+
+static void free_samples(struct samples *samples)
+{
+    int k;
+    for (k = 0; k < 3; k++)
+        free(samples->v[k]);
+    memset(samples, 0, sizeof(*samples));
+}
+
+
+static int read_text_samples(FILE *fp, struct fit_job *job)
+{
+    char line[256];
+    int line_no = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        double v[3];
+        char extra;
+        int n;
+
+        line_no++;
+        n = sscanf(line, "%lf %lf %lf %c", &v[0], &v[1], &v[2], &extra);
+        if (n == EOF)
+            continue;
+        if (n != 3)
+        {
+            fprintf(stderr, "Error: unexpected input data in %s:%d\n", job->path, line_no);
+            return -EINVAL;
+        }
+        if (add_sample(&job->samples, v) < 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+
+static double channel_si(const char *scan, const struct bin_channel *chan, int decoded)
+{
+    uint64_t input;
+    int64_t value;
+    double si;
+
+    if (decoded)
+    {
+        memcpy(&si, scan + chan->location, sizeof(si));
+        return si;
+    }
+    switch (chan->bytes)
+    {
+        case 1: input = *(const uint8_t *)(scan + chan->location); break;
+        case 2:
+        {
+            uint16_t v;
+            memcpy(&v, scan + chan->location, sizeof(v));
+            input = chan->be ? be16toh(v) : le16toh(v);
+            break;
+        }
+        case 4:
+        {
+            uint32_t v;
+            memcpy(&v, scan + chan->location, sizeof(v));
+            input = chan->be ? be32toh(v) : le32toh(v);
+            break;
+        }
+        case 8:
+        {
+            uint64_t v;
+            memcpy(&v, scan + chan->location, sizeof(v));
+            input = chan->be ? be64toh(v) : le64toh(v);
+            break;
+        }
+        default: return 0;
+    }
+    input >>= chan->shift;
+    input &= chan->mask;
+    if (chan->is_signed && (chan->bits_used > 0) && (chan->bits_used < 64))
+    {
+        value = (int64_t)(input << (64 - chan->bits_used)) >> (64 - chan->bits_used);
+        return ((double)value + chan->offset) * chan->scale;
+    }
+    return ((double)input + chan->offset) * chan->scale;
+}
+
+
+static int read_binary_samples(FILE *fp, struct fit_job *job)
+{
+    struct bin_header header;
+    struct bin_device devices[BIN_MAX_DEVICES];
+    struct bin_channel channels[BIN_MAX_DEVICES][BIN_MAX_CHANNELS];
+    int axis_channel[3];
+    int device = -1;
+    int max_scan = 0;
+    char *scan;
+    int d;
+    int k;
+
+    // generic_buffer only writes no record or a struct bin_record
+    if ((fread(&header, sizeof(header), 1, fp) != 1) ||
+        (header.version != BIN_VERSION) ||
+        ((header.record_size != 0) && (header.record_size != 2 * sizeof(uint32_t))) ||
+        (header.num_devices == 0) || (header.num_devices > BIN_MAX_DEVICES))
+    {
+        fprintf(stderr, "Error: %s is not a supported capture\n", job->path);
+        return -EINVAL;
+    }
+    for (d = 0; d < header.num_devices; d++)
+    {
+        if ((fread(&devices[d], sizeof(devices[d]), 1, fp) != 1) ||
+            (devices[d].num_channels > BIN_MAX_CHANNELS) ||
+            (fread(channels[d], sizeof(channels[d][0]), devices[d].num_channels, fp) != devices[d].num_channels))
+        {
+            fprintf(stderr, "Error: %s is truncated\n", job->path);
+            return -EINVAL;
+        }
+        devices[d].name[BIN_NAME_LENGTH - 1] = 0;
+        if ((devices[d].scan_size == 0) || (devices[d].scan_size > BIN_MAX_SCAN_SIZE))
+        {
+            fprintf(stderr, "Error: %s in %s has a bad scan size\n", devices[d].name, job->path);
+            return -EINVAL;
+        }
+        for (k = 0; k < devices[d].num_channels; k++)
+        {
+            const struct bin_channel *chan = &channels[d][k];
+            int bytes = (header.format == BIN_FORMAT_DECODED) ? 8 : chan->bytes;
+            if (((bytes != 1) && (bytes != 2) && (bytes != 4) && (bytes != 8)) ||
+                ((uint64_t)chan->location + bytes > devices[d].scan_size))
+            {
+                fprintf(stderr, "Error: %s channel %d in %s is outside the scan\n",
+                        devices[d].name, k, job->path);
+                return -EINVAL;
+            }
+        }
+        if ((device < 0) && strstr(devices[d].name, job->device_match))
+            device = d;
+        if (devices[d].scan_size > max_scan)
+            max_scan = devices[d].scan_size;
+    }
+    if (device < 0)
+    {
+        if (header.num_devices > 1)
+        {
+            fprintf(stderr, "Error: no %s device in %s\n", job->device_match, job->path);
+            return -EINVAL;
+        }
+        device = 0;
+    }
+
+    // Same axis assignment as test_iio_sensors, by order of the
+    // non-timestamp channels
+    for (k = 0, d = 0; (k < devices[device].num_channels) && (d < 3); k++)
+    {
+        if ((k == devices[device].timestamp) || (channels[device][k].type == BIN_TYPE_INT64))
+            continue;
+        axis_channel[job->channel_index_to_axis_map[d++] - 'x'] = k;
+    }
+    if (d < 3)
+    {
+        fprintf(stderr, "Error: %s in %s has fewer than three axes\n", devices[device].name, job->path);
+        return -EINVAL;
+    }
+
+    scan = malloc(max_scan);
+    if (scan == NULL)
+        return -ENOMEM;
+    for (;;)
+    {
+        uint32_t record[2] = { 0, 0 };
+        double v[3];
+        if (header.record_size && (fread(record, header.record_size, 1, fp) != 1))
+            break;
+        if ((record[0] >= header.num_devices) ||
+            (fread(scan, devices[record[0]].scan_size, 1, fp) != 1))
+            break;
+        if (record[0] != device)
+            continue;
+        for (k = 0; k < 3; k++)
+            v[k] = channel_si(scan, &channels[device][axis_channel[k]],
+                              header.format == BIN_FORMAT_DECODED);
+        if (add_sample(&job->samples, v) < 0)
+        {
+            free(scan);
+            return -ENOMEM;
+        }
+    }
+    free(scan);
+    return 0;
+}
+
+
+static int read_samples(struct fit_job *job)
+{
+    char magic[4];
+    int ret;
+    FILE *fp = fopen(job->path, "r");
+    if (fp == NULL)
+    {
+        ret = -errno;
+        fprintf(stderr, "Error: cannot open %s\n", job->path);
+        return ret;
+    }
+    if ((fread(magic, sizeof(magic), 1, fp) == 1) && (memcmp(magic, BIN_MAGIC, sizeof(magic)) == 0))
+    {
+        rewind(fp);
+        ret = read_binary_samples(fp, job);
+    }
+    else
+    {
+        rewind(fp);
+        ret = read_text_samples(fp, job);
+    }
+    fclose(fp);
+    return ret;
+}
+
+
+// Gaussian elimination with partial pivoting, a is row major and destroyed.
+static int solve(double a[NUM_PARAMS][NUM_PARAMS], double *b, double *x)
+{
+    int i;
+    int j;
+    int k;
+
+    for (i = 0; i < NUM_PARAMS; i++)
+    {
+        int pivot = i;
+        for (k = i + 1; k < NUM_PARAMS; k++)
+            if (fabs(a[k][i]) > fabs(a[pivot][i]))
+                pivot = k;
+        if (fabs(a[pivot][i]) < 1e-12)
+            return -1;
+        if (pivot != i)
+        {
+            double t;
+            for (j = 0; j < NUM_PARAMS; j++)
+            {
+                t = a[i][j]; a[i][j] = a[pivot][j]; a[pivot][j] = t;
+            }
+            t = b[i]; b[i] = b[pivot]; b[pivot] = t;
+        }
+        for (k = i + 1; k < NUM_PARAMS; k++)
+        {
+            double f = a[k][i] / a[i][i];
+            for (j = i; j < NUM_PARAMS; j++)
+                a[k][j] -= f * a[i][j];
+            b[k] -= f * b[i];
+        }
+    }
+    for (i = NUM_PARAMS - 1; i >= 0; i--)
+    {
+        double sum = b[i];
+        for (j = i + 1; j < NUM_PARAMS; j++)
+            sum -= a[i][j] * x[j];
+        x[i] = sum / a[i][i];
+    }
+    return 0;
+}
+
+
+/*
+ * Fits x^2 = p0 x + p1 y + p2 z - p3 y^2 - p4 z^2 + p5 over the samples
+ * listed in index (all if NULL), weighted if weight is not NULL. The
+ * samples are centred first to keep the normal equations well conditioned.
+ */
+static int fit_ellipsoid(const struct samples *s,
+                         const int *index,
+                         int n,
+                         const double *weight,
+                         struct ellipsoid *e)
+{
+    double ata[NUM_PARAMS][NUM_PARAMS];
+    double atb[NUM_PARAMS];
+    double p[NUM_PARAMS];
+    double centre[3] = { 0, 0, 0 };
+    double a;
+    int i;
+    int j;
+    int k;
+
+    for (i = 0; i < n; i++)
+        for (k = 0; k < 3; k++)
+            centre[k] += s->v[k][index ? index[i] : i];
+    for (k = 0; k < 3; k++)
+        centre[k] /= n;
+
+    memset(ata, 0, sizeof(ata));
+    memset(atb, 0, sizeof(atb));
+    for (i = 0; i < n; i++)
+    {
+        int m = index ? index[i] : i;
+        double w = weight ? weight[m] : 1.0;
+        double x = s->v[0][m] - centre[0];
+        double y = s->v[1][m] - centre[1];
+        double z = s->v[2][m] - centre[2];
+        double h[NUM_PARAMS] = { x, y, z, -y * y, -z * z, 1.0 };
+        if (w == 0.0)
+            continue;
+        for (j = 0; j < NUM_PARAMS; j++)
+        {
+            for (k = j; k < NUM_PARAMS; k++)
+                ata[j][k] += w * h[j] * h[k];
+            atb[j] += w * h[j] * x * x;
+        }
+    }
+    for (j = 0; j < NUM_PARAMS; j++)
+        for (k = 0; k < j; k++)
+            ata[j][k] = ata[k][j];
+    if (solve(ata, atb, p) < 0)
+        return -1;
+    if ((p[3] <= 0) || (p[4] <= 0))
+        return -1;
+
+    e->offset[0] = p[0] / 2;
+    e->offset[1] = p[1] / (2 * p[3]);
+    e->offset[2] = p[2] / (2 * p[4]);
+    a = p[5] + e->offset[0] * e->offset[0] +
+        p[3] * e->offset[1] * e->offset[1] +
+        p[4] * e->offset[2] * e->offset[2];
+    if (a <= 0)
+        return -1;
+    e->radius[0] = sqrt(a);
+    e->radius[1] = sqrt(a / p[3]);
+    e->radius[2] = sqrt(a / p[4]);
+    for (k = 0; k < 3; k++)
+        e->offset[k] += centre[k];
+    return 0;
+}
+
+
+// Radius error of a sample relative to the ellipsoid, 0 on its surface.
+static inline double radius_error(const struct samples *s, int i, const struct ellipsoid *e)
+{
+    double sum = 0;
+    int k;
+    for (k = 0; k < 3; k++)
+    {
+        double d = (s->v[k][i] - e->offset[k]) / e->radius[k];
+        sum += d * d;
+    }
+    return sqrt(sum) - 1.0;
+}
+
+
+static int count_inliers(const struct samples *s, const struct ellipsoid *e, int *index)
+{
+    int n = 0;
+    int i;
+    for (i = 0; i < s->n; i++)
+    {
+        if (fabs(radius_error(s, i, e)) < threshold)
+        {
+            if (index)
+                index[n] = i;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+static int ransac_needed(int inliers, int n)
+{
+    double w = (double)inliers / n;
+    double p = pow(w, NUM_PARAMS);
+    int needed = max_hypotheses;
+    if (p >= 1.0)
+        needed = RANSAC_MIN_HYPOTHESES;
+    else if (p > 0.0)
+    {
+        p = ceil(log(1 - RANSAC_CONFIDENCE) / log(1 - p));
+        if (p < needed)
+            needed = (p > RANSAC_MIN_HYPOTHESES) ? (int)p : RANSAC_MIN_HYPOTHESES;
+    }
+    return (needed < max_hypotheses) ? needed : max_hypotheses;
+}
+
+
+static void *ransac_worker(void *arg)
+{
+    struct ransac_state *state = arg;
+    const struct samples *s = state->samples;
+
+    for (;;)
+    {
+        struct ellipsoid best;
+        int best_inliers;
+        int best_hypothesis;
+        int valid;
+        int first;
+        int h;
+
+        pthread_mutex_lock(&state->lock);
+        first = state->next;
+        if (first < state->needed)
+            state->next += RANSAC_BATCH;
+        pthread_mutex_unlock(&state->lock);
+        if (first >= state->needed)
+            break;
+
+        // Best of the batch, merged into the shared state once
+        best_inliers = -1;
+        best_hypothesis = 0;
+        valid = 0;
+        for (h = first; h < first + RANSAC_BATCH; h++)
+        {
+            // Seeded by hypothesis number, so the draws do not depend on
+            // which thread takes the batch
+            unsigned int hseed = seed * 2654435761u + h;
+            struct ellipsoid e;
+            int index[NUM_PARAMS];
+            int inliers;
+            int i;
+            int j;
+
+            for (i = 0; i < NUM_PARAMS; i++)
+            {
+                index[i] = rand_r(&hseed) % s->n;
+                for (j = 0; j < i; j++)
+                    if (index[j] == index[i])
+                        break;
+                if (j < i)
+                    i--;
+            }
+            if (fit_ellipsoid(s, index, NUM_PARAMS, NULL, &e) < 0)
+                continue;
+            valid++;
+            inliers = count_inliers(s, &e, NULL);
+            if (inliers > best_inliers)
+            {
+                best_inliers = inliers;
+                best_hypothesis = h;
+                best = e;
+            }
+        }
+
+        pthread_mutex_lock(&state->lock);
+        state->tried += RANSAC_BATCH;
+        state->valid += valid;
+        if ((best_inliers > state->best_inliers) ||
+            ((best_inliers == state->best_inliers) && (best_hypothesis < state->best_hypothesis)))
+        {
+            state->best_inliers = best_inliers;
+            state->best_hypothesis = best_hypothesis;
+            state->best = best;
+            state->needed = ransac_needed(best_inliers, s->n);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return NULL;
+}
+
+
+static int fit_ransac(struct fit_job *job, struct ellipsoid *e)
+{
+    struct ransac_state state;
+    pthread_t threads[MAX_THREADS];
+    const struct samples *s = &job->samples;
+    int *index;
+    int pass;
+    int started = 1;
+    int t;
+
+    memset(&state, 0, sizeof(state));
+    state.samples = s;
+    state.needed = max_hypotheses;
+    state.best_hypothesis = max_hypotheses;
+    pthread_mutex_init(&state.lock, NULL);
+    // Batches come from a shared counter, so workers that fail to start
+    // just leave more of them to the others
+    for (t = 1; t < num_threads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, ransac_worker, &state) != 0)
+            break;
+        started++;
+    }
+    ransac_worker(&state);
+    for (t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&state.lock);
+
+    if (state.best_inliers < NUM_PARAMS)
+    {
+        fprintf(stderr, "Error: %s: no ellipsoid fits the samples\n", job->name);
+        return -EDOM;
+    }
+    fprintf(stderr, "%s: %d hypotheses, %d valid\n", job->name, state.tried, state.valid);
+
+    index = malloc(s->n * sizeof(int));
+    if (index == NULL)
+        return -ENOMEM;
+    *e = state.best;
+    job->inliers = count_inliers(s, e, index);
+    for (pass = 0; pass < RANSAC_REFINE_PASSES; pass++)
+    {
+        struct ellipsoid refined;
+        if (fit_ellipsoid(s, index, job->inliers, NULL, &refined) < 0)
+            break;
+        *e = refined;
+        job->inliers = count_inliers(s, e, index);
+    }
+    free(index);
+    return 0;
+}
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double d = *(const double *)a - *(const double *)b;
+    return (d > 0) - (d < 0);
+}
+
+
+static double median(double *v, int n)
+{
+    qsort(v, n, sizeof(double), compare_double);
+    return (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+static int fit_irls(struct fit_job *job, struct ellipsoid *e)
+{
+    const struct samples *s = &job->samples;
+    double *weight = malloc(s->n * sizeof(double));
+    double *error = malloc(s->n * sizeof(double));
+    double *scratch = malloc(s->n * sizeof(double));
+    int ret = 0;
+    int iteration;
+    int i;
+
+    if ((weight == NULL) || (error == NULL) || (scratch == NULL))
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (fit_ellipsoid(s, NULL, s->n, NULL, e) < 0)
+    {
+        fprintf(stderr, "Error: %s: no ellipsoid fits the samples\n", job->name);
+        ret = -EDOM;
+        goto out;
+    }
+    for (iteration = 0; iteration < IRLS_ITERATIONS; iteration++)
+    {
+        struct ellipsoid next;
+        double sigma;
+        double change = 0;
+        int k;
+
+        for (i = 0; i < s->n; i++)
+        {
+            error[i] = radius_error(s, i, e);
+            scratch[i] = fabs(error[i]);
+        }
+        sigma = 1.4826 * median(scratch, s->n);
+        if (sigma < 1e-9)
+            break;
+        for (i = 0; i < s->n; i++)
+        {
+            double u = error[i] / (TUKEY_C * sigma);
+            weight[i] = (fabs(u) < 1.0) ? (1 - u * u) * (1 - u * u) : 0.0;
+        }
+        if (fit_ellipsoid(s, NULL, s->n, weight, &next) < 0)
+            break;
+        for (k = 0; k < 3; k++)
+            change += fabs(next.offset[k] - e->offset[k]) + fabs(next.radius[k] - e->radius[k]);
+        *e = next;
+        if (change < 1e-9 * e->radius[0])
+            break;
+    }
+    job->inliers = count_inliers(s, e, NULL);
+out:
+    free(weight);
+    free(error);
+    free(scratch);
+    return ret;
+}
+
+
+static int fit_gyro(struct fit_job *job)
+{
+    const struct samples *s = &job->samples;
+    double *scratch = malloc(s->n * sizeof(double));
+    double offset[3];
+    int k;
+
+    if (scratch == NULL)
+        return -ENOMEM;
+    for (k = 0; k < 3; k++)
+    {
+        memcpy(scratch, s->v[k], s->n * sizeof(double));
+        offset[k] = -median(scratch, s->n);
+    }
+    free(scratch);
+
+    job->calibration->x_offset = offset[0];
+    job->calibration->y_offset = offset[1];
+    job->calibration->z_offset = offset[2];
+    job->calibration->x_scale = 1.0;
+    job->calibration->y_scale = 1.0;
+    job->calibration->z_scale = 1.0;
+    fprintf(stderr, "%s: %d samples, offset %f %f %f\n", job->name, s->n, offset[0], offset[1], offset[2]);
+    return 0;
+}
+
+
+static void *fit_thread(void *arg)
+{
+    struct fit_job *job = arg;
+    const struct samples *s = &job->samples;
+    struct ellipsoid e;
+    double sum = 0;
+    int i;
+
+    job->ret = read_samples(job);
+    if (job->ret < 0)
+        return NULL;
+    if (s->n < 2 * NUM_PARAMS)
+    {
+        fprintf(stderr, "Error: %s: only %d samples in %s\n", job->name, s->n, job->path);
+        job->ret = -EINVAL;
+        return NULL;
+    }
+    if (job->target_radius == 0.0)
+    {
+        job->ret = fit_gyro(job);
+        return NULL;
+    }
+
+    switch (method)
+    {
+        case FIT_RANSAC: job->ret = fit_ransac(job, &e); break;
+        case FIT_IRLS:   job->ret = fit_irls(job, &e); break;
+        default:
+            job->ret = fit_ellipsoid(s, NULL, s->n, NULL, &e) < 0 ? -EDOM : 0;
+            if (job->ret == 0)
+                job->inliers = count_inliers(s, &e, NULL);
+            break;
+    }
+    if (job->ret < 0)
+        return NULL;
+
+    for (i = 0; i < s->n; i++)
+    {
+        double d = radius_error(s, i, &e);
+        if (fabs(d) < threshold)
+            sum += d * d;
+    }
+    job->rms = job->inliers ? sqrt(sum / job->inliers) : 0;
+
+    job->calibration->x_offset = -e.offset[0];
+    job->calibration->y_offset = -e.offset[1];
+    job->calibration->z_offset = -e.offset[2];
+    job->calibration->x_scale = job->target_radius / e.radius[0];
+    job->calibration->y_scale = job->target_radius / e.radius[1];
+    job->calibration->z_scale = job->target_radius / e.radius[2];
+    fprintf(stderr, "%s: %d samples, %d within %.1f%% of the fit (%.1f%%), rms error %.2f%%\n",
+            job->name, s->n, job->inliers, 100 * threshold,
+            100.0 * job->inliers / s->n, 100 * job->rms);
+    return NULL;
+}
+
+
+static int write_calibration(const char *path)
+{
+    int ret;
+    FILE *fp = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    if (fp == NULL)
+    {
+        ret = -errno;
+        fprintf(stderr, "Error: cannot open %s\n", path);
+        return ret;
+    }
+
+    fprintf(fp, "# Look up magnetic declination from http://www.magnetic-declination.com/\n");
+    fprintf(fp, "# Convert to milliradians http://www.wolframalpha.com/input/?i=%%2811%%C2%%B0+35%%27%%29+in+radians\n");
+    fprintf(fp, "magn.declination_mrad = %.1f\n", magnetic_declination_mrad);
+    fprintf(fp, "magn.x_offset = %f\n", magn_calibration.x_offset);
+    fprintf(fp, "magn.y_offset = %f\n", magn_calibration.y_offset);
+    fprintf(fp, "magn.z_offset = %f\n", magn_calibration.z_offset);
+    fprintf(fp, "magn.x_scale  = %f\n", magn_calibration.x_scale);
+    fprintf(fp, "magn.y_scale  = %f\n", magn_calibration.y_scale);
+    fprintf(fp, "magn.z_scale  = %f\n", magn_calibration.z_scale);
+    fprintf(fp, "accel.x_offset = %f\n", accel_calibration.x_offset);
+    fprintf(fp, "accel.y_offset = %f\n", accel_calibration.y_offset);
+    fprintf(fp, "accel.z_offset = %f\n", accel_calibration.z_offset);
+    fprintf(fp, "accel.x_scale  = %f\n", accel_calibration.x_scale);
+    fprintf(fp, "accel.y_scale  = %f\n", accel_calibration.y_scale);
+    fprintf(fp, "accel.z_scale  = %f\n", accel_calibration.z_scale);
+    fprintf(fp, "gyro.x_offset = %f\n", gyro_calibration.x_offset);
+    fprintf(fp, "gyro.y_offset = %f\n", gyro_calibration.y_offset);
+    fprintf(fp, "gyro.z_offset = %f\n", gyro_calibration.z_offset);
+    fprintf(fp, "gyro.x_scale  = %f\n", gyro_calibration.x_scale);
+    fprintf(fp, "gyro.y_scale  = %f\n", gyro_calibration.y_scale);
+    fprintf(fp, "gyro.z_scale  = %f\n", gyro_calibration.z_scale);
+
+    ret = ferror(fp) ? -EIO : 0;
+    if ((fp != stdout) && (fclose(fp) != 0))
+        ret = -errno;
+    if (ret < 0)
+        fprintf(stderr, "Error: failed to write %s\n", path);
+    return ret;
+}
+
+
+static void syntax(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -M <path>     Magnetometer samples, text or generic_buffer -o capture\n");
+    fprintf(stderr, " -A <path>     Accelerometer samples\n");
+    fprintf(stderr, " -G <path>     Gyroscope samples, taken while still\n");
+    fprintf(stderr, " -o <path>     Calibration file to write (default rpi-stereo-cam-stream-calib.conf,\n"
+                    "               - for stdout)\n");
+    fprintf(stderr, " -c <path>     Start from this calibration file, sensors not fitted keep its values\n");
+    fprintf(stderr, " -D <mrad>     Magnetic declination\n");
+    fprintf(stderr, " -f <method>   ransac (default), irls or lsq\n");
+    fprintf(stderr, " -e <error>    Inlier radius error (default %.2f)\n", threshold);
+    fprintf(stderr, " -n <count>    Most RANSAC hypotheses (default %d)\n", max_hypotheses);
+    fprintf(stderr, " -j <threads>  RANSAC threads per sensor (default all cores)\n");
+    fprintf(stderr, " -s <seed>     RANSAC seed (default %u)\n", seed);
+    fprintf(stderr, " -h            display this information\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *output = "rpi-stereo-cam-stream-calib.conf";
+    const char *base = NULL;
+    double declination = NAN;
+    int ret = 0;
+    int opt;
+    int i;
+
+    progname = argv[0];
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "M:A:G:o:c:D:f:e:n:j:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'M': jobs[0].path = optarg; break;
+            case 'A': jobs[1].path = optarg; break;
+            case 'G': jobs[2].path = optarg; break;
+            case 'o': output = optarg; break;
+            case 'c': base = optarg; break;
+            case 'D': declination = atof(optarg); break;
+            case 'f':
+                if (strcmp(optarg, "ransac") == 0)
+                    method = FIT_RANSAC;
+                else if (strcmp(optarg, "irls") == 0)
+                    method = FIT_IRLS;
+                else if (strcmp(optarg, "lsq") == 0)
+                    method = FIT_LSQ;
+                else
+                    syntax();
+                break;
+            case 'e': threshold = atof(optarg); break;
+            case 'n': max_hypotheses = atoi(optarg); break;
+            case 'j': num_threads = atoi(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+    if ((threshold <= 0) || (max_hypotheses <= 0))
+        syntax();
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+    if (!jobs[0].path && !jobs[1].path && !jobs[2].path)
+        syntax();
+
+    if (base && (read_calibration_from_file(base, &accel_calibration, &magn_calibration,
+                                            &gyro_calibration, &magnetic_declination_mrad) < 0))
+        return EXIT_FAILURE;
+    if (!isnan(declination))
+        magnetic_declination_mrad = declination;
+
+    for (i = 0; i < NUM_JOBS; i++)
+    {
+        if (!jobs[i].path)
+            continue;
+        if (pthread_create(&jobs[i].thread, NULL, fit_thread, &jobs[i]) == 0)
+            jobs[i].threaded = 1;
+        else
+            fit_thread(&jobs[i]);
+    }
+    for (i = 0; i < NUM_JOBS; i++)
+    {
+        if (!jobs[i].path)
+            continue;
+        if (jobs[i].threaded)
+            pthread_join(jobs[i].thread, NULL);
+        if (jobs[i].ret < 0)
+            ret = jobs[i].ret;
+        free_samples(&jobs[i].samples);
+    }
+    if (ret < 0)
+        return EXIT_FAILURE;
+
+    if (write_calibration(output) < 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
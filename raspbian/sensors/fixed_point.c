@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <math.h>
+#include <endian.h>
+#include "iio_utils.h"
+#include "fixed_point.h"
+
+
+
+static inline fixed_t saturate(int64_t v)
+{
+    if (v > FIXED_MAX)
+        return FIXED_MAX;
+    if (v < FIXED_MIN)
+        return FIXED_MIN;
+    return (fixed_t)v;
+}
+
+
+int fixed_channel_init(struct fixed_channel *fc,
+                       const struct iio_channel_info *info)
+{
+    double scale = fabs(info->scale);
+    double m;
+    double offset;
+    int shift = 0;
+
+    if ((info->bytes > 4) || (info->bits_used > 24) || (info->bits_used == 0))
+        return -EINVAL;
+
+    fc->location = info->location;
+    fc->bytes = info->bytes;
+    fc->be = info->be;
+    fc->is_signed = info->is_signed;
+    fc->bits_used = info->bits_used;
+    fc->shift = info->shift;
+    fc->mask = (uint32_t)info->mask;
+
+    offset = round(info->offset * (1 << FIXED_OFFSET_BITS));
+    if ((offset > INT32_MAX / 2) || (offset < -INT32_MAX / 2))
+        return -ERANGE;
+    fc->offset = (int32_t)offset;
+
+    // Largest shift that keeps the multiplier in 30 bits, so the product
+    // of a 24 bit Q8 value and the multiplier stays well inside 64 bits
+    m = scale * (1 << (FIXED_FRAC_BITS - FIXED_OFFSET_BITS));
+    if ((m == 0) || (m >= (1 << 30)))
+        return -ERANGE;
+    while ((m * 2 < (1 << 30)) && (shift < 62))
+    {
+        m *= 2;
+        shift++;
+    }
+    fc->multiplier = (int32_t)round(m);
+    if (info->scale < 0)
+        fc->multiplier = -fc->multiplier;
+    fc->product_shift = shift;
+    return 0;
+}
+
+
+fixed_t fixed_channel_decode(const struct fixed_channel *fc, const char *scan)
+{
+    const char *data = scan + fc->location;
+    uint32_t input;
+    int32_t raw;
+    int64_t v;
+
+    switch (fc->bytes)
+    {
+        case 1:
+            input = *(uint8_t *)data;
+            break;
+        case 2:
+            input = fc->be ? be16toh(*(uint16_t *)data) : le16toh(*(uint16_t *)data);
+            break;
+        case 4:
+            input = fc->be ? be32toh(*(uint32_t *)data) : le32toh(*(uint32_t *)data);
+            break;
+        default:
+            return 0;
+    }
+
+    // Shift before conversion to avoid sign extension of left aligned data
+    input >>= fc->shift;
+    input &= fc->mask;
+    if (fc->is_signed)
+        raw = (int32_t)(input << (32 - fc->bits_used)) >> (32 - fc->bits_used);
+    else
+        raw = (int32_t)input;
+
+    v = ((int64_t)raw << FIXED_OFFSET_BITS) + fc->offset;
+    v *= fc->multiplier;
+    if (fc->product_shift > 0)
+        v = (v + ((int64_t)1 << (fc->product_shift - 1))) >> fc->product_shift;
+    return saturate(v);
+}
@@ -0,0 +1,69 @@
+#ifndef _FIXED_POINT_H_
+#define _FIXED_POINT_H_
+
+#include <stdint.h>
+
+struct iio_channel_info;
+
+
+/*
+ * All integer decode and calibration of IIO channel values.
+ *
+ * A channel's scale and offset (which already include the calibration,
+ * see apply_calibration_data) are converted once into a Q format multiplier
+ * and a Q8 offset in raw units. Each value is then computed as
+ *
+ *     out = sat32(((raw << 8) + offset) * multiplier >> shift)
+ *
+ * with one 64 bit multiply and no floating point, giving a fixed_t in
+ * FIXED_FRAC_BITS fractional bits (Q15.16), about +-32768 SI units with
+ * 1/65536 resolution. Values outside the range saturate.
+ *
+ * Only channels of up to 24 valid bits are supported, which keeps the
+ * product inside 63 bits.
+ */
+
+#define FIXED_FRAC_BITS         16
+#define FIXED_OFFSET_BITS       8
+#define FIXED_ONE               (1 << FIXED_FRAC_BITS)
+#define FIXED_MAX               INT32_MAX
+#define FIXED_MIN               (-INT32_MAX)
+
+typedef int32_t fixed_t;
+
+
+struct fixed_channel
+{
+    unsigned location;
+    unsigned bytes;
+    unsigned be;
+    unsigned is_signed;
+    unsigned bits_used;
+    unsigned shift;             // storage shift, as iio_channel_info
+    uint32_t mask;
+    int32_t offset;             // raw units, Q8
+    int32_t multiplier;         // scale * 2^(FIXED_FRAC_BITS - FIXED_OFFSET_BITS + product_shift)
+    int product_shift;
+};
+
+
+/* Returns 0, or -EINVAL for channels over 24 bits, -ERANGE if the scale or
+ * offset cannot be represented. */
+int fixed_channel_init(struct fixed_channel *fc,
+                       const struct iio_channel_info *info);
+
+fixed_t fixed_channel_decode(const struct fixed_channel *fc, const char *scan);
+
+static inline fixed_t fixed_negate(fixed_t v)
+{
+    // FIXED_MIN is -FIXED_MAX so this cannot overflow
+    return -v;
+}
+
+static inline double fixed_to_double(fixed_t v)
+{
+    return (double)v * (1.0 / FIXED_ONE);
+}
+
+
+#endif // _FIXED_POINT_H_
@@ -16,6 +16,23 @@
  * If trigger name is not specified the program assumes you want a dataready
  * trigger associated with the device and goes looking for it.
  *
+ * -n may be given up to MAX_DEVICES times to capture several devices
+ * together, each -t applying to the -n before it. Their scans are merged
+ * into one stream in timestamp order, which needs the timestamp channel
+ * (in_timestamp_en) enabled on every device.
+ *
+ * Other options
+ * -c <n>	number of reads, 0 to run until interrupted
+ * -l <n>	buffer length in scans
+ * -W <n>	buffer watermark in scans, poll only wakes once this many
+ *		scans are ready (needs kernel support, ignored otherwise)
+ * -o <file>	write scans in binary to file ('-' for stdout) instead of
+ *		printing them, see struct bin_header for the format
+ * -d		with -o, store decoded values instead of raw scans
+ * -B <bytes>	with -o, size of the output blocks (default 1 MiB)
+ * -r <secs>	report scans/s, bytes/s and read sizes to stderr every
+ *		secs seconds, and a summary on exit
+ *
  */
 
 #include <unistd.h>
@@ -31,6 +48,8 @@
 #include <endian.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <time.h>
 #include "iio_utils.h"
 
 void print2byte(uint16_t input, struct iio_channel_info *info)
@@ -141,217 +160,1040 @@ void process_scan(char *data,
 	printf("\n");
 }
 
-int main(int argc, char **argv)
-{
-	unsigned long num_loops = 2;
-	unsigned long timedelay = 1000000;
-	unsigned long buf_len = 128;
+/*
+ * Binary output format (-o)
+ *
+ * The stream starts with a struct bin_header. Each device follows as a
+ * struct bin_device and its num_channels struct bin_channel, in the order
+ * the devices were given. Scans come after that back to back, scan_size
+ * bytes each. With more than one device every scan is preceded by a
+ * struct bin_record naming its device, and scans are in timestamp order
+ * across devices (see emit_scans()).
+ *
+ * In raw mode every scan is stored exactly as read from the buffer and the
+ * channel descriptions carry what is needed to decode it. In decoded mode
+ * every channel takes 8 bytes at bin_channel.location, an int64_t for
+ * timestamps and a double in SI units for everything else. Everything is
+ * in host byte order.
+ */
+#define BIN_MAGIC		"IIOB"
+#define BIN_VERSION		2
+#define BIN_FORMAT_RAW		0
+#define BIN_FORMAT_DECODED	1
+#define BIN_TYPE_RAW		0
+#define BIN_TYPE_DOUBLE		1
+#define BIN_TYPE_INT64		2
+#define BIN_NAME_LENGTH		32
+#define BIN_BLOCK_SIZE		(1024 * 1024)
+#define BIN_BLOCK_SIZE_MIN	4096
 
-	int ret, c, i, j, toread;
-	int fp;
+#define MAX_DEVICES		8
+#define HOLDOFF_MS		1000
 
-	int num_channels;
-	char *trigger_name = NULL, *device_name = NULL;
-	char *dev_dir_name, *buf_dir_name;
+struct bin_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t format;		/* BIN_FORMAT_* */
+	uint32_t num_devices;
+	uint32_t record_size;		/* bytes before each scan, 0 or 8 */
+};
 
-	int datardytrigger = 1;
-	char *data;
-	ssize_t read_size;
-	int dev_num, trig_num;
+struct bin_device {
+	char name[BIN_NAME_LENGTH];
+	char trigger[BIN_NAME_LENGTH];
+	uint32_t num_channels;
+	uint32_t scan_size;
+	int32_t timestamp;		/* timestamp channel, -1 if none */
+	uint32_t reserved;
+};
+
+struct bin_record {
+	uint32_t device;		/* index in the header */
+	uint32_t reserved;
+};
+
+struct bin_channel {
+	char name[BIN_NAME_LENGTH];
+	uint64_t mask;
+	float scale;
+	float offset;
+	uint32_t location;		/* offset of the channel in a scan */
+	uint8_t bytes;
+	uint8_t bits_used;
+	uint8_t shift;
+	uint8_t be;
+	uint8_t is_signed;
+	uint8_t type;			/* BIN_TYPE_* */
+	uint8_t reserved[6];
+};
+
+/**
+ * struct bin_output - output blocked into large writes
+ * @fd:		output file
+ * @buf:	block being filled
+ * @size:	block size
+ * @used:	bytes in the block
+ * @written:	bytes written to fd so far
+ **/
+struct bin_output {
+	int fd;
+	char *buf;
+	size_t size;
+	size_t used;
+	uint64_t written;
+};
+
+/**
+ * struct rate_meter - acquisition rate over an interval and overall
+ * @interval:	report interval in ns, 0 if disabled
+ * @start:	start of the run
+ * @mark:	start of the current interval
+ * @scans:	scans read in the current interval
+ * @reads:	reads that returned data in the current interval
+ * @empty:	reads that returned nothing in the current interval
+ * @read_min:	smallest read in the current interval, in bytes
+ * @read_max:	largest read in the current interval, in bytes
+ **/
+struct rate_meter {
+	int64_t interval;
+	int64_t start;
+	int64_t mark;
+	uint64_t scans;
+	uint64_t reads;
+	uint64_t empty;
+	size_t read_min;
+	size_t read_max;
+	uint64_t total_scans;
+	uint64_t total_reads;
+	uint64_t total_empty;
+	size_t total_read_min;
+	size_t total_read_max;
+};
+
+/**
+ * struct device - a device being captured
+ * @name:		device name (-n)
+ * @trigger_name:	trigger name (-t), or built from the device name
+ * @datardytrigger:	trigger_name was built and has to be freed
+ * @timestamp:		index of the timestamp channel, -1 if none
+ * @fp:			buffer access device
+ * @enabled:		buffer was enabled and has to be stopped
+ * @data:		scans read but not yet written out
+ * @capacity:		size of data in scans
+ * @head:		first pending scan in data
+ * @count:		scans in data, including those before head
+ * @last_ts:		timestamp of the last scan read
+ * @last_read:		monotonic time of the last read that returned data
+ **/
+struct device {
+	char *name;
+	char *trigger_name;
+	int datardytrigger;
+	int dev_num;
+	char *dev_dir_name;
+	char *buf_dir_name;
 	char *buffer_access;
+	struct iio_channel_info *channels;
+	int num_channels;
 	int scan_size;
-	int noevents = 0;
-	char *dummy;
+	int timestamp;
+	int fp;
+	int enabled;
+	char *data;
+	unsigned long capacity;
+	unsigned long head;
+	unsigned long count;
+	int64_t last_ts;
+	int64_t last_read;
+	struct rate_meter meter;
+};
+
+static volatile sig_atomic_t terminated;
+static FILE *msg;
+
+static void handle_terminate_signal(int sig)
+{
+	if ((sig == SIGTERM) || (sig == SIGINT))
+		terminated = 1;
+}
+
+static int64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int is_timestamp(struct iio_channel_info *info)
+{
+	/* same special case as print8byte */
+	return info->bytes == 8 && info->is_signed &&
+	       info->scale == 1.0f && info->offset == 0.0f;
+}
+
+/**
+ * channel_value() - extract the value of a channel from a scan
+ * @data:	pointer to the start of the scan
+ * @info:	the channel
+ *
+ * Returns the value shifted, masked and sign extended into an int64_t, or
+ * reinterpreted as one for unsigned 64 bit channels.
+ **/
+static int64_t channel_value(const char *data, struct iio_channel_info *info)
+{
+	uint64_t input;
+
+	data += info->location;
+	switch (info->bytes) {
+	case 1:
+		input = *(uint8_t *)data;
+		break;
+	case 2:
+		input = info->be ? be16toh(*(uint16_t *)data) :
+				   le16toh(*(uint16_t *)data);
+		break;
+	case 4:
+		input = info->be ? be32toh(*(uint32_t *)data) :
+				   le32toh(*(uint32_t *)data);
+		break;
+	case 8:
+		input = info->be ? be64toh(*(uint64_t *)data) :
+				   le64toh(*(uint64_t *)data);
+		break;
+	default:
+		return 0;
+	}
+	input >>= info->shift;
+	input &= info->mask;
+	if (info->is_signed && info->bits_used > 0 && info->bits_used < 64)
+		return (int64_t)(input << (64 - info->bits_used)) >>
+		       (64 - info->bits_used);
+	return (int64_t)input;
+}
+
+static int bin_flush(struct bin_output *out)
+{
+	size_t done = 0;
+	ssize_t n;
 
+	while (done < out->used) {
+		n = write(out->fd, out->buf + done, out->used - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += n;
+	}
+	out->written += out->used;
+	out->used = 0;
+	return 0;
+}
+
+/**
+ * bin_reserve() - get room for len bytes in the current block
+ *
+ * Writes out the block first if it does not have room. len must not be
+ * larger than the block size.
+ **/
+static char *bin_reserve(struct bin_output *out, size_t len)
+{
+	char *p;
+
+	if (out->used + len > out->size && bin_flush(out))
+		return NULL;
+	p = out->buf + out->used;
+	out->used += len;
+	return p;
+}
+
+/**
+ * bin_append() - copy data into the output, writing out every full block
+ **/
+static int bin_append(struct bin_output *out, const char *data, size_t len)
+{
+	size_t n;
+	int ret;
+
+	while (len) {
+		n = out->size - out->used;
+		if (n > len)
+			n = len;
+		memcpy(out->buf + out->used, data, n);
+		out->used += n;
+		data += n;
+		len -= n;
+		if (out->used == out->size) {
+			ret = bin_flush(out);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static int bin_write_header(struct bin_output *out,
+			    struct device *devs,
+			    int num_devices,
+			    int decoded)
+{
+	struct bin_header header;
+	struct bin_device device;
+	struct bin_channel chan;
 	struct iio_channel_info *channels;
+	int d, k, ret;
 
-	while ((c = getopt(argc, argv, "l:w:c:et:n:")) != -1) {
-		switch (c) {
-		case 'n':
-			device_name = optarg;
-			break;
-		case 't':
-			trigger_name = optarg;
-			datardytrigger = 0;
-			break;
-		case 'e':
-			noevents = 1;
-			break;
-		case 'c':
-			errno = 0;
-			num_loops = strtoul(optarg, &dummy, 10);
-			if (errno)
-				return -errno;
-			break;
-		case 'w':
-			errno = 0;
-			timedelay = strtoul(optarg, &dummy, 10);
-			if (errno)
-				return -errno;
-			break;
-		case 'l':
-			errno = 0;
-			buf_len = strtoul(optarg, &dummy, 10);
-			if (errno)
-				return -errno;
-			break;
-		case '?':
-			return -1;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BIN_MAGIC, sizeof(header.magic));
+	header.version = BIN_VERSION;
+	header.format = decoded ? BIN_FORMAT_DECODED : BIN_FORMAT_RAW;
+	header.num_devices = num_devices;
+	header.record_size = num_devices > 1 ? sizeof(struct bin_record) : 0;
+	ret = bin_append(out, (char *)&header, sizeof(header));
+	if (ret)
+		return ret;
+
+	for (d = 0; d < num_devices; d++) {
+		channels = devs[d].channels;
+		memset(&device, 0, sizeof(device));
+		strncpy(device.name, devs[d].name, sizeof(device.name) - 1);
+		strncpy(device.trigger, devs[d].trigger_name,
+			sizeof(device.trigger) - 1);
+		device.num_channels = devs[d].num_channels;
+		device.scan_size = decoded ? devs[d].num_channels * 8 :
+					     devs[d].scan_size;
+		device.timestamp = devs[d].timestamp;
+		ret = bin_append(out, (char *)&device, sizeof(device));
+		if (ret)
+			return ret;
+
+		for (k = 0; k < devs[d].num_channels; k++) {
+			memset(&chan, 0, sizeof(chan));
+			strncpy(chan.name, channels[k].name,
+				sizeof(chan.name) - 1);
+			chan.mask = channels[k].mask;
+			chan.scale = channels[k].scale;
+			chan.offset = channels[k].offset;
+			chan.bytes = channels[k].bytes;
+			chan.bits_used = channels[k].bits_used;
+			chan.shift = channels[k].shift;
+			chan.be = channels[k].be;
+			chan.is_signed = channels[k].is_signed;
+			if (decoded) {
+				chan.location = k * 8;
+				chan.type = is_timestamp(&channels[k]) ?
+					    BIN_TYPE_INT64 : BIN_TYPE_DOUBLE;
+			} else {
+				chan.location = channels[k].location;
+				chan.type = BIN_TYPE_RAW;
+			}
+			ret = bin_append(out, (char *)&chan, sizeof(chan));
+			if (ret)
+				return ret;
 		}
 	}
+	return 0;
+}
 
-	if (device_name == NULL)
+/**
+ * bin_decode_scan() - convert a scan to SI units straight into the output
+ **/
+static int bin_decode_scan(struct bin_output *out,
+			   const char *data,
+			   struct iio_channel_info *channels,
+			   int num_channels)
+{
+	int64_t val;
+	double si;
+	char *p;
+	int k;
+
+	p = bin_reserve(out, num_channels * 8);
+	if (!p)
+		return -errno;
+	for (k = 0; k < num_channels; k++, p += 8) {
+		val = channel_value(data, &channels[k]);
+		if (is_timestamp(&channels[k])) {
+			memcpy(p, &val, 8);
+			continue;
+		}
+		if (channels[k].is_signed)
+			si = ((double)val + channels[k].offset) *
+			     channels[k].scale;
+		else
+			si = ((double)(uint64_t)val + channels[k].offset) *
+			     channels[k].scale;
+		memcpy(p, &si, 8);
+	}
+	return 0;
+}
+
+static void rate_meter_reset_interval(struct rate_meter *meter, int64_t now)
+{
+	meter->mark = now;
+	meter->scans = 0;
+	meter->reads = 0;
+	meter->empty = 0;
+	meter->read_min = 0;
+	meter->read_max = 0;
+}
+
+static void rate_meter_init(struct rate_meter *meter, double interval)
+{
+	memset(meter, 0, sizeof(*meter));
+	meter->interval = interval * 1e9;
+	meter->start = monotonic_ns();
+	rate_meter_reset_interval(meter, meter->start);
+}
+
+/**
+ * rate_meter_add() - account for one read
+ * @bytes:	bytes returned, 0 if the read found nothing
+ **/
+static void rate_meter_add(struct rate_meter *meter, size_t bytes,
+			   int scan_size)
+{
+	if (bytes == 0) {
+		meter->empty++;
+		meter->total_empty++;
+		return;
+	}
+	meter->scans += bytes / scan_size;
+	meter->total_scans += bytes / scan_size;
+	if (meter->reads == 0 || bytes < meter->read_min)
+		meter->read_min = bytes;
+	if (bytes > meter->read_max)
+		meter->read_max = bytes;
+	if (meter->total_reads == 0 || bytes < meter->total_read_min)
+		meter->total_read_min = bytes;
+	if (bytes > meter->total_read_max)
+		meter->total_read_max = bytes;
+	meter->reads++;
+	meter->total_reads++;
+}
+
+/**
+ * rate_meter_timeout() - ms until the next report, -1 if disabled
+ **/
+static int rate_meter_timeout(struct rate_meter *meter)
+{
+	int64_t left;
+
+	if (meter->interval == 0)
 		return -1;
+	left = meter->mark + meter->interval - monotonic_ns();
+	return left > 0 ? (left + 999999) / 1000000 : 0;
+}
+
+static void rate_meter_print(const char *name,
+			     const char *label,
+			     double secs,
+			     uint64_t scans,
+			     uint64_t reads,
+			     uint64_t empty,
+			     size_t read_min,
+			     size_t read_max,
+			     int scan_size)
+{
+	double bytes = (double)scans * scan_size;
+
+	fprintf(stderr,
+		"%s %s %.0f scans/s %.0f bytes/s, %.0f reads/s"
+		" size %zu/%.0f/%zu bytes (%.1f scans/read), %" PRIu64 " empty\n",
+		name, label,
+		secs > 0 ? scans / secs : 0.0,
+		secs > 0 ? bytes / secs : 0.0,
+		secs > 0 ? reads / secs : 0.0,
+		read_min,
+		reads ? bytes / reads : 0.0,
+		read_max,
+		reads ? (double)scans / reads : 0.0,
+		empty);
+}
+
+/**
+ * rate_meter_update() - report if the interval has elapsed
+ **/
+static void rate_meter_update(struct rate_meter *meter, const char *name,
+			      int scan_size)
+{
+	int64_t now;
+
+	if (meter->interval == 0)
+		return;
+	now = monotonic_ns();
+	if (now - meter->mark < meter->interval)
+		return;
+	rate_meter_print(name, "rate:", (now - meter->mark) / 1e9,
+			 meter->scans, meter->reads, meter->empty,
+			 meter->read_min, meter->read_max, scan_size);
+	rate_meter_reset_interval(meter, now);
+}
+
+static void rate_meter_summary(struct rate_meter *meter, const char *name,
+			       int scan_size)
+{
+	double secs = (monotonic_ns() - meter->start) / 1e9;
+
+	if (meter->interval == 0)
+		return;
+	fprintf(stderr, "%s total: %" PRIu64 " scans in %.3f s\n",
+		name, meter->total_scans, secs);
+	rate_meter_print(name, "total:", secs,
+			 meter->total_scans, meter->total_reads,
+			 meter->total_empty, meter->total_read_min,
+			 meter->total_read_max, scan_size);
+}
+
+/**
+ * device_setup() - attach a device to its trigger and start its buffer
+ * @dev:	device with name and trigger_name (or NULL) filled in
+ * @buf_len:	buffer length in scans
+ * @watermark:	buffer watermark in scans, 0 to leave it alone
+ *
+ * Whatever was set up is undone by device_teardown(), also on failure.
+ **/
+static int device_setup(struct device *dev,
+			unsigned long buf_len,
+			unsigned long watermark)
+{
+	int ret, k, trig_num;
 
 	/* Find the device requested */
-	dev_num = find_type_by_name(device_name, "iio:device");
-	if (dev_num < 0) {
-		printf("Failed to find the %s\n", device_name);
-		ret = dev_num;
-		goto error_ret;
+	dev->dev_num = find_type_by_name(dev->name, "iio:device");
+	if (dev->dev_num < 0) {
+		fprintf(msg, "Failed to find the %s\n", dev->name);
+		return dev->dev_num;
 	}
-	printf("iio device number being used is %d\n", dev_num);
+	fprintf(msg, "iio device number being used is %d\n", dev->dev_num);
 
-	ret = asprintf(&dev_dir_name, "%siio:device%d", iio_dir, dev_num);
-	if (ret < 0)
+	ret = asprintf(&dev->dev_dir_name, "%siio:device%d",
+		       iio_dir, dev->dev_num);
+	if (ret < 0) {
+		dev->dev_dir_name = NULL;
 		return -ENOMEM;
-	if (trigger_name == NULL) {
+	}
+	if (dev->trigger_name == NULL) {
 		/*
 		 * Build the trigger name. If it is device associated its
 		 * name is <device_name>_dev[n] where n matches the device
 		 * number found above
 		 */
-		ret = asprintf(&trigger_name,
-			       "%s-dev%d", device_name, dev_num);
+		ret = asprintf(&dev->trigger_name,
+			       "%s-dev%d", dev->name, dev->dev_num);
 		if (ret < 0) {
-			ret = -ENOMEM;
-			goto error_ret;
+			dev->trigger_name = NULL;
+			return -ENOMEM;
 		}
+		dev->datardytrigger = 1;
 	}
 
 	/* Verify the trigger exists */
-	trig_num = find_type_by_name(trigger_name, "trigger");
+	trig_num = find_type_by_name(dev->trigger_name, "trigger");
 	if (trig_num < 0) {
-		printf("Failed to find the trigger %s\n", trigger_name);
-		ret = trig_num;
-		goto error_free_triggername;
+		fprintf(msg, "Failed to find the trigger %s\n",
+			dev->trigger_name);
+		return trig_num;
 	}
-	printf("iio trigger number being used is %d\n", trig_num);
+	fprintf(msg, "iio trigger number being used is %d\n", trig_num);
 
 	/*
 	 * Parse the files in scan_elements to identify what channels are
 	 * present
 	 */
-	ret = build_channel_array(dev_dir_name, &channels, &num_channels);
+	ret = build_channel_array(dev->dev_dir_name,
+				  &dev->channels, &dev->num_channels);
 	if (ret) {
-		printf("Problem reading scan element information\n");
-		printf("diag %s\n", dev_dir_name);
-		goto error_free_triggername;
+		dev->channels = NULL;
+		fprintf(msg, "Problem reading scan element information\n");
+		fprintf(msg, "diag %s\n", dev->dev_dir_name);
+		return ret;
 	}
+	dev->scan_size = size_from_channelarray(dev->channels,
+						dev->num_channels);
+	dev->timestamp = -1;
+	for (k = 0; k < dev->num_channels; k++)
+		if (is_timestamp(&dev->channels[k]))
+			dev->timestamp = k;
 
 	/*
 	 * Construct the directory name for the associated buffer.
 	 * As we know that the lis3l02dq has only one buffer this may
 	 * be built rather than found.
 	 */
-	ret = asprintf(&buf_dir_name,
-		       "%siio:device%d/buffer", iio_dir, dev_num);
+	ret = asprintf(&dev->buf_dir_name,
+		       "%siio:device%d/buffer", iio_dir, dev->dev_num);
 	if (ret < 0) {
-		ret = -ENOMEM;
-		goto error_free_triggername;
+		dev->buf_dir_name = NULL;
+		return -ENOMEM;
 	}
-	printf("%s %s\n", dev_dir_name, trigger_name);
+	fprintf(msg, "%s %s\n", dev->dev_dir_name, dev->trigger_name);
 	/* Set the device trigger to be the data ready trigger found above */
 	ret = write_sysfs_string_and_verify("trigger/current_trigger",
-					dev_dir_name,
-					trigger_name);
+					dev->dev_dir_name,
+					dev->trigger_name);
 	if (ret < 0) {
-		printf("Failed to write current_trigger file\n");
-		goto error_free_buf_dir_name;
+		fprintf(msg, "Failed to write current_trigger file\n");
+		return ret;
 	}
 
 	/* Setup ring buffer parameters */
-	ret = write_sysfs_int("length", buf_dir_name, buf_len);
+	ret = write_sysfs_int("length", dev->buf_dir_name, buf_len);
 	if (ret < 0)
-		goto error_free_buf_dir_name;
+		return ret;
+	if (watermark &&
+	    write_sysfs_int("watermark", dev->buf_dir_name, watermark) < 0)
+		fprintf(msg, "Buffer watermark not supported, ignored\n");
 
 	/* Enable the buffer */
-	ret = write_sysfs_int("enable", buf_dir_name, 1);
+	ret = write_sysfs_int("enable", dev->buf_dir_name, 1);
 	if (ret < 0)
-		goto error_free_buf_dir_name;
-	scan_size = size_from_channelarray(channels, num_channels);
-	data = malloc(scan_size*buf_len);
-	if (!data) {
-		ret = -ENOMEM;
-		goto error_free_buf_dir_name;
-	}
+		return ret;
+	dev->enabled = 1;
 
-	ret = asprintf(&buffer_access, "/dev/iio:device%d", dev_num);
+	ret = asprintf(&dev->buffer_access, "/dev/iio:device%d",
+		       dev->dev_num);
 	if (ret < 0) {
-		ret = -ENOMEM;
-		goto error_free_data;
+		dev->buffer_access = NULL;
+		return -ENOMEM;
 	}
 
 	/* Attempt to open non blocking the access dev */
-	fp = open(buffer_access, O_RDONLY | O_NONBLOCK);
-	if (fp == -1) { /* If it isn't there make the node */
+	dev->fp = open(dev->buffer_access, O_RDONLY | O_NONBLOCK);
+	if (dev->fp == -1) { /* If it isn't there make the node */
 		ret = -errno;
-		printf("Failed to open %s\n", buffer_access);
-		goto error_free_buffer_access;
+		fprintf(msg, "Failed to open %s\n", dev->buffer_access);
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * device_teardown() - stop the buffer and free a device
+ *
+ * Returns the result of stopping the buffer, 0 if it was not started.
+ **/
+static int device_teardown(struct device *dev)
+{
+	int ret = 0;
+
+	if (dev->enabled) {
+		/* Stop the buffer */
+		ret = write_sysfs_int("enable", dev->buf_dir_name, 0);
+		/* Disconnect the trigger - just write a dummy name. */
+		if (ret >= 0)
+			write_sysfs_string("trigger/current_trigger",
+					   dev->dev_dir_name, "NULL");
+	}
+	if (dev->fp != -1)
+		close(dev->fp);
+	free(dev->data);
+	free(dev->buffer_access);
+	free(dev->buf_dir_name);
+	free(dev->dev_dir_name);
+	if (dev->datardytrigger)
+		free(dev->trigger_name);
+	return ret;
+}
+
+/**
+ * device_read() - read up to toread scans onto the end of the pending ones
+ *
+ * Returns the number of bytes read, 0 if nothing was available, or a
+ * negative error code.
+ **/
+static ssize_t device_read(struct device *dev, unsigned long toread)
+{
+	ssize_t read_size;
+	char *data;
+
+	if (dev->head == dev->count) {
+		dev->head = 0;
+		dev->count = 0;
+	}
+	if (dev->count + toread > dev->capacity) {
+		if (dev->head) {
+			memmove(dev->data, dev->data + dev->head*dev->scan_size,
+				(dev->count - dev->head)*dev->scan_size);
+			dev->count -= dev->head;
+			dev->head = 0;
+		}
+		if (dev->count + toread > dev->capacity) {
+			data = realloc(dev->data,
+				       (dev->count + toread)*dev->scan_size);
+			if (!data)
+				return -ENOMEM;
+			dev->data = data;
+			dev->capacity = dev->count + toread;
+		}
+	}
+
+	read_size = read(dev->fp,
+			 dev->data + dev->count*dev->scan_size,
+			 toread*dev->scan_size);
+	if (read_size < 0) {
+		if (errno != EAGAIN)
+			return -errno;
+		read_size = 0;
+	}
+	rate_meter_add(&dev->meter, read_size, dev->scan_size);
+	if (read_size >= dev->scan_size) {
+		dev->count += read_size/dev->scan_size;
+		dev->last_read = monotonic_ns();
+		if (dev->timestamp >= 0)
+			dev->last_ts = channel_value(
+				dev->data + (dev->count - 1)*dev->scan_size,
+				&dev->channels[dev->timestamp]);
+	}
+	return read_size;
+}
+
+/**
+ * emit_scan() - print a scan, or write it to out if not NULL
+ * @index:	device index, written to out with more than one device
+ **/
+static int emit_scan(struct device *dev,
+		     int index,
+		     int num_devices,
+		     struct bin_output *out,
+		     int decoded)
+{
+	struct bin_record record = { .device = index };
+	char *data = dev->data + dev->head*dev->scan_size;
+	int ret;
+
+	dev->head++;
+	if (!out) {
+		if (num_devices > 1)
+			printf("%s ", dev->name);
+		process_scan(data, dev->channels, dev->num_channels);
+		return 0;
+	}
+	if (num_devices > 1) {
+		ret = bin_append(out, (char *)&record, sizeof(record));
+		if (ret)
+			return ret;
+	}
+	if (decoded)
+		return bin_decode_scan(out, data, dev->channels,
+				       dev->num_channels);
+	return bin_append(out, data, dev->scan_size);
+}
+
+/**
+ * emit_scans() - write out pending scans in timestamp order
+ * @flush:	write out everything, the capture is over
+ *
+ * Each device delivers its scans in timestamp order, so a pending scan can
+ * go out once every device without pending scans has already read past its
+ * timestamp. A device that has read nothing for HOLDOFF_MS is taken to have
+ * stalled and no longer holds the others back; its scans go out as they
+ * come. Devices without a timestamp channel are written in read order.
+ **/
+static int emit_scans(struct device *devs,
+		      int num_devices,
+		      struct bin_output *out,
+		      int decoded,
+		      int flush)
+{
+	int64_t now = monotonic_ns();
+	int64_t limit, ts, best_ts;
+	int d, best, ret;
+
+	for (d = 0; d < num_devices; d++)
+		if (devs[d].timestamp < 0)
+			while (devs[d].head < devs[d].count) {
+				ret = emit_scan(&devs[d], d, num_devices,
+						out, decoded);
+				if (ret)
+					return ret;
+			}
+
+	limit = INT64_MAX;
+	for (d = 0; d < num_devices && !flush; d++)
+		if (devs[d].timestamp >= 0 &&
+		    devs[d].head == devs[d].count &&
+		    now - devs[d].last_read < HOLDOFF_MS * 1000000LL &&
+		    devs[d].last_ts < limit)
+			limit = devs[d].last_ts;
+
+	while (1) {
+		best = -1;
+		best_ts = INT64_MAX;
+		for (d = 0; d < num_devices; d++) {
+			if (devs[d].head == devs[d].count)
+				continue;
+			ts = channel_value(devs[d].data +
+					   devs[d].head*devs[d].scan_size,
+					   &devs[d].channels[devs[d].timestamp]);
+			if (best < 0 || ts < best_ts) {
+				best = d;
+				best_ts = ts;
+			}
+		}
+		if (best < 0 || best_ts > limit)
+			return 0;
+		ret = emit_scan(&devs[best], best, num_devices, out, decoded);
+		if (ret)
+			return ret;
+		/* it may have been the last scan of a device holding back */
+		if (devs[best].head == devs[best].count &&
+		    now - devs[best].last_read < HOLDOFF_MS * 1000000LL &&
+		    devs[best].last_ts < limit && !flush)
+			limit = devs[best].last_ts;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long num_loops = 2;
+	unsigned long timedelay = 1000000;
+	unsigned long buf_len = 128;
+	unsigned long watermark = 0;
+	unsigned long block_size = BIN_BLOCK_SIZE;
+	double report_interval = 0;
+
+	int ret, err, c, d, toread, timeout;
+	unsigned long j;
+	ssize_t read_size;
+
+	struct device devs[MAX_DEVICES];
+	struct pollfd pfd[MAX_DEVICES];
+	int num_devices = 0;
+	char *pending_trigger = NULL;
+
+	int noevents = 0;
+	int out_ret = 0;
+	char *dummy;
+	char *output_name = NULL;
+	int decoded = 0;
+	struct bin_output out = { .fd = -1 };
+
+	msg = stdout;
+	memset(devs, 0, sizeof(devs));
+	for (d = 0; d < MAX_DEVICES; d++)
+		devs[d].fp = -1;
+
+	while ((c = getopt(argc, argv, "l:w:c:et:n:W:o:dB:r:")) != -1) {
+		switch (c) {
+		case 'n':
+			if (num_devices == MAX_DEVICES) {
+				fprintf(stderr, "At most %d devices\n",
+					MAX_DEVICES);
+				return -EINVAL;
+			}
+			devs[num_devices].name = optarg;
+			devs[num_devices].trigger_name = pending_trigger;
+			pending_trigger = NULL;
+			num_devices++;
+			break;
+		case 't':
+			/* applies to the last -n, or the next if none yet */
+			if (num_devices)
+				devs[num_devices - 1].trigger_name = optarg;
+			else
+				pending_trigger = optarg;
+			break;
+		case 'e':
+			noevents = 1;
+			break;
+		case 'c':
+			errno = 0;
+			num_loops = strtoul(optarg, &dummy, 10);
+			if (errno)
+				return -errno;
+			break;
+		case 'w':
+			errno = 0;
+			timedelay = strtoul(optarg, &dummy, 10);
+			if (errno)
+				return -errno;
+			break;
+		case 'l':
+			errno = 0;
+			buf_len = strtoul(optarg, &dummy, 10);
+			if (errno)
+				return -errno;
+			break;
+		case 'W':
+			errno = 0;
+			watermark = strtoul(optarg, &dummy, 10);
+			if (errno)
+				return -errno;
+			break;
+		case 'o':
+			output_name = optarg;
+			break;
+		case 'd':
+			decoded = 1;
+			break;
+		case 'B':
+			errno = 0;
+			block_size = strtoul(optarg, &dummy, 10);
+			if (errno)
+				return -errno;
+			if (block_size < BIN_BLOCK_SIZE_MIN)
+				block_size = BIN_BLOCK_SIZE_MIN;
+			break;
+		case 'r':
+			report_interval = strtod(optarg, &dummy);
+			if (report_interval < 0)
+				return -EINVAL;
+			break;
+		case '?':
+			return -1;
+		}
 	}
 
-	/* Wait for events 10 times */
-	for (j = 0; j < num_loops; j++) {
+	if (num_devices == 0)
+		return -1;
+
+	/* Keep stdout clean when the scans go there */
+	if (output_name) {
+		msg = stderr;
+		if (strcmp(output_name, "-") == 0)
+			out.fd = STDOUT_FILENO;
+		else
+			out.fd = open(output_name,
+				      O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out.fd == -1) {
+			ret = -errno;
+			fprintf(msg, "Failed to open %s\n", output_name);
+			goto error_ret;
+		}
+		out.size = block_size;
+		out.buf = malloc(out.size);
+		if (!out.buf) {
+			ret = -ENOMEM;
+			goto error_ret;
+		}
+	}
+
+	for (d = 0; d < num_devices; d++) {
+		ret = device_setup(&devs[d], buf_len, watermark);
+		if (ret < 0)
+			goto error_teardown;
+		if (num_devices > 1 && devs[d].timestamp < 0)
+			fprintf(msg, "%s has no timestamp channel enabled, "
+				"its scans will not be time ordered\n",
+				devs[d].name);
+	}
+
+	if (output_name) {
+		out_ret = bin_write_header(&out, devs, num_devices, decoded);
+		if (out_ret < 0)
+			fprintf(msg, "Failed to write %s: %s\n",
+				output_name, strerror(-out_ret));
+	}
+
+	signal(SIGINT, handle_terminate_signal);
+	signal(SIGTERM, handle_terminate_signal);
+	signal(SIGPIPE, SIG_IGN);
+	for (d = 0; d < num_devices; d++) {
+		rate_meter_init(&devs[d].meter, report_interval);
+		devs[d].last_read = devs[d].meter.start;
+		devs[d].last_ts = INT64_MIN;
+	}
+
+	/* Wait for events num_loops times, or until interrupted if 0 */
+	j = 0;
+	ret = 0;
+	while (!terminated && out_ret == 0 && ret >= 0 &&
+	       (num_loops == 0 || j < num_loops)) {
 		if (!noevents) {
-			struct pollfd pfd = {
-				.fd = fp,
-				.events = POLLIN,
-			};
+			timeout = rate_meter_timeout(&devs[0].meter);
+			for (d = 0; d < num_devices; d++) {
+				pfd[d].fd = devs[d].fp;
+				pfd[d].events = POLLIN;
+				pfd[d].revents = 0;
+			}
 
-			poll(&pfd, 1, -1);
+			/* Wake up for reports even if the devices stall */
+			ret = poll(pfd, num_devices, timeout);
+			for (d = 0; d < num_devices; d++)
+				rate_meter_update(&devs[d].meter, devs[d].name,
+						  devs[d].scan_size);
+			if (ret == 0) {
+				out_ret = emit_scans(devs, num_devices,
+						     output_name ? &out : NULL,
+						     decoded, 0);
+				continue;
+			}
+			if (ret < 0) {
+				if (errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				ret = -errno;
+				fprintf(stderr, "Failed to poll: %s\n",
+					strerror(-ret));
+				break;
+			}
 			toread = buf_len;
 
 		} else {
 			usleep(timedelay);
 			toread = 64;
 		}
+		j++;
 
-		read_size = read(fp,
-				 data,
-				 toread*scan_size);
-		if (read_size < 0) {
-			if (errno == EAGAIN) {
-				printf("nothing available\n");
+		for (d = 0; d < num_devices; d++) {
+			if (!noevents && !pfd[d].revents)
 				continue;
-			} else
+			read_size = device_read(&devs[d], toread);
+			if (read_size < 0) {
+				ret = read_size;
+				fprintf(stderr, "Failed to read %s: %s\n",
+					devs[d].name, strerror(-ret));
 				break;
+			}
+			if (read_size == 0 && !output_name) {
+				if (num_devices > 1)
+					printf("%s ", devs[d].name);
+				printf("nothing available\n");
+			}
+			if (noevents)
+				rate_meter_update(&devs[d].meter, devs[d].name,
+						  devs[d].scan_size);
 		}
-		for (i = 0; i < read_size/scan_size; i++)
-			process_scan(data + scan_size*i,
-				     channels,
-				     num_channels);
+		if (out_ret == 0)
+			out_ret = emit_scans(devs, num_devices,
+					     output_name ? &out : NULL,
+					     decoded, 0);
 	}
 
-	/* Stop the buffer */
-	ret = write_sysfs_int("enable", buf_dir_name, 0);
-	if (ret < 0)
-		goto error_close_buffer_access;
-
-	/* Disconnect the trigger - just write a dummy name. */
-	write_sysfs_string("trigger/current_trigger",
-			dev_dir_name, "NULL");
-
-error_close_buffer_access:
-	close(fp);
-error_free_data:
-	free(data);
-error_free_buffer_access:
-	free(buffer_access);
-error_free_buf_dir_name:
-	free(buf_dir_name);
-error_free_triggername:
-	if (datardytrigger)
-		free(trigger_name);
+	if (out_ret == 0)
+		out_ret = emit_scans(devs, num_devices,
+				     output_name ? &out : NULL, decoded, 1);
+	if (output_name) {
+		if (out_ret == 0)
+			out_ret = bin_flush(&out);
+		if (out_ret < 0 && out_ret != -EPIPE)
+			fprintf(msg, "Failed to write %s: %s\n",
+				output_name, strerror(-out_ret));
+	}
+	for (d = 0; d < num_devices; d++)
+		rate_meter_summary(&devs[d].meter, devs[d].name,
+				   devs[d].scan_size);
+	if (output_name && report_interval > 0)
+		fprintf(stderr, "total: %" PRIu64 " bytes written\n",
+			out.written);
+	/* a read or poll error ended the loop, keep it as the exit status */
+	if (ret > 0)
+		ret = 0;
+
+error_teardown:
+	for (d = 0; d < num_devices; d++) {
+		err = device_teardown(&devs[d]);
+		if (err < 0 && ret >= 0)
+			ret = err;
+	}
+	if (out_ret < 0 && out_ret != -EPIPE && ret >= 0)
+		ret = out_ret;
 error_ret:
+	if (out.fd > STDOUT_FILENO)
+		close(out.fd);
+	free(out.buf);
 	return ret;
 }
@@ -6,6 +6,10 @@
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License version 2 as published by
  * the Free Software Foundation.
+ *
+ * With -w the devices are watched instead of listed once: buffer state,
+ * trigger period and, with -a, the measured sample rate, jitter and
+ * overruns, refreshed in place.
  */
 
 #include <string.h>
@@ -15,6 +19,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <endian.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/dir.h>
@@ -137,16 +148,431 @@ error_close_dir:
 	closedir(dp);
 }
 
+/*
+ * Watch mode (-w)
+ *
+ * Every interval each device's buffer state and trigger period are read
+ * from sysfs. With -a an enabled buffer that no other process has open is
+ * also read here (the data is consumed, so only do this when nothing else
+ * needs it), and its timestamps give the effective sample rate, the jitter
+ * of the sample interval and the overruns: gaps longer than 1.5 periods,
+ * counted together with the number of scans lost in them.
+ */
+#define WATCH_MAX_DEVICES	16
+#define WATCH_BUF_SCANS		1024
+
+struct watch_stats {
+	uint64_t scans;
+	uint64_t intervals;
+	double interval_sum;
+	double interval_sumsq;
+	int64_t interval_min;
+	int64_t interval_max;
+	uint64_t overruns;
+	uint64_t missed;
+};
+
+struct watch_device {
+	int idx;
+	char name[IIO_MAX_NAME_LENGTH];
+	char *dir;
+	char *buf_dir;
+	int fd;			/* -1 if not attached */
+	int attach_error;	/* why attaching failed, 0 if it did not */
+	struct iio_channel_info *channels;
+	int num_channels;
+	int scan_size;
+	int timestamp;		/* timestamp channel, -1 if none */
+	char *data;
+	int64_t last_ts;	/* 0 until the first scan */
+	double period_ns;	/* expected sample interval, 0 if unknown */
+	struct watch_stats now;	/* since the last refresh */
+	struct watch_stats total;
+};
+
+static struct watch_device watch_devices[WATCH_MAX_DEVICES];
+static int num_watch_devices;
+
+/*
+ * Unlike read_sysfs_*() this does not complain about missing attributes,
+ * several of them depend on the kernel version and the trigger type.
+ */
+static int read_attr(const char *dir, const char *attr, char *val, size_t len)
+{
+	char path[256];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	n = read(fd, val, len - 1);
+	close(fd);
+	if (n < 0)
+		return -errno;
+	while (n > 0 && (val[n - 1] == '\n' || val[n - 1] == ' '))
+		n--;
+	val[n] = '\0';
+	return n;
+}
+
+static int read_attr_long(const char *dir, const char *attr, long *val)
+{
+	char str[64];
+	int ret = read_attr(dir, attr, str, sizeof(str));
+
+	if (ret <= 0)
+		return ret < 0 ? ret : -ENODATA;
+	*val = strtol(str, NULL, 10);
+	return 0;
+}
+
+static int read_attr_double(const char *dir, const char *attr, double *val)
+{
+	char str[64];
+	int ret = read_attr(dir, attr, str, sizeof(str));
+
+	if (ret <= 0)
+		return ret < 0 ? ret : -ENODATA;
+	*val = strtod(str, NULL);
+	return 0;
+}
+
+static int64_t scan_timestamp(struct watch_device *wd, const char *scan)
+{
+	struct iio_channel_info *info = &wd->channels[wd->timestamp];
+	uint64_t val = *(uint64_t *)(scan + info->location);
+
+	return (int64_t)(info->be ? be64toh(val) : le64toh(val));
+}
+
+static void stats_add_interval(struct watch_stats *stats, int64_t interval,
+			       double period_ns)
+{
+	if (stats->intervals == 0 || interval < stats->interval_min)
+		stats->interval_min = interval;
+	if (stats->intervals == 0 || interval > stats->interval_max)
+		stats->interval_max = interval;
+	stats->intervals++;
+	stats->interval_sum += interval;
+	stats->interval_sumsq += (double)interval * interval;
+	if (period_ns > 0 && interval > 1.5 * period_ns) {
+		stats->overruns++;
+		stats->missed += (uint64_t)(interval / period_ns + 0.5) - 1;
+	}
+}
+
+static void watch_consume(struct watch_device *wd, const char *data, int count)
+{
+	int64_t ts, interval;
+	int i;
+
+	wd->now.scans += count;
+	wd->total.scans += count;
+	if (wd->timestamp < 0)
+		return;
+	for (i = 0; i < count; i++) {
+		ts = scan_timestamp(wd, data + i * wd->scan_size);
+		if (wd->last_ts) {
+			interval = ts - wd->last_ts;
+			stats_add_interval(&wd->now, interval, wd->period_ns);
+			stats_add_interval(&wd->total, interval, wd->period_ns);
+		}
+		wd->last_ts = ts;
+	}
+}
+
+static void watch_read(struct watch_device *wd)
+{
+	ssize_t n;
+
+	while (wd->fd != -1) {
+		n = read(wd->fd, wd->data, WATCH_BUF_SCANS * wd->scan_size);
+		if (n > 0) {
+			watch_consume(wd, wd->data, n / wd->scan_size);
+			continue;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			wd->attach_error = errno;
+			close(wd->fd);
+			wd->fd = -1;
+		}
+		break;
+	}
+}
+
+static void watch_attach(struct watch_device *wd)
+{
+	char *dev_name;
+	long enabled;
+
+	if (wd->fd != -1 || wd->scan_size <= 0)
+		return;
+	if (read_attr_long(wd->buf_dir, "enable", &enabled) || !enabled)
+		return;
+	if (asprintf(&dev_name, "/dev/iio:device%d", wd->idx) < 0)
+		return;
+	wd->fd = open(dev_name, O_RDONLY | O_NONBLOCK);
+	wd->attach_error = wd->fd == -1 ? errno : 0;
+	free(dev_name);
+	wd->last_ts = 0;
+}
+
+/**
+ * watch_period() - expected sample interval in ns from the trigger
+ *
+ * Prefers the trigger's delay_ns (hrtimer trigger), then its
+ * sampling_frequency, then the device's own sampling_frequency.
+ **/
+static double watch_period(struct watch_device *wd, char *trigger,
+			   size_t len, long *delay_ns)
+{
+	char *trig_dir;
+	double freq;
+	int trig_num;
+	double period = 0;
+
+	*delay_ns = -1;
+	if (read_attr(wd->dir, "trigger/current_trigger", trigger, len) <= 0) {
+		trigger[0] = '\0';
+	} else {
+		trig_num = find_type_by_name(trigger, type_trigger);
+		if (trig_num >= 0 &&
+		    asprintf(&trig_dir, "%s%s%d", iio_dir, type_trigger,
+			     trig_num) >= 0) {
+			if (read_attr_long(trig_dir, "delay_ns", delay_ns) == 0 &&
+			    *delay_ns > 0)
+				period = *delay_ns;
+			else if (read_attr_double(trig_dir,
+					"sampling_frequency", &freq) == 0 &&
+				 freq > 0)
+				period = 1e9 / freq;
+			free(trig_dir);
+		}
+	}
+	if (period == 0 &&
+	    read_attr_double(wd->dir, "sampling_frequency", &freq) == 0 &&
+	    freq > 0)
+		period = 1e9 / freq;
+	return period;
+}
+
+static void print_stats(const char *label, struct watch_stats *stats,
+			double secs, double period_ns)
+{
+	double mean, sd;
+
+	printf("  %-6s %8.1f scans/s", label, secs > 0 ? stats->scans / secs : 0);
+	if (stats->intervals) {
+		mean = stats->interval_sum / stats->intervals;
+		sd = stats->interval_sumsq / stats->intervals - mean * mean;
+		sd = sd > 0 ? sqrt(sd) : 0;
+		printf("  interval %.3f ms sd %.3f min %.3f max %.3f",
+		       mean / 1e6, sd / 1e6,
+		       stats->interval_min / 1e6, stats->interval_max / 1e6);
+	}
+	if (period_ns > 0)
+		printf("  overruns %" PRIu64 " (%" PRIu64 " scans)",
+		       stats->overruns, stats->missed);
+	printf("\n");
+}
+
+static void watch_print(struct watch_device *wd, double secs,
+			double total_secs)
+{
+	char trigger[IIO_MAX_NAME_LENGTH + 1];
+	long enabled, available, watermark, delay_ns;
+	long length = 0;
+	double freq;
+
+	wd->period_ns = watch_period(wd, trigger, sizeof(trigger), &delay_ns);
+
+	printf("Device %03d: %s", wd->idx, wd->name);
+	if (read_attr_double(wd->dir, "sampling_frequency", &freq) == 0)
+		printf("  sampling_frequency %g", freq);
+	printf("\n");
+
+	printf("  trigger %s", trigger[0] ? trigger : "none");
+	if (delay_ns > 0)
+		printf("  delay_ns %ld", delay_ns);
+	if (wd->period_ns > 0)
+		printf("  expected %.1f scans/s", 1e9 / wd->period_ns);
+	printf("\n");
+
+	if (read_attr_long(wd->buf_dir, "enable", &enabled) == 0) {
+		printf("  buffer %s", enabled ? "on" : "off");
+		if (read_attr_long(wd->buf_dir, "length", &length) == 0)
+			printf("  length %ld", length);
+		if (read_attr_long(wd->buf_dir, "watermark", &watermark) == 0)
+			printf("  watermark %ld", watermark);
+		/* kernels without data_available cannot show the fill level */
+		if (read_attr_long(wd->buf_dir, "data_available",
+				   &available) == 0) {
+			printf("  fill %ld", available);
+			if (length > 0)
+				printf(" (%ld%%)%s", available * 100 / length,
+				       available >= length ? " FULL" : "");
+		}
+		printf("\n");
+	}
+
+	if (wd->fd != -1) {
+		print_stats("now", &wd->now, secs, wd->period_ns);
+		print_stats("total", &wd->total, total_secs, wd->period_ns);
+		if (wd->timestamp < 0)
+			printf("  no timestamp channel enabled, "
+			       "no interval or overrun figures\n");
+	} else if (wd->attach_error == EBUSY) {
+		printf("  buffer is open in another process\n");
+	} else if (wd->attach_error) {
+		printf("  cannot read buffer: %s\n", strerror(wd->attach_error));
+	}
+	memset(&wd->now, 0, sizeof(wd->now));
+}
+
+static int watch_add_device(const char *dev_dir_name, int attach)
+{
+	struct watch_device *wd;
+	int k;
+
+	if (num_watch_devices == WATCH_MAX_DEVICES)
+		return -ENOSPC;
+	wd = &watch_devices[num_watch_devices];
+	memset(wd, 0, sizeof(*wd));
+	wd->fd = -1;
+	wd->timestamp = -1;
+	sscanf(dev_dir_name + strlen(iio_dir) + strlen(type_device),
+			"%i", &wd->idx);
+	if (read_sysfs_string("name", dev_dir_name, wd->name) < 0)
+		return -ENODEV;
+	wd->dir = strdup(dev_dir_name);
+	if (asprintf(&wd->buf_dir, "%s/buffer", dev_dir_name) < 0)
+		return -ENOMEM;
+	num_watch_devices++;
+
+	if (!attach)
+		return 0;
+	/* a device without a buffer just has no scan elements */
+	if (build_channel_array(dev_dir_name, &wd->channels,
+				&wd->num_channels) == 0 && wd->num_channels) {
+		wd->scan_size = size_from_channelarray(wd->channels,
+						       wd->num_channels);
+		for (k = 0; k < wd->num_channels; k++)
+			if (wd->channels[k].bytes == 8 &&
+			    strcmp(wd->channels[k].generic_name,
+				   "in_timestamp") == 0)
+				wd->timestamp = k;
+		wd->data = malloc(WATCH_BUF_SCANS * wd->scan_size);
+		if (!wd->data)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static int watch_devices_run(double interval, int attach)
+{
+	struct pollfd pfd[WATCH_MAX_DEVICES];
+	const struct dirent *ent;
+	struct timespec start, last, now;
+	int64_t left;
+	int i, n, tty;
+	DIR *dp;
+	char *dev_dir_name;
+
+	dp = opendir(iio_dir);
+	if (dp == NULL) {
+		printf("No industrial I/O devices available\n");
+		return -ENODEV;
+	}
+	while (ent = readdir(dp), ent != NULL) {
+		if (!check_prefix(ent->d_name, type_device))
+			continue;
+		if (asprintf(&dev_dir_name, "%s%s", iio_dir,
+			     ent->d_name) < 0) {
+			printf("Memory allocation failed\n");
+			break;
+		}
+		watch_add_device(dev_dir_name, attach);
+		free(dev_dir_name);
+	}
+	closedir(dp);
+
+	tty = isatty(STDOUT_FILENO);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+	while (1) {
+		for (i = 0; i < num_watch_devices; i++)
+			if (attach)
+				watch_attach(&watch_devices[i]);
+
+		/* keep reading the buffers until the next refresh */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (last.tv_sec - now.tv_sec) * 1000 +
+		       (last.tv_nsec - now.tv_nsec) / 1000000 +
+		       (int64_t)(interval * 1000);
+		while (left > 0) {
+			for (i = 0, n = 0; i < num_watch_devices; i++) {
+				if (watch_devices[i].fd == -1)
+					continue;
+				pfd[n].fd = watch_devices[i].fd;
+				pfd[n].events = POLLIN;
+				n++;
+			}
+			poll(pfd, n, left);
+			for (i = 0; i < num_watch_devices; i++)
+				watch_read(&watch_devices[i]);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = (last.tv_sec - now.tv_sec) * 1000 +
+			       (last.tv_nsec - now.tv_nsec) / 1000000 +
+			       (int64_t)(interval * 1000);
+		}
+
+		if (tty)
+			printf("\033[H\033[J");
+		for (i = 0; i < num_watch_devices; i++)
+			watch_print(&watch_devices[i],
+				    (now.tv_sec - last.tv_sec) +
+				    (now.tv_nsec - last.tv_nsec) / 1e9,
+				    (now.tv_sec - start.tv_sec) +
+				    (now.tv_nsec - start.tv_nsec) / 1e9);
+		if (!tty)
+			printf("\n");
+		fflush(stdout);
+		last = now;
+	}
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
+	static const struct option long_options[] = {
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "watch", optional_argument, NULL, 'w' },
+		{ "attach", no_argument, NULL, 'a' },
+		{ NULL, 0, NULL, 0 }
+	};
 	int c, err = 0;
+	int attach = 0;
+	double watch = 0;
 
-	while ((c = getopt(argc, argv, "d:D:v")) != EOF) {
+	while ((c = getopt_long(argc, argv, "d:D:vw::a", long_options,
+				NULL)) != EOF) {
 		switch (c) {
 		case 'v':
 			verblevel++;
 			break;
 
+		case 'w':
+			watch = optarg ? strtod(optarg, NULL) : 1.0;
+			if (watch <= 0)
+				err++;
+			break;
+
+		case 'a':
+			attach = 1;
+			break;
+
 		case '?':
 		default:
 			err++;
@@ -158,10 +584,18 @@ int main(int argc, char **argv)
 			"List industrial I/O devices\n"
 			"  -v, --verbose\n"
 			"      Increase verbosity (may be given multiple times)\n"
+			"  -w, --watch[=SECS]\n"
+			"      Show buffer and trigger state every SECS (default 1)\n"
+			"  -a, --attach\n"
+			"      With --watch, read enabled buffers nobody else has\n"
+			"      open to measure rate, jitter and overruns\n"
 			);
 		exit(1);
 	}
 
+	if (watch > 0)
+		return watch_devices_run(watch, attach) ? 1 : 0;
+
 	dump_devices();
 
 	return 0;
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "resample.h"
+
+
+#define max(a,b) ( (a > b) ? a : b )
+
+
+static int64_t gcd(int64_t a, int64_t b)
+{
+    while (b)
+    {
+        int64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+static double sinc(double x)
+{
+    if (x == 0.0)
+        return 1.0;
+    return sin(M_PI * x) / (M_PI * x);
+}
+
+
+int resampler_init(struct resampler *rs,
+                   int in_period_us,
+                   int out_rate_hz,
+                   int taps)
+{
+    int64_t up = (int64_t)out_rate_hz * in_period_us;
+    int64_t down = 1000000;
+    int length;
+    double cutoff;
+    double *prototype;
+    int64_t g;
+    int p;
+    int k;
+
+    memset(rs, 0, sizeof(*rs));
+    if ((in_period_us <= 0) || (out_rate_hz <= 0) || (taps <= 0))
+        return -EINVAL;
+    g = gcd(up, down);
+    up /= g;
+    down /= g;
+    if ((up > RESAMPLE_MAX_PHASES) || (taps > RESAMPLE_MAX_TAPS))
+        return -EINVAL;
+    // The cutoff drops with the decimation, keep the filter as many cutoff
+    // periods long as it is without
+    if (down > up)
+        taps *= (down + up - 1) / up;
+    taps = (taps + 3) & ~3;
+    if (taps > RESAMPLE_MAX_TAPS)
+        taps = RESAMPLE_MAX_TAPS;
+
+    rs->interp = up;
+    rs->decim = down;
+    rs->taps = taps;
+    rs->in_period_us = in_period_us;
+    rs->out_rate_hz = out_rate_hz;
+    length = rs->interp * taps;
+    rs->coef = malloc(length * sizeof(*rs->coef));
+    prototype = malloc(length * sizeof(*prototype));
+    if ((rs->coef == NULL) || (prototype == NULL))
+    {
+        free(prototype);
+        resampler_free(rs);
+        return -ENOMEM;
+    }
+
+    // Windowed sinc at the interpolated rate, cutoff in cycles per sample
+    cutoff = RESAMPLE_CUTOFF * 0.5 / max(rs->interp, rs->decim);
+    for (k = 0; k < length; k++)
+    {
+        double n = k - (length - 1) / 2.0;
+        double w = 0.42 - 0.5 * cos(2 * M_PI * (k + 0.5) / length) +
+                   0.08 * cos(4 * M_PI * (k + 0.5) / length);
+        prototype[k] = 2 * cutoff * sinc(2 * cutoff * n) * w;
+    }
+
+    // Phase p takes every interp'th coefficient from p, reversed so that
+    // a row lines up with the history window, oldest input first
+    for (p = 0; p < rs->interp; p++)
+    {
+        float *row = rs->coef + p * taps;
+        double sum = 0;
+        for (k = 0; k < taps; k++)
+            sum += prototype[p + (taps - 1 - k) * rs->interp];
+        for (k = 0; k < taps; k++)
+            row[k] = prototype[p + (taps - 1 - k) * rs->interp] / sum;
+    }
+    free(prototype);
+    return 0;
+}
+
+
+void resampler_free(struct resampler *rs)
+{
+    free(rs->coef);
+    rs->coef = NULL;
+}
+
+
+void resampler_reset(struct resampler *rs)
+{
+    rs->pos = 0;
+    rs->primed = 0;
+}
+
+
+int resampler_max_output(const struct resampler *rs, int n)
+{
+    return (n * rs->interp + rs->interp - 1) / rs->decim + 1;
+}
+
+
+static inline float dot(const float *restrict h,
+                        const float *restrict x,
+                        int taps)
+{
+    float sum = 0;
+    int k;
+    for (k = 0; k < taps; k++)
+        sum += h[k] * x[k];
+    return sum;
+}
+
+
+int resampler_process(struct resampler *rs,
+                      const struct sensor_axis_t *in,
+                      int n,
+                      struct sensor_axis_t *out,
+                      int max_out)
+{
+    const int taps = rs->taps;
+    int count = 0;
+    int i;
+    int k;
+
+    if ((n > 0) && !rs->primed)
+    {
+        for (k = 0; k < 2 * taps; k++)
+        {
+            rs->history[0][k] = in[0].x;
+            rs->history[1][k] = in[0].y;
+            rs->history[2][k] = in[0].z;
+        }
+        rs->primed = 1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        // Each sample goes in twice, so the window starting at the oldest
+        // sample is always contiguous
+        rs->history[0][rs->pos] = rs->history[0][rs->pos + taps] = in[i].x;
+        rs->history[1][rs->pos] = rs->history[1][rs->pos + taps] = in[i].y;
+        rs->history[2][rs->pos] = rs->history[2][rs->pos + taps] = in[i].z;
+        if (++rs->pos == taps)
+            rs->pos = 0;
+
+        while (rs->phase < rs->interp)
+        {
+            const float *h = rs->coef + rs->phase * taps;
+            if (count < max_out)
+            {
+                out[count].x = dot(h, rs->history[0] + rs->pos, taps);
+                out[count].y = dot(h, rs->history[1] + rs->pos, taps);
+                out[count].z = dot(h, rs->history[2] + rs->pos, taps);
+                count++;
+            }
+            rs->phase += rs->decim;
+        }
+        rs->phase -= rs->interp;
+    }
+    return count;
+}
+
+
+int64_t resampler_delay_ns(const struct resampler *rs)
+{
+    // Centre of the prototype in interpolated samples, back to input time
+    return (int64_t)(rs->interp * rs->taps - 1) * rs->in_period_us * 1000 / (2 * rs->interp);
+}
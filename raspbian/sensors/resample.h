@@ -0,0 +1,78 @@
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+#include "ahrs.h"
+
+
+/*
+ * Polyphase FIR resampler for one three axis sensor.
+ *
+ * Converts samples taken every in_period_us to out_rate_hz by the rational
+ * factor interp/decim (out_rate_hz * in_period_us / 1000000, reduced). The
+ * prototype is a Blackman windowed sinc of interp * taps coefficients with
+ * its cutoff at RESAMPLE_CUTOFF of the lower of the two Nyquist rates, so
+ * it filters the images when interpolating and the aliases when
+ * decimating. It is split once into interp phases of taps coefficients
+ * each, every phase normalised to unity gain at DC. When decimating, taps
+ * is multiplied by decim / interp rounded up, up to RESAMPLE_MAX_TAPS, so
+ * the filter spans as many cutoff periods and keeps its stop band. An
+ * output then costs one taps long dot product per axis over a contiguous
+ * history window.
+ *
+ * Latency is fixed, see resampler_delay_ns().
+ */
+
+#define RESAMPLE_MAX_PHASES     256
+#define RESAMPLE_MAX_TAPS       128
+#define RESAMPLE_DEFAULT_TAPS   8
+#define RESAMPLE_CUTOFF         0.8
+
+
+struct resampler
+{
+    int interp;
+    int decim;
+    int taps;                   // per phase, a multiple of 4, scaled for decimation
+    int in_period_us;
+    int out_rate_hz;
+    int phase;                  // of the next output within the newest input
+    int pos;
+    int primed;
+    float *coef;                // interp rows of taps, oldest input first
+    float history[3][2 * RESAMPLE_MAX_TAPS];
+};
+
+
+/* taps is per phase without decimation. Returns 0, -EINVAL if the ratio
+ * needs over RESAMPLE_MAX_PHASES phases or taps is out of range, or
+ * -ENOMEM. */
+int resampler_init(struct resampler *rs,
+                   int in_period_us,
+                   int out_rate_hz,
+                   int taps);
+
+void resampler_free(struct resampler *rs);
+
+/* Forgets the history, the next sample fills it again as the first did.
+ * The output phase carries on. */
+void resampler_reset(struct resampler *rs);
+
+/* Most outputs n inputs can produce. */
+int resampler_max_output(const struct resampler *rs, int n);
+
+/* Feeds n samples, writes up to max_out outputs and returns their number.
+ * The first sample also fills the history so there is no start up
+ * transient. */
+int resampler_process(struct resampler *rs,
+                      const struct sensor_axis_t *in,
+                      int n,
+                      struct sensor_axis_t *out,
+                      int max_out);
+
+/* Group delay of the filter, the age of an output's centre sample. */
+int64_t resampler_delay_ns(const struct resampler *rs);
+
+
+#endif // _RESAMPLE_H_
@@ -0,0 +1,150 @@
+/*
+ * Check the resampler's alias rejection.
+ *
+ * For each sensor interval resampled to the fusion rate a tone is fed in
+ * at steps from the output Nyquist rate up to the input Nyquist rate, and
+ * the RMS of the output, once the filter has settled, is compared with
+ * the input's. Tones below the passband edge must come through within
+ * PASS_DB, tones above STOP_START times the output Nyquist rate must be
+ * down by at least STOP_DB, as they would otherwise alias into the band
+ * the fusion sees. Exits non-zero if any tone fails.
+ *
+ * -t sets the taps per phase, as test_iio_sensors -F does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <getopt.h>
+#include "resample.h"
+
+
+#define OUT_RATE_HZ             25
+#define SECONDS                 20
+#define SETTLE_SECONDS          4
+#define PASS_DB                 1.0
+#define STOP_DB                 -40.0
+#define STOP_START              1.5
+#define TONE_STEPS              16
+
+
+static const int in_periods_us[] = { 40000, 33000, 11000 };
+static const char *progname;
+
+
+// Output level of a unit tone in dB, or 1 (never a valid level) on error
+static double tone_level(int in_period_us, int taps, double tone_hz)
+{
+    struct resampler rs;
+    int n = SECONDS * 1000000 / in_period_us;
+    struct sensor_axis_t *in;
+    struct sensor_axis_t *out;
+    int max_out;
+    int count;
+    int skip;
+    double sum = 0;
+    int i;
+
+    if (resampler_init(&rs, in_period_us, OUT_RATE_HZ, taps) != 0)
+        return 1;
+    max_out = resampler_max_output(&rs, n);
+    in = malloc(n * sizeof(*in));
+    out = malloc(max_out * sizeof(*out));
+    if ((in == NULL) || (out == NULL))
+    {
+        free(in);
+        free(out);
+        resampler_free(&rs);
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        in[i].x = sin(2 * M_PI * tone_hz * i * in_period_us / 1e6);
+        in[i].y = 0;
+        in[i].z = 0;
+    }
+    count = resampler_process(&rs, in, n, out, max_out);
+    skip = SETTLE_SECONDS * OUT_RATE_HZ + resampler_delay_ns(&rs) * OUT_RATE_HZ / 1000000000;
+    for (i = skip; i < count; i++)
+        sum += out[i].x * out[i].x;
+    free(in);
+    free(out);
+    resampler_free(&rs);
+    if (count <= skip)
+        return 1;
+    // A unit sine has an RMS of 1/sqrt(2)
+    return 10 * log10(2 * sum / (count - skip));
+}
+
+
+static void syntax(void)
+{
+    fprintf(stderr, "Usage: %s [-t <taps>]\n", progname);
+    fprintf(stderr, " -t <taps>     Filter taps per phase (default %d)\n", RESAMPLE_DEFAULT_TAPS);
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const double out_nyquist = OUT_RATE_HZ / 2.0;
+    int taps = RESAMPLE_DEFAULT_TAPS;
+    int failed = 0;
+    int opt;
+    int i;
+    int j;
+
+    progname = argv[0];
+    while ((opt = getopt(argc, argv, "t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': taps = atoi(optarg); break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+
+    for (i = 0; i < sizeof(in_periods_us) / sizeof(in_periods_us[0]); i++)
+    {
+        const int in_period_us = in_periods_us[i];
+        const double in_nyquist = 500000.0 / in_period_us;
+        struct resampler rs;
+        double worst_stop = -INFINITY;
+        double pass;
+
+        if (resampler_init(&rs, in_period_us, OUT_RATE_HZ, taps) != 0)
+        {
+            fprintf(stderr, "Cannot resample from %d ms to %d Hz with %d taps\n",
+                    in_period_us / 1000, OUT_RATE_HZ, taps);
+            return 1;
+        }
+        printf("%d ms to %d Hz, %d taps per phase:\n", in_period_us / 1000, OUT_RATE_HZ, rs.taps);
+        resampler_free(&rs);
+
+        pass = tone_level(in_period_us, taps, out_nyquist * RESAMPLE_CUTOFF / 2);
+        printf("  %6.2f Hz %7.1f dB\n", out_nyquist * RESAMPLE_CUTOFF / 2, pass);
+        if ((pass > 0.5) || (fabs(pass) > PASS_DB))
+            failed = 1;
+
+        // Nothing to alias when the input is slower than the output
+        if (in_nyquist <= out_nyquist * STOP_START)
+            continue;
+        for (j = 0; j < TONE_STEPS; j++)
+        {
+            double tone_hz = out_nyquist * STOP_START +
+                             (in_nyquist - out_nyquist * STOP_START) * (j + 0.5) / TONE_STEPS;
+            double level = tone_level(in_period_us, taps, tone_hz);
+            printf("  %6.2f Hz %7.1f dB\n", tone_hz, level);
+            if (level > worst_stop)
+                worst_stop = level;
+        }
+        printf("  alias rejection %.1f dB\n", -worst_stop);
+        if (worst_stop > STOP_DB)
+            failed = 1;
+    }
+    if (failed)
+        fprintf(stderr, "FAILED\n");
+    return failed;
+}
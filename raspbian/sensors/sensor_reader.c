@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "sensor_reader.h"
+
+
+#define URING_ENTRIES           64
+
+// io_uring and epoll user data, the low bits are the fd or extra slot index
+#define TAG_DEVICE              (1ULL << 32)
+#define TAG_EXTRA               (2ULL << 32)
+#define TAG_REMOVE              (3ULL << 32)
+#define TAG_TIMEOUT             (4ULL << 32)
+#define TAG_MASK                (0xFFULL << 32)
+
+
+struct extra_slot
+{
+    int fd;
+    short events;
+    int registered;             // epoll: added, io_uring: poll queued
+    uint32_t generation;
+    uint32_t seq;               // io_uring: of the queued poll, in its user data
+};
+
+
+#ifdef HAVE_IO_URING
+struct uring
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned sqe_tail;          // next sqe, published to *sq_tail on enter
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int fixed_buffers;          // buffers registered, reads use READ_FIXED
+};
+#endif
+
+
+struct sensor_reader
+{
+    int backend;
+    int num_fds;
+    int fds[SENSOR_READER_MAX_FDS];
+    char *buffers[SENSOR_READER_MAX_FDS];
+    int sizes[SENSOR_READER_MAX_FDS];
+    int fd_flags[SENSOR_READER_MAX_FDS];
+    struct pollfd pollfds[SENSOR_READER_MAX_FDS + SENSOR_READER_MAX_EXTRA];
+    int epoll_fd;
+    struct extra_slot extra[SENSOR_READER_MAX_EXTRA];
+#ifdef HAVE_IO_URING
+    struct uring ring;
+    struct iovec iov[SENSOR_READER_MAX_FDS];
+    int queued[SENSOR_READER_MAX_FDS];
+#ifdef IORING_TIMEOUT_ABS
+    struct __kernel_timespec timeout;
+    int timeout_queued;
+#endif
+#endif
+};
+
+
+static const char *backend_names[] = { "poll", "epoll", "uring" };
+
+
+int sensor_reader_backend_from_name(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(backend_names) / sizeof(backend_names[0])); i++)
+    {
+        if (strcmp(name, backend_names[i]) == 0)
+        {
+#ifndef HAVE_IO_URING
+            if (i == SENSOR_READER_URING)
+                return -1;
+#endif
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+const char *sensor_reader_backend_name(int backend)
+{
+    if ((backend < 0) || (backend > SENSOR_READER_URING))
+        return "?";
+    return backend_names[backend];
+}
+
+
+static int read_device(struct sensor_reader *reader, int i)
+{
+    int len = read(reader->fds[i], reader->buffers[i], reader->sizes[i]);
+    if (len >= 0)
+        return len;
+    if ((errno == EAGAIN) || (errno == EINTR))
+        return 0;
+    return -errno;
+}
+
+//------------------------------------------------------------------------------
+
+static int wait_poll(struct sensor_reader *reader,
+                     int *lengths,
+                     struct pollfd *extra,
+                     int num_extra,
+                     int timeout_ms)
+{
+    int ready = 0;
+    int i;
+
+    for (i = 0; i < reader->num_fds; i++)
+    {
+        reader->pollfds[i].fd = reader->fds[i];
+        reader->pollfds[i].events = POLLIN;
+        lengths[i] = 0;
+    }
+    memcpy(reader->pollfds + reader->num_fds, extra, num_extra * sizeof(*extra));
+    if (poll(reader->pollfds, reader->num_fds + num_extra, timeout_ms) < 0)
+        return (errno == EINTR) ? 0 : -errno;
+
+    for (i = 0; i < reader->num_fds; i++)
+    {
+        if (reader->pollfds[i].revents & POLLIN)
+        {
+            lengths[i] = read_device(reader, i);
+            if (lengths[i] != 0)
+                ready++;
+        }
+    }
+    for (i = 0; i < num_extra; i++)
+        extra[i].revents = reader->pollfds[reader->num_fds + i].revents;
+    return ready;
+}
+
+//------------------------------------------------------------------------------
+
+static uint32_t to_epoll_events(short events)
+{
+    return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+
+static short from_epoll_events(uint32_t events)
+{
+    return ((events & EPOLLIN) ? POLLIN : 0) |
+           ((events & EPOLLOUT) ? POLLOUT : 0) |
+           ((events & EPOLLERR) ? POLLERR : 0) |
+           ((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+
+static int open_epoll(struct sensor_reader *reader)
+{
+    int i;
+
+    reader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reader->epoll_fd < 0)
+        return -errno;
+    for (i = 0; i < reader->num_fds; i++)
+    {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG_DEVICE | i };
+        if (reader->fds[i] < 0)
+            continue;
+        if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, reader->fds[i], &ev) < 0)
+            return -errno;
+    }
+    return 0;
+}
+
+
+/* Brings the registered extra fds in line with extra[], only touching the
+ * slots that changed. Stale slots are all removed before any are added, a
+ * reused fd number may have moved to another slot. */
+static void sync_epoll_extra(struct sensor_reader *reader,
+                             struct pollfd *extra,
+                             int num_extra,
+                             uint32_t generation)
+{
+    int i;
+
+    for (i = 0; i < SENSOR_READER_MAX_EXTRA; i++)
+    {
+        struct extra_slot *slot = &reader->extra[i];
+        int fd = (i < num_extra) ? extra[i].fd : -1;
+
+        // The fd may already be closed, in which case epoll dropped it
+        if (slot->registered && ((slot->fd != fd) || (slot->generation != generation)))
+        {
+            epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, slot->fd, NULL);
+            slot->registered = 0;
+        }
+    }
+
+    for (i = 0; i < SENSOR_READER_MAX_EXTRA; i++)
+    {
+        struct extra_slot *slot = &reader->extra[i];
+        int fd = (i < num_extra) ? extra[i].fd : -1;
+        short events = (i < num_extra) ? extra[i].events : 0;
+        struct epoll_event ev = { .events = to_epoll_events(events), .data.u64 = TAG_EXTRA | i };
+
+        if (slot->registered)
+        {
+            if (slot->events != events)
+                epoll_ctl(reader->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        }
+        else if (fd >= 0)
+        {
+            if ((epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) ||
+                ((errno == EEXIST) && (epoll_ctl(reader->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0)))
+                slot->registered = 1;
+        }
+        slot->fd = fd;
+        slot->events = events;
+        slot->generation = generation;
+    }
+}
+
+
+static int wait_epoll(struct sensor_reader *reader,
+                      int *lengths,
+                      struct pollfd *extra,
+                      int num_extra,
+                      uint32_t generation,
+                      int timeout_ms)
+{
+    struct epoll_event events[SENSOR_READER_MAX_FDS + SENSOR_READER_MAX_EXTRA];
+    int ready = 0;
+    int n;
+    int i;
+
+    sync_epoll_extra(reader, extra, num_extra, generation);
+    for (i = 0; i < num_extra; i++)
+        extra[i].revents = 0;
+    for (i = 0; i < reader->num_fds; i++)
+        lengths[i] = 0;
+
+    n = epoll_wait(reader->epoll_fd, events, SENSOR_READER_MAX_FDS + SENSOR_READER_MAX_EXTRA, timeout_ms);
+    if (n < 0)
+        return (errno == EINTR) ? 0 : -errno;
+    for (i = 0; i < n; i++)
+    {
+        int index = events[i].data.u64 & 0xFFFFFFFF;
+        if ((events[i].data.u64 & TAG_MASK) == TAG_DEVICE)
+        {
+            lengths[index] = read_device(reader, index);
+            if (lengths[index] != 0)
+                ready++;
+        }
+        else if (index < num_extra)
+            extra[index].revents = from_epoll_events(events[i].events);
+    }
+    return ready;
+}
+
+//------------------------------------------------------------------------------
+
+#ifdef HAVE_IO_URING
+
+static int uring_setup(struct uring *ring)
+{
+    struct io_uring_params params;
+    int features;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return -errno;
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    features = params.features;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+#endif
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        return -errno;
+    if (ring->cq_ring_size)
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            return -errno;
+    }
+    else
+        ring->cq_ring = ring->sq_ring;
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -errno;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+
+static void uring_teardown(struct uring *ring)
+{
+    if (ring->sqes && (ring->sqes != MAP_FAILED))
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size && ring->cq_ring && (ring->cq_ring != MAP_FAILED))
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && (ring->sq_ring != MAP_FAILED))
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->fd = -1;
+}
+
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned index;
+
+    if (ring->sqe_tail - head >= ring->entries)
+        return NULL;
+    index = ring->sqe_tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+    return &ring->sqes[index];
+}
+
+
+/* Submits every sqe not yet taken by the kernel, including any left over
+ * from an interrupted call, and waits for at least one completion. */
+static int uring_enter(struct uring *ring)
+{
+    unsigned to_submit;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        return -errno;
+    return 0;
+}
+
+
+static void uring_queue_read(struct sensor_reader *reader, int i)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((reader->fds[i] < 0) || ((sqe = uring_get_sqe(&reader->ring)) == NULL))
+        return;
+    sqe->fd = reader->fds[i];
+    if (reader->ring.fixed_buffers)
+    {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)reader->buffers[i];
+        sqe->len = reader->sizes[i];
+        sqe->buf_index = i;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)&reader->iov[i];
+        sqe->len = 1;
+    }
+    sqe->user_data = TAG_DEVICE | i;
+    reader->queued[i] = 1;
+}
+
+
+static int open_uring(struct sensor_reader *reader)
+{
+    int ret;
+    int i;
+
+    if ((ret = uring_setup(&reader->ring)) != 0)
+        return ret;
+    for (i = 0; i < reader->num_fds; i++)
+    {
+        reader->iov[i].iov_base = reader->buffers[i];
+        reader->iov[i].iov_len = reader->sizes[i];
+    }
+    // Registered buffers count against RLIMIT_MEMLOCK, fall back to READV
+    reader->ring.fixed_buffers =
+        (syscall(__NR_io_uring_register, reader->ring.fd, IORING_REGISTER_BUFFERS,
+                 reader->iov, reader->num_fds) == 0);
+
+    // A queued read on an O_NONBLOCK fd would complete with -EAGAIN at once
+    for (i = 0; i < reader->num_fds; i++)
+    {
+        if (reader->fds[i] < 0)
+            continue;
+        reader->fd_flags[i] = fcntl(reader->fds[i], F_GETFL);
+        if (reader->fd_flags[i] & O_NONBLOCK)
+            fcntl(reader->fds[i], F_SETFL, reader->fd_flags[i] & ~O_NONBLOCK);
+        uring_queue_read(reader, i);
+    }
+    return 0;
+}
+
+
+static void close_uring(struct sensor_reader *reader)
+{
+    int i;
+
+    // Closing the ring cancels the queued reads
+    uring_teardown(&reader->ring);
+    for (i = 0; i < reader->num_fds; i++)
+    {
+        if (reader->fd_flags[i] & O_NONBLOCK)
+            fcntl(reader->fds[i], F_SETFL, reader->fd_flags[i]);
+    }
+}
+
+
+static void sync_uring_extra(struct sensor_reader *reader,
+                             struct pollfd *extra,
+                             int num_extra,
+                             uint32_t generation)
+{
+    int i;
+
+    for (i = 0; i < SENSOR_READER_MAX_EXTRA; i++)
+    {
+        struct extra_slot *slot = &reader->extra[i];
+        int fd = (i < num_extra) ? extra[i].fd : -1;
+        short events = (i < num_extra) ? extra[i].events : 0;
+        struct io_uring_sqe *sqe;
+
+        if (slot->registered)
+        {
+            if ((slot->fd == fd) && (slot->events == events) && (slot->generation == generation))
+                continue;
+            // The cancelled poll completes with -ECANCELED and a stale
+            // seq, which reaping ignores
+            if ((sqe = uring_get_sqe(&reader->ring)) == NULL)
+                continue;
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = TAG_EXTRA | ((uint64_t)slot->seq << 40) | i;
+            sqe->user_data = TAG_REMOVE;
+            slot->registered = 0;
+        }
+        slot->fd = fd;
+        slot->events = events;
+        slot->generation = generation;
+        if ((fd >= 0) && ((sqe = uring_get_sqe(&reader->ring)) != NULL))
+        {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll_events = events;
+            slot->seq = (slot->seq + 1) & 0xFFFFFF;
+            sqe->user_data = TAG_EXTRA | ((uint64_t)slot->seq << 40) | i;
+            slot->registered = 1;
+        }
+    }
+}
+
+
+static int wait_uring(struct sensor_reader *reader,
+                      int *lengths,
+                      struct pollfd *extra,
+                      int num_extra,
+                      uint32_t generation,
+                      int timeout_ms)
+{
+    struct uring *ring = &reader->ring;
+    unsigned head;
+    unsigned tail;
+    int ready = 0;
+    int ret;
+    int i;
+
+    // Re-queue the reads reaped last time, this goes in the same syscall
+    // as the wait
+    for (i = 0; i < reader->num_fds; i++)
+    {
+        if (!reader->queued[i])
+            uring_queue_read(reader, i);
+        lengths[i] = 0;
+    }
+    sync_uring_extra(reader, extra, num_extra, generation);
+    for (i = 0; i < num_extra; i++)
+        extra[i].revents = 0;
+#ifdef IORING_TIMEOUT_ABS
+    // Completes after timeout_ms or with the first other completion
+    if ((timeout_ms >= 0) && !reader->timeout_queued)
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (sqe != NULL)
+        {
+            reader->timeout.tv_sec = timeout_ms / 1000;
+            reader->timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uintptr_t)&reader->timeout;
+            sqe->len = 1;
+            sqe->off = 1;
+            sqe->user_data = TAG_TIMEOUT;
+            reader->timeout_queued = 1;
+        }
+    }
+#endif
+
+    if ((ret = uring_enter(ring)) != 0)
+        return (ret == -EINTR) ? 0 : ret;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t tag = cqe->user_data & TAG_MASK;
+        int index = cqe->user_data & 0xFF;
+
+#ifdef IORING_TIMEOUT_ABS
+        if (tag == TAG_TIMEOUT)
+            reader->timeout_queued = 0;
+#endif
+        if (tag == TAG_DEVICE)
+        {
+            reader->queued[index] = 0;
+            if ((cqe->res == -EAGAIN) || (cqe->res == -EINTR))
+                continue;
+            lengths[index] = cqe->res;
+            if (cqe->res != 0)
+                ready++;
+        }
+        else if (tag == TAG_EXTRA)
+        {
+            struct extra_slot *slot = &reader->extra[index];
+            if (!slot->registered || ((cqe->user_data >> 40) != slot->seq))
+                continue;
+            if (cqe->res != -ECANCELED)
+            {
+                // Polls are one shot, sync_uring_extra queues the next
+                slot->registered = 0;
+                if (index < num_extra)
+                    extra[index].revents = (cqe->res < 0) ? POLLERR : cqe->res;
+            }
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return ready;
+}
+
+#endif // HAVE_IO_URING
+
+//------------------------------------------------------------------------------
+
+struct sensor_reader *sensor_reader_open(int backend,
+                                         int num_fds,
+                                         const int *fds,
+                                         char *const *buffers,
+                                         const int *sizes)
+{
+    struct sensor_reader *reader;
+    int ret = 0;
+    int i;
+
+    if ((num_fds <= 0) || (num_fds > SENSOR_READER_MAX_FDS))
+        return NULL;
+    reader = calloc(1, sizeof(*reader));
+    if (reader == NULL)
+        return NULL;
+    reader->backend = backend;
+    reader->num_fds = num_fds;
+    reader->epoll_fd = -1;
+    for (i = 0; i < num_fds; i++)
+    {
+        reader->fds[i] = fds[i];
+        reader->buffers[i] = buffers[i];
+        reader->sizes[i] = sizes[i];
+    }
+
+    switch (backend)
+    {
+        case SENSOR_READER_POLL:
+            break;
+        case SENSOR_READER_EPOLL:
+            ret = open_epoll(reader);
+            break;
+#ifdef HAVE_IO_URING
+        case SENSOR_READER_URING:
+            reader->ring.fd = -1;
+            ret = open_uring(reader);
+            break;
+#endif
+        default:
+            ret = -EINVAL;
+            break;
+    }
+    if (ret)
+    {
+        fprintf(stderr, "Cannot set up %s reader: %s\n",
+                sensor_reader_backend_name(backend), strerror(-ret));
+        sensor_reader_close(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+
+void sensor_reader_close(struct sensor_reader *reader)
+{
+    if (reader == NULL)
+        return;
+#ifdef HAVE_IO_URING
+    if (reader->backend == SENSOR_READER_URING)
+        close_uring(reader);
+#endif
+    if (reader->epoll_fd >= 0)
+        close(reader->epoll_fd);
+    free(reader);
+}
+
+
+int sensor_reader_wait(struct sensor_reader *reader,
+                       int *lengths,
+                       struct pollfd *extra,
+                       int num_extra,
+                       uint32_t extra_generation,
+                       int timeout_ms)
+{
+    if (num_extra > SENSOR_READER_MAX_EXTRA)
+        num_extra = SENSOR_READER_MAX_EXTRA;
+    switch (reader->backend)
+    {
+        case SENSOR_READER_EPOLL:
+            return wait_epoll(reader, lengths, extra, num_extra, extra_generation, timeout_ms);
+#ifdef HAVE_IO_URING
+        case SENSOR_READER_URING:
+            return wait_uring(reader, lengths, extra, num_extra, extra_generation, timeout_ms);
+#endif
+        default:
+            return wait_poll(reader, lengths, extra, num_extra, timeout_ms);
+    }
+}
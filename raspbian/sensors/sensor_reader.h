@@ -0,0 +1,76 @@
+#ifndef _SENSOR_READER_H_
+#define _SENSOR_READER_H_
+
+#include <stdint.h>
+#include <poll.h>
+
+
+/*
+ * Waits for and reads a fixed set of IIO buffer fds (/dev/iio:deviceN,
+ * opened O_NONBLOCK) into fixed buffers, one wakeup at a time.
+ *
+ * SENSOR_READER_POLL   poll() on every fd, then read() each ready one
+ * SENSOR_READER_EPOLL  the device fds stay registered, epoll_wait() then
+ *                      read() each ready one
+ * SENSOR_READER_URING  a read stays queued on every device fd, into
+ *                      registered buffers where the kernel allows, and one
+ *                      io_uring_enter() both re-queues the reads reaped
+ *                      last time and waits for the next completions. Only
+ *                      built with HAVE_IO_URING, needs Linux 5.1.
+ *
+ * The caller may also pass extra pollfds (e.g. from sensor_stream_pollfds)
+ * which are waited on together with the devices and get their revents
+ * filled in. Extra fds with fd < 0 are ignored, as with poll(). The epoll
+ * and io_uring backends keep extra fds registered between waits while the
+ * fd, events and generation stay the same; change the generation whenever
+ * an fd number may have been closed and reused (see
+ * sensor_stream_generation).
+ *
+ * Device fds < 0 are skipped too, so a device that is being re-armed can
+ * keep its index.
+ */
+
+#define SENSOR_READER_MAX_FDS       8
+#define SENSOR_READER_MAX_EXTRA     16
+
+enum sensor_reader_backend
+{
+    SENSOR_READER_POLL,
+    SENSOR_READER_EPOLL,
+    SENSOR_READER_URING,
+};
+
+struct sensor_reader;
+
+
+/* Backend by name ("poll", "epoll", "uring"), -1 if unknown or not built. */
+int sensor_reader_backend_from_name(const char *name);
+
+const char *sensor_reader_backend_name(int backend);
+
+/* Buffer i takes the reads of fds[i], at most sizes[i] bytes each. The
+ * io_uring backend clears O_NONBLOCK on the fds while it is open. */
+struct sensor_reader *sensor_reader_open(int backend,
+                                         int num_fds,
+                                         const int *fds,
+                                         char *const *buffers,
+                                         const int *sizes);
+
+void sensor_reader_close(struct sensor_reader *reader);
+
+/*
+ * Blocks until at least one device has data, one extra fd is ready or
+ * timeout_ms passes (-1 waits forever, the io_uring backend needs Linux 5.4
+ * headers for a timeout), then sets lengths[i] to the bytes read into
+ * buffer i: 0 if none, -errno if the read failed. Returns the number of
+ * devices read, 0 on timeout or if interrupted by a signal, or -errno.
+ */
+int sensor_reader_wait(struct sensor_reader *reader,
+                       int *lengths,
+                       struct pollfd *extra,
+                       int num_extra,
+                       uint32_t extra_generation,
+                       int timeout_ms);
+
+
+#endif // _SENSOR_READER_H_
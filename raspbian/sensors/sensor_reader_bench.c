@@ -0,0 +1,321 @@
+/*
+ * Compare the sensor_reader backends.
+ *
+ * A writer thread plays the part of the IIO triggers: every source gets a
+ * scan of -s bytes at its own rate, written into a non-blocking pipe, and
+ * the first 8 bytes of a scan are its CLOCK_MONOTONIC time like an IIO
+ * timestamp channel. The main thread reads all pipes through one backend
+ * for -t seconds and reports wakeups, scans per wakeup, its own CPU time
+ * and the latency from scan to read. Each backend is run in turn on the
+ * same load.
+ *
+ * With -d the named devices (e.g. /dev/iio:device0) are read instead of
+ * pipes, their buffers must already be enabled (e.g. with generic_buffer
+ * -c 0 running elsewhere, or test_iio_sensors stopped with its buffers
+ * left on).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "sensor_reader.h"
+
+
+#define MAX_SOURCES             SENSOR_READER_MAX_FDS
+#define MAX_SCAN_SIZE           64
+#define BUFFER_SCANS            128
+
+
+struct source
+{
+    int rate_hz;
+    int read_fd;
+    int write_fd;
+    int64_t next_ns;
+};
+
+
+struct bench_result
+{
+    uint64_t wakeups;
+    uint64_t reads;
+    uint64_t scans;
+    uint64_t latency_sum_ns;
+    int64_t latency_max_ns;
+    double cpu_s;
+    double elapsed_s;
+};
+
+
+static struct source sources[MAX_SOURCES];
+static int num_sources = 0;
+static int scan_size = 16;
+static int use_devices = 0;
+static volatile int writer_stop = 0;
+static const char *progname = "";
+
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static double cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+static void *writer_thread(void *arg)
+{
+    char scan[MAX_SCAN_SIZE];
+    int i;
+
+    (void)arg;
+    memset(scan, 0, sizeof(scan));
+    for (i = 0; i < num_sources; i++)
+        sources[i].next_ns = now_ns();
+    while (!writer_stop)
+    {
+        int64_t next = INT64_MAX;
+        struct timespec ts;
+
+        for (i = 0; i < num_sources; i++)
+        {
+            int64_t t = now_ns();
+            if (t >= sources[i].next_ns)
+            {
+                memcpy(scan, &t, sizeof(t));
+                // A full pipe drops the scan, as a full IIO buffer would
+                if (write(sources[i].write_fd, scan, scan_size) < 0) {}
+                sources[i].next_ns += 1000000000LL / sources[i].rate_hz;
+            }
+            if (sources[i].next_ns < next)
+                next = sources[i].next_ns;
+        }
+        ts.tv_sec = next / 1000000000LL;
+        ts.tv_nsec = next % 1000000000LL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    return NULL;
+}
+
+
+static void drain(void)
+{
+    char buffer[BUFFER_SCANS * MAX_SCAN_SIZE];
+    int i;
+
+    for (i = 0; i < num_sources; i++)
+        while (read(sources[i].read_fd, buffer, sizeof(buffer)) > 0)
+            ;
+}
+
+
+static int run_backend(int backend, double seconds, struct bench_result *result)
+{
+    static char buffers[MAX_SOURCES][BUFFER_SCANS * MAX_SCAN_SIZE];
+    char *buffer_ptrs[MAX_SOURCES];
+    int sizes[MAX_SOURCES];
+    int fds[MAX_SOURCES];
+    struct sensor_reader *reader;
+    int64_t start;
+    int64_t end;
+    double cpu_start;
+    int i;
+
+    for (i = 0; i < num_sources; i++)
+    {
+        fds[i] = sources[i].read_fd;
+        buffer_ptrs[i] = buffers[i];
+        sizes[i] = BUFFER_SCANS * scan_size;
+    }
+    drain();
+    reader = sensor_reader_open(backend, num_sources, fds, buffer_ptrs, sizes);
+    if (reader == NULL)
+        return -1;
+
+    memset(result, 0, sizeof(*result));
+    start = now_ns();
+    end = start + (int64_t)(seconds * 1e9);
+    cpu_start = cpu_seconds();
+    while (now_ns() < end)
+    {
+        int lengths[MAX_SOURCES];
+        int ret = sensor_reader_wait(reader, lengths, NULL, 0, 0, -1);
+        int64_t t = now_ns();
+
+        if (ret < 0)
+        {
+            fprintf(stderr, "%s: wait failed: %s\n", sensor_reader_backend_name(backend), strerror(-ret));
+            break;
+        }
+        result->wakeups++;
+        for (i = 0; i < num_sources; i++)
+        {
+            int64_t ts;
+            if (lengths[i] <= 0)
+                continue;
+            result->reads++;
+            result->scans += lengths[i] / scan_size;
+            if (use_devices)
+                continue;
+            // Latency of the oldest scan in the read, the one that waited longest
+            memcpy(&ts, buffers[i], sizeof(ts));
+            result->latency_sum_ns += t - ts;
+            if (t - ts > result->latency_max_ns)
+                result->latency_max_ns = t - ts;
+        }
+    }
+    result->cpu_s = cpu_seconds() - cpu_start;
+    result->elapsed_s = (now_ns() - start) / 1e9;
+    sensor_reader_close(reader);
+    return 0;
+}
+
+
+static void print_result(int backend, struct bench_result *result)
+{
+    fprintf(stdout, "%-6s %9.1f %9.1f %7.2f %7.2f %9.2f %9.1f %9.1f\n",
+            sensor_reader_backend_name(backend),
+            result->wakeups / result->elapsed_s,
+            result->scans / result->elapsed_s,
+            result->wakeups ? (double)result->scans / result->wakeups : 0,
+            100.0 * result->cpu_s / result->elapsed_s,
+            result->wakeups ? 1e6 * result->cpu_s / result->wakeups : 0,
+            result->reads ? result->latency_sum_ns / 1e3 / result->reads : 0,
+            result->latency_max_ns / 1e3);
+}
+
+
+static void syntax(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "%s [options]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -r <hz>[,<hz>...]  Simulated sources and their rates (default 1000,1000,1000)\n");
+    fprintf(stderr, " -s <bytes>         Scan size (default %d, at most %d)\n", scan_size, MAX_SCAN_SIZE);
+    fprintf(stderr, " -t <seconds>       Time per backend (default 5)\n");
+    fprintf(stderr, " -b <backend>       Only run poll, epoll or uring (default all built)\n");
+    fprintf(stderr, " -d <device>        Read an enabled IIO device instead, may repeat\n");
+    fprintf(stderr, " -h                 display this information\n");
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *rates = "1000,1000,1000";
+    const char *devices[MAX_SOURCES];
+    int num_devices = 0;
+    double seconds = 5;
+    int only_backend = -1;
+    pthread_t writer;
+    int backend;
+    int opt;
+    int i;
+
+    progname = argv[0];
+    while ((opt = getopt(argc, argv, "r:s:t:b:d:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': rates = optarg; break;
+            case 's': scan_size = atoi(optarg); break;
+            case 't': seconds = atof(optarg); break;
+            case 'b':
+                only_backend = sensor_reader_backend_from_name(optarg);
+                if (only_backend < 0)
+                    syntax();
+                break;
+            case 'd':
+                if (num_devices >= MAX_SOURCES)
+                    syntax();
+                devices[num_devices++] = optarg;
+                break;
+            case 'h': // fall through
+            default:
+                syntax();
+                break;
+        }
+    }
+    if ((scan_size < 8) || (scan_size > MAX_SCAN_SIZE) || (seconds <= 0))
+        syntax();
+
+    signal(SIGPIPE, SIG_IGN);
+    if (num_devices)
+    {
+        use_devices = 1;
+        for (i = 0; i < num_devices; i++)
+        {
+            sources[i].read_fd = open(devices[i], O_RDONLY | O_NONBLOCK);
+            if (sources[i].read_fd < 0)
+            {
+                fprintf(stderr, "Cannot open %s: %s\n", devices[i], strerror(errno));
+                return EXIT_FAILURE;
+            }
+        }
+        num_sources = num_devices;
+    }
+    else
+    {
+        char *list = strdup(rates);
+        char *saveptr = NULL;
+        char *tok;
+        for (tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+        {
+            int pipe_fds[2];
+            if ((num_sources >= MAX_SOURCES) || (atoi(tok) <= 0))
+                syntax();
+            if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0)
+            {
+                fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+            sources[num_sources].rate_hz = atoi(tok);
+            sources[num_sources].read_fd = pipe_fds[0];
+            sources[num_sources].write_fd = pipe_fds[1];
+            num_sources++;
+        }
+        free(list);
+        if (num_sources == 0)
+            syntax();
+        pthread_create(&writer, NULL, writer_thread, NULL);
+    }
+
+    fprintf(stdout, "%d sources, %d byte scans, %.1f s per backend\n", num_sources, scan_size, seconds);
+    fprintf(stdout, "%-6s %9s %9s %7s %7s %9s %9s %9s\n",
+            "", "wakeup/s", "scans/s", "scan/wk", "cpu %", "cpu us/wk", "lat us", "lat max");
+    for (backend = SENSOR_READER_POLL; backend <= SENSOR_READER_URING; backend++)
+    {
+        struct bench_result result;
+        if ((only_backend >= 0) && (backend != only_backend))
+            continue;
+        if (sensor_reader_backend_from_name(sensor_reader_backend_name(backend)) < 0)
+            continue;
+        if (run_backend(backend, seconds, &result) == 0)
+            print_result(backend, &result);
+    }
+
+    if (!use_devices)
+    {
+        writer_stop = 1;
+        pthread_join(writer, NULL);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "sensor_stream.h"
+
+
+#define MAX_CLIENTS             (SENSOR_STREAM_MAX_POLLFDS - 1)
+#define CLIENT_QUEUE_LENGTH     32
+#define MAX_FRAME_SIZE          128
+#define MAX_REQUEST_LENGTH      128
+#define MAX_RATE_HZ             1000
+
+
+struct stream_client
+{
+    int fd;
+    int fields;
+    int rate_hz;
+    int64_t period_ns;
+    int64_t next_due_ns;
+    uint32_t seq;
+    uint32_t dropped;
+    // queued frames, oldest at head
+    char frames[CLIENT_QUEUE_LENGTH][MAX_FRAME_SIZE];
+    int frame_length[CLIENT_QUEUE_LENGTH];
+    int head;
+    int count;
+    int head_offset;    // bytes of the head frame already written
+    char request[MAX_REQUEST_LENGTH];
+    int request_length;
+};
+
+
+struct sensor_stream
+{
+    char *path;
+    int listen_fd;
+    uint32_t generation;        // bumped on every accept
+    struct stream_client clients[MAX_CLIENTS];
+};
+
+
+static const struct
+{
+    const char *name;
+    int field;
+} field_names[] =
+{
+    { "accel",       SENSOR_FIELD_ACCEL       },
+    { "magn",        SENSOR_FIELD_MAGN        },
+    { "gyro",        SENSOR_FIELD_GYRO        },
+    { "orientation", SENSOR_FIELD_ORIENTATION },
+    { "pressure",    SENSOR_FIELD_PRESSURE    },
+    { "all",         SENSOR_FIELD_ALL         },
+};
+
+
+static void client_reset(struct stream_client *client)
+{
+    client->fd = -1;
+    client->fields = 0;
+    client->rate_hz = 0;
+    client->period_ns = 0;
+    client->next_due_ns = 0;
+    client->seq = 0;
+    client->dropped = 0;
+    client->head = 0;
+    client->count = 0;
+    client->head_offset = 0;
+    client->request_length = 0;
+}
+
+
+static void client_close(struct stream_client *client)
+{
+    if (client->fd != -1)
+        close(client->fd);
+    client_reset(client);
+}
+
+
+struct sensor_stream *sensor_stream_open(const char *path)
+{
+    struct sockaddr_un addr;
+    struct sensor_stream *stream;
+    int i;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return NULL;
+    }
+
+    stream = malloc(sizeof(struct sensor_stream));
+    if (stream == NULL)
+        return NULL;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        client_reset(&stream->clients[i]);
+    stream->generation = 0;
+    stream->path = strdup(path);
+
+    stream->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stream->listen_fd == -1)
+    {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        goto error_ret;
+    }
+    fcntl(stream->listen_fd, F_SETFL, fcntl(stream->listen_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(stream->listen_fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((bind(stream->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+        (listen(stream->listen_fd, MAX_CLIENTS) == -1))
+    {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        goto error_ret;
+    }
+    return stream;
+
+error_ret:
+    if (stream->listen_fd != -1)
+        close(stream->listen_fd);
+    free(stream->path);
+    free(stream);
+    return NULL;
+}
+
+
+void sensor_stream_close(struct sensor_stream *stream)
+{
+    int i;
+
+    if (stream == NULL)
+        return;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        client_close(&stream->clients[i]);
+    close(stream->listen_fd);
+    unlink(stream->path);
+    free(stream->path);
+    free(stream);
+}
+
+
+int sensor_stream_wanted_fields(struct sensor_stream *stream)
+{
+    int fields = 0;
+    int i;
+
+    if (stream == NULL)
+        return 0;
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (stream->clients[i].fd != -1)
+            fields |= stream->clients[i].fields;
+    }
+    return fields;
+}
+
+
+int64_t sensor_stream_next_due(struct sensor_stream *stream)
+{
+    int64_t next = INT64_MAX;
+    int i;
+
+    if (stream == NULL)
+        return next;
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct stream_client *client = &stream->clients[i];
+        if ((client->fd != -1) && (client->fields) && (client->rate_hz) &&
+            (client->next_due_ns < next))
+            next = client->next_due_ns;
+    }
+    return next;
+}
+
+
+static char *put_float(char *p, double v)
+{
+    union { float f; uint32_t u; } c;
+    c.f = (float)v;
+    c.u = htole32(c.u);
+    memcpy(p, &c.u, sizeof(c.u));
+    return p + sizeof(c.u);
+}
+
+
+static char *put_axis(char *p, const struct sensor_axis_t *axis)
+{
+    p = put_float(p, axis->x);
+    p = put_float(p, axis->y);
+    return put_float(p, axis->z);
+}
+
+
+static int encode_frame(struct stream_client *client,
+                        const struct sensor_sample_t *sample,
+                        char *frame)
+{
+    struct sensor_stream_header header;
+    char *p = frame + sizeof(header);
+
+    if (client->fields & SENSOR_FIELD_ACCEL)
+        p = put_axis(p, &sample->accel);
+    if (client->fields & SENSOR_FIELD_MAGN)
+        p = put_axis(p, &sample->magn);
+    if (client->fields & SENSOR_FIELD_GYRO)
+        p = put_axis(p, &sample->gyro);
+    if (client->fields & SENSOR_FIELD_ORIENTATION)
+    {
+        p = put_float(p, sample->orientation.roll);
+        p = put_float(p, sample->orientation.pitch);
+        p = put_float(p, sample->orientation.yaw);
+    }
+    if (client->fields & SENSOR_FIELD_PRESSURE)
+    {
+        uint32_t pressure = htole32((uint32_t)sample->pressure);
+        memcpy(p, &pressure, sizeof(pressure));
+        p += sizeof(pressure);
+        p = put_float(p, sample->temperature);
+    }
+
+    header.magic = htole32(SENSOR_STREAM_MAGIC);
+    header.version = htole16(SENSOR_STREAM_VERSION);
+    header.fields = htole16(client->fields);
+    header.length = htole16(p - frame);
+    header.flags = htole16(sample->flags);
+    header.seq = htole32(client->seq);
+    header.dropped = htole32(client->dropped);
+    header.reserved = 0;
+    header.timestamp_ns = htole64(sample->timestamp_ns);
+    memcpy(frame, &header, sizeof(header));
+    return p - frame;
+}
+
+
+void sensor_stream_publish(struct sensor_stream *stream,
+                           const struct sensor_sample_t *sample)
+{
+    int i;
+
+    if (stream == NULL)
+        return;
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct stream_client *client = &stream->clients[i];
+        if ((client->fd == -1) || (client->fields == 0) || (client->rate_hz == 0) ||
+            (sample->timestamp_ns < client->next_due_ns))
+            continue;
+
+        client->next_due_ns += client->period_ns;
+        if (client->next_due_ns <= sample->timestamp_ns)
+            client->next_due_ns = sample->timestamp_ns + client->period_ns;
+
+        if (client->count >= CLIENT_QUEUE_LENGTH)
+        {
+            // Queue full, client is too slow. Drop the oldest frame unless
+            // it is already partially written.
+            if (client->head_offset)
+            {
+                client->dropped++;
+                client->seq++;
+                continue;
+            }
+            client->head = (client->head + 1) % CLIENT_QUEUE_LENGTH;
+            client->count--;
+            client->dropped++;
+        }
+        int slot = (client->head + client->count) % CLIENT_QUEUE_LENGTH;
+        client->frame_length[slot] = encode_frame(client, sample, client->frames[slot]);
+        client->count++;
+        client->seq++;
+    }
+}
+
+
+static int flush_client(struct stream_client *client)
+{
+    struct iovec iov[CLIENT_QUEUE_LENGTH];
+    ssize_t written;
+    int i;
+
+    while (client->count > 0)
+    {
+        for (i = 0; i < client->count; i++)
+        {
+            int slot = (client->head + i) % CLIENT_QUEUE_LENGTH;
+            int offset = (i == 0) ? client->head_offset : 0;
+            iov[i].iov_base = client->frames[slot] + offset;
+            iov[i].iov_len = client->frame_length[slot] - offset;
+        }
+        written = writev(client->fd, iov, client->count);
+        if (written < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        // retire fully written frames
+        while ((written > 0) && (client->count > 0))
+        {
+            int remaining = client->frame_length[client->head] - client->head_offset;
+            if (written >= remaining)
+            {
+                written -= remaining;
+                client->head_offset = 0;
+                client->head = (client->head + 1) % CLIENT_QUEUE_LENGTH;
+                client->count--;
+            }
+            else
+            {
+                client->head_offset += written;
+                written = 0;
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+
+void sensor_stream_flush(struct sensor_stream *stream)
+{
+    int i;
+
+    if (stream == NULL)
+        return;
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct stream_client *client = &stream->clients[i];
+        if ((client->fd != -1) && (client->count > 0) &&
+            (flush_client(client) < 0))
+            client_close(client);
+    }
+}
+
+
+int sensor_stream_pollfds(struct sensor_stream *stream,
+                          struct pollfd *fds,
+                          int max_fds)
+{
+    int n = 0;
+    int i;
+
+    if ((stream == NULL) || (max_fds < MAX_CLIENTS + 1))
+        return 0;
+
+    fds[n].fd = stream->listen_fd;
+    fds[n].events = POLLIN;
+    fds[n].revents = 0;
+    n++;
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct stream_client *client = &stream->clients[i];
+        fds[n].fd = client->fd;
+        fds[n].events = POLLIN;
+        if (client->count > 0)
+            fds[n].events |= POLLOUT;
+        fds[n].revents = 0;
+        n++;
+    }
+    return n;
+}
+
+
+static void parse_request(struct stream_client *client, char *line)
+{
+    char *saveptr = NULL;
+    char *token;
+    int fields = -1;
+    int rate_hz = -1;
+
+    for (token = strtok_r(line, " \t\r", &saveptr);
+         token != NULL;
+         token = strtok_r(NULL, " \t\r", &saveptr))
+    {
+        if (strncmp(token, "rate=", 5) == 0)
+        {
+            rate_hz = atoi(token + 5);
+        }
+        else if (strncmp(token, "fields=", 7) == 0)
+        {
+            char *fsaveptr = NULL;
+            char *name;
+            fields = 0;
+            for (name = strtok_r(token + 7, ",", &fsaveptr);
+                 name != NULL;
+                 name = strtok_r(NULL, ",", &fsaveptr))
+            {
+                int i;
+                for (i = 0; i < sizeof(field_names)/sizeof(field_names[0]); i++)
+                {
+                    if (strcmp(name, field_names[i].name) == 0)
+                        fields |= field_names[i].field;
+                }
+            }
+        }
+    }
+
+    if (rate_hz >= 0)
+    {
+        client->rate_hz = (rate_hz > MAX_RATE_HZ) ? MAX_RATE_HZ : rate_hz;
+        client->period_ns = client->rate_hz ? 1000000000LL / client->rate_hz : 0;
+        client->next_due_ns = 0;
+    }
+    if (fields >= 0)
+        client->fields = fields;
+}
+
+
+static void read_requests(struct stream_client *client)
+{
+    ssize_t len;
+
+    while (1)
+    {
+        len = read(client->fd, client->request + client->request_length,
+                   sizeof(client->request) - 1 - client->request_length);
+        if (len == 0)
+        {
+            client_close(client);
+            return;
+        }
+        if (len < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                client_close(client);
+            return;
+        }
+        client->request_length += len;
+        client->request[client->request_length] = 0;
+
+        char *newline;
+        while ((newline = strchr(client->request, '\n')) != NULL)
+        {
+            *newline = 0;
+            parse_request(client, client->request);
+            client->request_length -= (newline + 1 - client->request);
+            memmove(client->request, newline + 1, client->request_length + 1);
+        }
+        if (client->request_length >= sizeof(client->request) - 1)
+        {
+            // line too long, discard it
+            client->request_length = 0;
+        }
+    }
+}
+
+
+static void accept_clients(struct sensor_stream *stream)
+{
+    int fd;
+
+    while ((fd = accept(stream->listen_fd, NULL, NULL)) != -1)
+    {
+        int i;
+        for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            if (stream->clients[i].fd == -1)
+                break;
+        }
+        if (i >= MAX_CLIENTS)
+        {
+            fprintf(stderr, "Too many sensor stream clients\n");
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        client_reset(&stream->clients[i]);
+        stream->clients[i].fd = fd;
+        stream->generation++;
+    }
+}
+
+
+uint32_t sensor_stream_generation(struct sensor_stream *stream)
+{
+    return stream ? stream->generation : 0;
+}
+
+
+void sensor_stream_handle(struct sensor_stream *stream,
+                          struct pollfd *fds,
+                          int num_fds)
+{
+    int i;
+
+    if ((stream == NULL) || (num_fds < MAX_CLIENTS + 1))
+        return;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct stream_client *client = &stream->clients[i];
+        struct pollfd *fdp = &fds[i + 1];
+        if ((client->fd == -1) || (fdp->fd != client->fd))
+            continue;
+        if (fdp->revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            client_close(client);
+            continue;
+        }
+        if (fdp->revents & POLLIN)
+            read_requests(client);
+        if ((client->fd != -1) && (fdp->revents & POLLOUT) &&
+            (flush_client(client) < 0))
+            client_close(client);
+    }
+    if (fds[0].revents & POLLIN)
+        accept_clients(stream);
+}
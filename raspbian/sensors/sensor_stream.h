@@ -0,0 +1,118 @@
+#ifndef _SENSOR_STREAM_H_
+#define _SENSOR_STREAM_H_
+
+#include <stdint.h>
+#include <poll.h>
+#include "ahrs.h"
+
+
+/*
+ * Local sensor streaming server.
+ *
+ * Clients connect to a unix domain stream socket and subscribe by sending a
+ * text line, e.g.
+ *
+ *     rate=20 fields=orientation,pressure
+ *
+ * A subscription may be changed at any time by sending another line. The
+ * server then sends one binary frame per period. Every frame starts with a
+ * struct sensor_stream_header, followed by one fixed size block per field
+ * bit set in header.fields, in ascending bit order:
+ *
+ *     SENSOR_FIELD_ACCEL        float x, y, z       (m/s^2)
+ *     SENSOR_FIELD_MAGN         float x, y, z       (gauss)
+ *     SENSOR_FIELD_GYRO         float x, y, z       (rad/s)
+ *     SENSOR_FIELD_ORIENTATION  float roll, pitch, yaw (degrees)
+ *     SENSOR_FIELD_PRESSURE     int32 pressure (Pa), float temperature (C)
+ *
+ * All values are little endian. Frames that cannot be written because the
+ * client is not reading fast enough are dropped (oldest first) rather than
+ * stalling the sampling loop; header.dropped counts them.
+ *
+ * header.flags carries SENSOR_SAMPLE_* bits. With test_iio_sensors -g a
+ * SENSOR_SAMPLE_GAP_* bit marks the first sample after scans of that sensor
+ * were lost, so consumers can restart any filtering rather than treat the
+ * step as motion. The -F resampler is restarted there as well, and the
+ * orientation carries no state from one sample to the next.
+ */
+
+#define SENSOR_STREAM_MAGIC             0x53524E53  // "SNRS"
+#define SENSOR_STREAM_VERSION           1
+#define SENSOR_STREAM_DEFAULT_PATH      "/tmp/rpi-stereo-cam-sensors.sock"
+
+#define SENSOR_FIELD_ACCEL              (1 << 0)
+#define SENSOR_FIELD_MAGN               (1 << 1)
+#define SENSOR_FIELD_GYRO               (1 << 2)
+#define SENSOR_FIELD_ORIENTATION        (1 << 3)
+#define SENSOR_FIELD_PRESSURE           (1 << 4)
+#define SENSOR_FIELD_ALL                0x1F
+
+#define SENSOR_SAMPLE_GAP_ACCEL         (1 << 0)
+#define SENSOR_SAMPLE_GAP_MAGN          (1 << 1)
+#define SENSOR_SAMPLE_GAP_GYRO          (1 << 2)
+
+#define SENSOR_STREAM_MAX_POLLFDS       9
+
+
+struct sensor_stream_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t fields;
+    uint16_t length;        // total frame length in bytes, header included
+    uint16_t flags;
+    uint32_t seq;
+    uint32_t dropped;
+    uint32_t reserved;
+    int64_t timestamp_ns;   // CLOCK_MONOTONIC sample time
+} __attribute__((packed));
+
+
+struct sensor_sample_t
+{
+    int64_t timestamp_ns;
+    int flags;
+    struct sensor_axis_t accel;
+    struct sensor_axis_t magn;
+    struct sensor_axis_t gyro;
+    struct orientation_t orientation;
+    int pressure;
+    double temperature;
+};
+
+
+struct sensor_stream;
+
+
+struct sensor_stream *sensor_stream_open(const char *path);
+void sensor_stream_close(struct sensor_stream *stream);
+
+/* Union of the fields requested by all connected clients. */
+int sensor_stream_wanted_fields(struct sensor_stream *stream);
+
+/* Earliest time any client is due a frame, INT64_MAX if none is. */
+int64_t sensor_stream_next_due(struct sensor_stream *stream);
+
+/* Queue one sample to every client that is due a frame. */
+void sensor_stream_publish(struct sensor_stream *stream,
+                           const struct sensor_sample_t *sample);
+
+/* Write out queued frames, batched per client. */
+void sensor_stream_flush(struct sensor_stream *stream);
+
+/* Fill up to max_fds poll entries, returns the number used. */
+int sensor_stream_pollfds(struct sensor_stream *stream,
+                          struct pollfd *fds,
+                          int max_fds);
+
+/* Changes whenever a client connects, i.e. whenever an fd number in the
+ * poll entries may have been closed and reused. */
+uint32_t sensor_stream_generation(struct sensor_stream *stream);
+
+/* Handle events from the entries filled by sensor_stream_pollfds. */
+void sensor_stream_handle(struct sensor_stream *stream,
+                          struct pollfd *fds,
+                          int num_fds);
+
+
+#endif // _SENSOR_STREAM_H_
@@ -13,10 +13,15 @@
 #include <signal.h>
 #include <getopt.h>
 #include <time.h>
+#include <math.h>
 
 #include "iio_utils.h"
 #include "ahrs.h"
 #include "calib.h"
+#include "sensor_stream.h"
+#include "fixed_point.h"
+#include "resample.h"
+#include "sensor_reader.h"
 
 
 struct iio_trigger_info
@@ -27,6 +32,26 @@ struct iio_trigger_info
     int assigned;
 };
 
+struct sample_loss
+{
+    uint64_t scans;
+    uint32_t reads;
+    uint32_t gaps;              // timestamp steps over GAP_PERIODS trigger periods
+    uint64_t dropped;           // scans missing in those gaps
+    uint32_t late_reads;        // reads returning over half the buffer
+    uint32_t full_reads;        // reads returning the whole buffer, scans were likely overwritten
+    uint32_t recoveries;        // device re-armed after a read error or a stall
+    int64_t last_timestamp_ns;
+};
+
+struct precision_report
+{
+    uint64_t samples;
+    double max_error[3];        // x, y, z, SI units
+    double sum_sq_error[3];
+    double max_error_lsb;       // largest error in units of the channel scale
+};
+
 struct iio_sensor_info
 {
     char *sensor_name;
@@ -47,11 +72,53 @@ struct iio_sensor_info
     char *buffer_access;
     char *data;
     struct iio_trigger_info *trigger;
+    int timestamp_channel;      // -1 if the device has no timestamp
+    int gap_scan;               // first scan after a gap in the last read, -1 if none
+    int gap_flag;               // SENSOR_SAMPLE_GAP_*
+    struct sample_loss loss;
+    int64_t last_read_ns;       // CLOCK_MONOTONIC of the last read with data
+    struct fixed_channel *fixed_channels;
+    struct precision_report precision;
+    struct resampler resampler;
+    struct sensor_axis_t *resampled;    // rows at fusion_rate_hz not fused yet
+    int resampled_count;
+    int resampled_size;
+    int resampled_lead;         // rows to repeat before the first output, see setup_fusion
+    int gap_row;                // first resampled row after a gap, -1 if none
+    uint64_t resampled_dropped;
 };
 
 
 #define BUFFER_LENGTH           128
 #define MAX_PRINT_RATE_HZ       25
+#define GAP_PERIODS             1.5
+#define STALL_PERIODS           10
+#define RAW_PRINT_DIVIDER       8
+#define SHOW_PRINT_DIVIDER      6
+#define STILL_WINDOW_MS         500
+#define STILL_MAX_RATE          0.2     // rad/s, well above the zero rate offset
+#define STILL_MAX_STDDEV        0.02    // rad/s
+#define STILL_WINDOW_MAX        64
+
+
+struct still_window
+{
+    struct sensor_axis_t rows[STILL_WINDOW_MAX];
+    int size;                   // rows per window, 0 if not gating
+    int head;
+    int count;
+};
+
+struct calibration_capture
+{
+    struct iio_sensor_info *sensor;
+    FILE *fp;
+    int num_lines;
+    int num_skipped;
+    int print_rate_divider;
+    int print_rate_counter;
+    struct still_window still;
+};
 
 
 static char *barometric_path = "/sys/bus/i2c/drivers/bmp085/1-0077/pressure0_input";
@@ -90,6 +157,8 @@ static struct iio_sensor_info accel =
     .calibration = &accel_calibration,
     .invert_axes = {0, 0, 1},
     .dev_fd = -1,
+    .timestamp_channel = -1,
+    .gap_flag = SENSOR_SAMPLE_GAP_ACCEL,
 };
 static struct iio_sensor_info magn  =
 {
@@ -100,6 +169,8 @@ static struct iio_sensor_info magn  =
     .calibration = &magn_calibration,
     .invert_axes = {0, 0, 1},
     .dev_fd = -1,
+    .timestamp_channel = -1,
+    .gap_flag = SENSOR_SAMPLE_GAP_MAGN,
 };
 static struct iio_sensor_info gyro  =
 {
@@ -110,6 +181,8 @@ static struct iio_sensor_info gyro  =
     .calibration = &gyro_calibration,
     .invert_axes = {1, 1, 1},
     .dev_fd = -1,
+    .timestamp_channel = -1,
+    .gap_flag = SENSOR_SAMPLE_GAP_GYRO,
 };
 static struct iio_trigger_info timer[] =
 {
@@ -122,7 +195,17 @@ static const char *progname = "";
 static const char *calibration_data_file = "/etc/default/rpi-stereo-cam-stream-calib.conf";
 static int calibration_mode = 0;
 static int raw_mode = 0;
+static int mark_gaps = 0;
+static int fixed_mode = 0;
+static int precision_report = 0;
 static int apply_calibration_in_capture = 0;
+static int fusion_rate_hz = 0;
+static int fusion_taps = RESAMPLE_DEFAULT_TAPS;
+static int64_t fusion_delay_ns = 0;
+static int reader_backend = SENSOR_READER_POLL;
+static int stall_periods = STALL_PERIODS;
+static const char *stream_socket_path = NULL;
+static struct sensor_stream *stream = NULL;
 
 
 #define min(a,b) ( (a < b) ? a : b )
@@ -136,7 +219,7 @@ static void handle_terminate_signal(int sig)
 }
 
 
-static int enable_xyz_scan_channels(const char *device_dir)
+static int enable_scan_channels(const char *device_dir)
 {
     DIR *dp = NULL;
     const struct dirent *ent = NULL;
@@ -157,10 +240,12 @@ static int enable_xyz_scan_channels(const char *device_dir)
     while (ent = readdir(dp), ent != NULL)
     {
         const char *d_name = ent->d_name + strlen(ent->d_name) - strlen("_x_en");
-        if ((d_name >= ent->d_name) &&
-            ((strcmp(d_name, "_x_en") == 0) ||
-             (strcmp(d_name, "_y_en") == 0) ||
-             (strcmp(d_name, "_z_en") == 0)))
+        // x, y, z, and the timestamp for loss detection
+        if (((d_name >= ent->d_name) &&
+             ((strcmp(d_name, "_x_en") == 0) ||
+              (strcmp(d_name, "_y_en") == 0) ||
+              (strcmp(d_name, "_z_en") == 0))) ||
+            (strcmp(ent->d_name, "in_timestamp_en") == 0))
         {
             ret = write_sysfs_int(ent->d_name, scan_el_dir, 1);
             if (ret < 0)
@@ -178,16 +263,20 @@ error_ret:
 
 static void apply_calibration_data(struct iio_channel_info *channels,
                                    int num_channels,
+                                   int timestamp_channel,
                                    struct calibration_data *calibration,
                                    char *channel_index_to_axis_map)
 {
-    if ((calibration) && (num_channels == 3))
+    if ((calibration) && (num_channels - (timestamp_channel >= 0) == 3))
     {
         int i;
+        int n = 0;
         for (i = 0; i < num_channels; i++)
         {
+            if (i == timestamp_channel)
+                continue;
             // Note: Do not use channels[i].name as it is wrong !!!
-            switch (channel_index_to_axis_map[i])
+            switch (channel_index_to_axis_map[n++])
             {
                 case 'x':
                     channels[i].scale  *= calibration->x_scale;
@@ -203,7 +292,7 @@ static void apply_calibration_data(struct iio_channel_info *channels,
                     break;
                 default: return;
             }
-            printf("%c offset %f, scale %f\n", channel_index_to_axis_map[i], channels[i].offset, channels[i].scale);
+            printf("%c offset %f, scale %f\n", channel_index_to_axis_map[n - 1], channels[i].offset, channels[i].scale);
         }
     }
 }
@@ -233,7 +322,7 @@ static int setup_iio_device(struct iio_sensor_info *info)
     if (ret < 0)
         return -ENOMEM;
 
-    ret = enable_xyz_scan_channels(info->dev_dir_name);
+    ret = enable_scan_channels(info->dev_dir_name);
     if (ret < 0)
     {
         fprintf(stderr, "Failed to enable %s scan elements\n", info->sensor_name);
@@ -251,10 +340,40 @@ static int setup_iio_device(struct iio_sensor_info *info)
         fprintf(stderr, "Problem reading %s scan element information\n", info->sensor_name);
         return ret;
     }
+    info->timestamp_channel = -1;
+    int k;
+    for (k = 0; k < info->num_channels; k++)
+        if ((info->channels[k].bytes == 8) &&
+            (strcmp(info->channels[k].generic_name, "in_timestamp") == 0))
+            info->timestamp_channel = k;
+    if (info->timestamp_channel < 0)
+        fprintf(stderr, "%s has no timestamp, sample gaps will not be detected\n", info->sensor_name);
+
     if ((!calibration_mode) || apply_calibration_in_capture)
-        apply_calibration_data(info->channels, info->num_channels, info->calibration, info->channel_index_to_axis_map);
+        apply_calibration_data(info->channels, info->num_channels, info->timestamp_channel,
+                               info->calibration, info->channel_index_to_axis_map);
 
     info->scan_size = size_from_channelarray(info->channels, info->num_channels);
+
+    if (fixed_mode || precision_report)
+    {
+        info->fixed_channels = calloc(info->num_channels, sizeof(struct fixed_channel));
+        if (!info->fixed_channels)
+            return -ENOMEM;
+        for (k = 0; k < info->num_channels; k++)
+        {
+            if (k == info->timestamp_channel)
+                continue;
+            ret = fixed_channel_init(&info->fixed_channels[k], &info->channels[k]);
+            if (ret < 0)
+            {
+                fprintf(stderr, "%s channel %s cannot be decoded in fixed point\n",
+                        info->sensor_name, info->channels[k].name);
+                return ret;
+            }
+        }
+    }
+
     info->data = malloc(info->scan_size * BUFFER_LENGTH);
     if (!info->data)
         return -ENOMEM;
@@ -383,6 +502,11 @@ static void clean_up_iio_device(struct iio_sensor_info *info)
     info->dev_fd = -1;
     free(info->channels);
     info->channels = NULL;
+    free(info->fixed_channels);
+    info->fixed_channels = NULL;
+    resampler_free(&info->resampler);
+    free(info->resampled);
+    info->resampled = NULL;
     free(info->data);
     info->data = NULL;
     free(info->dev_dir_name);
@@ -497,18 +621,22 @@ static double double8byte(uint64_t input, struct iio_channel_info *info)
 static void populate_sensor_axis(char *data,
 		                 struct iio_channel_info *channels,
 		                 int num_channels,
+                                 int timestamp_channel,
                                  char *channel_index_to_axis_map,
                                  int *invert_axis,
                                  struct sensor_axis_t *axis)
 {
     int k;
-    if (num_channels != 3)
+    int n = 0;
+    if (num_channels - (timestamp_channel >= 0) != 3)
         return;
     for (k = 0; k < num_channels; k++)
     {
         double *a;
         int invert = 0;
-        switch (channel_index_to_axis_map[k])
+        if (k == timestamp_channel)
+            continue;
+        switch (channel_index_to_axis_map[n++])
         {
             case 'x': a = &axis->x; invert = invert_axis[0]; break;
             case 'y': a = &axis->y; invert = invert_axis[1]; break;
@@ -538,6 +666,227 @@ static void populate_sensor_axis(char *data,
 }
 
 
+static void populate_sensor_axis_fixed(char *data,
+                                       struct fixed_channel *channels,
+                                       int num_channels,
+                                       int timestamp_channel,
+                                       char *channel_index_to_axis_map,
+                                       int *invert_axis,
+                                       fixed_t *axis)
+{
+    int k;
+    int n = 0;
+    if (num_channels - (timestamp_channel >= 0) != 3)
+        return;
+    for (k = 0; k < num_channels; k++)
+    {
+        fixed_t *a;
+        int invert = 0;
+        if (k == timestamp_channel)
+            continue;
+        switch (channel_index_to_axis_map[n++])
+        {
+            case 'x': a = &axis[0]; invert = invert_axis[0]; break;
+            case 'y': a = &axis[1]; invert = invert_axis[1]; break;
+            case 'z': a = &axis[2]; invert = invert_axis[2]; break;
+            default: a = NULL;
+        }
+        if (a == NULL)
+            break;
+        *a = fixed_channel_decode(&channels[k], data);
+        if (invert)
+            *a = fixed_negate(*a);
+    }
+}
+
+
+static void precision_add(struct iio_sensor_info *sensor,
+                          const struct sensor_axis_t *ref,
+                          const fixed_t *fixed)
+{
+    struct precision_report *p = &sensor->precision;
+    double value[3] = { ref->x, ref->y, ref->z };
+    double lsb = 0;
+    int i;
+
+    for (i = 0; i < sensor->num_channels; i++)
+        if ((i != sensor->timestamp_channel) && (fabs(sensor->channels[i].scale) > lsb))
+            lsb = fabs(sensor->channels[i].scale);
+    for (i = 0; i < 3; i++)
+    {
+        double error = fabs(fixed_to_double(fixed[i]) - value[i]);
+        if (error > p->max_error[i])
+            p->max_error[i] = error;
+        p->sum_sq_error[i] += error * error;
+        if ((lsb > 0) && (error / lsb > p->max_error_lsb))
+            p->max_error_lsb = error / lsb;
+    }
+    p->samples++;
+}
+
+
+/*
+ * Decode one scan with the double or, with -q, the fixed point pipeline.
+ * With -Q both run and the fixed point result is compared to the double.
+ */
+static void decode_sensor_axis(struct iio_sensor_info *sensor,
+                               char *data,
+                               struct sensor_axis_t *axis)
+{
+    fixed_t fixed[3] = {0, 0, 0};
+
+    if (fixed_mode || precision_report)
+        populate_sensor_axis_fixed(data,
+                                   sensor->fixed_channels,
+                                   sensor->num_channels,
+                                   sensor->timestamp_channel,
+                                   sensor->channel_index_to_axis_map,
+                                   sensor->invert_axes,
+                                   fixed);
+    if ((!fixed_mode) || precision_report)
+        populate_sensor_axis(data,
+                             sensor->channels,
+                             sensor->num_channels,
+                             sensor->timestamp_channel,
+                             sensor->channel_index_to_axis_map,
+                             sensor->invert_axes,
+                             axis);
+    if (precision_report)
+        precision_add(sensor, axis, fixed);
+    if (fixed_mode)
+    {
+        // final conversion for the fusion and output stages
+        axis->x = fixed_to_double(fixed[0]);
+        axis->y = fixed_to_double(fixed[1]);
+        axis->z = fixed_to_double(fixed[2]);
+    }
+}
+
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+
+/*
+ * Print the fixed point error against the double pipeline, and time both
+ * over the scans of the last read.
+ */
+static void print_precision_report(struct iio_sensor_info *sensor)
+{
+    struct precision_report *p = &sensor->precision;
+    int num_scans = sensor->read_size / (sensor->scan_size ? sensor->scan_size : 1);
+    const int runs = 100000;
+    struct timespec t0, t1, t2;
+    struct sensor_axis_t axis;
+    fixed_t fixed[3];
+    volatile double sink = 0;
+    int i;
+
+    if ((p->samples == 0) || (num_scans <= 0))
+        return;
+    fprintf(stderr, "%s: fixed point vs double over %llu samples\n",
+            sensor->sensor_name, (unsigned long long)p->samples);
+    fprintf(stderr, "    max error  x %.3g y %.3g z %.3g (%.3f lsb)\n",
+            p->max_error[0], p->max_error[1], p->max_error[2], p->max_error_lsb);
+    fprintf(stderr, "    rms error  x %.3g y %.3g z %.3g\n",
+            sqrt(p->sum_sq_error[0] / p->samples),
+            sqrt(p->sum_sq_error[1] / p->samples),
+            sqrt(p->sum_sq_error[2] / p->samples));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < runs; i++)
+    {
+        populate_sensor_axis(sensor->data + sensor->scan_size * (i % num_scans),
+                             sensor->channels, sensor->num_channels,
+                             sensor->timestamp_channel,
+                             sensor->channel_index_to_axis_map,
+                             sensor->invert_axes, &axis);
+        sink += axis.x;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < runs; i++)
+    {
+        populate_sensor_axis_fixed(sensor->data + sensor->scan_size * (i % num_scans),
+                                   sensor->fixed_channels, sensor->num_channels,
+                                   sensor->timestamp_channel,
+                                   sensor->channel_index_to_axis_map,
+                                   sensor->invert_axes, fixed);
+        sink += fixed[0];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    fprintf(stderr, "    decode     double %.1f ns/scan, fixed %.1f ns/scan\n",
+            (double)timespec_diff_ns(&t0, &t1) / runs,
+            (double)timespec_diff_ns(&t1, &t2) / runs);
+}
+
+
+static int64_t scan_timestamp_ns(char *data, struct iio_channel_info *info)
+{
+    uint64_t input = *(uint64_t *)(data + info->location);
+    return (int64_t)(info->be ? be64toh(input) : le64toh(input));
+}
+
+
+/*
+ * Account for one read of sensor->read_size bytes. The kernel ring drops
+ * scans silently when it is not read in time, so losses are inferred: the
+ * timestamp stepping by more than GAP_PERIODS trigger periods is a gap, and
+ * a read returning the whole buffer means scans were probably overwritten.
+ * Sets sensor->gap_scan to the first scan after a gap, -1 if there was none.
+ */
+static void check_sample_loss(struct iio_sensor_info *sensor)
+{
+    struct sample_loss *loss = &sensor->loss;
+    int num_scans = sensor->read_size / sensor->scan_size;
+    int64_t period_ns = (int64_t)sensor->iio_sample_interval_ms * 1000000LL;
+    int j;
+
+    sensor->gap_scan = -1;
+    loss->reads++;
+    loss->scans += num_scans;
+    if (num_scans >= BUFFER_LENGTH)
+        loss->full_reads++;
+    else if (num_scans > BUFFER_LENGTH / 2)
+        loss->late_reads++;
+
+    if (sensor->timestamp_channel < 0)
+        return;
+    for (j = 0; j < num_scans; j++)
+    {
+        int64_t ts = scan_timestamp_ns(sensor->data + sensor->scan_size * j,
+                                       &sensor->channels[sensor->timestamp_channel]);
+        int64_t delta = ts - loss->last_timestamp_ns;
+        if ((loss->last_timestamp_ns != 0) && (delta > GAP_PERIODS * period_ns))
+        {
+            loss->gaps++;
+            loss->dropped += (delta + period_ns / 2) / period_ns - 1;
+            if (sensor->gap_scan < 0)
+                sensor->gap_scan = j;
+        }
+        loss->last_timestamp_ns = ts;
+    }
+}
+
+
+static void print_sample_loss(struct iio_sensor_info *sensor)
+{
+    struct sample_loss *loss = &sensor->loss;
+
+    if (loss->reads == 0)
+        return;
+    fprintf(stderr, "%s: %llu scans in %u reads, %u gaps (%llu scans dropped), "
+                    "%u late reads, %u full reads, %u re-arms\n",
+            sensor->sensor_name,
+            (unsigned long long)loss->scans, loss->reads,
+            loss->gaps, (unsigned long long)loss->dropped,
+            loss->late_reads, loss->full_reads, loss->recoveries);
+    if (sensor->resampled_dropped)
+        fprintf(stderr, "%s: %llu resampled rows dropped waiting for other sensors\n",
+                sensor->sensor_name, (unsigned long long)sensor->resampled_dropped);
+}
+
 //------------------------------------------------------------------------------
 
 static void print_raw_axis(FILE *fp, struct sensor_axis_t *axis)
@@ -546,31 +895,297 @@ static void print_raw_axis(FILE *fp, struct sensor_axis_t *axis)
 }
 
 
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+
+/*
+ * Fusion rate resampling (-F). Each sensor's scans go through its own
+ * polyphase resampler into a queue of rows at fusion_rate_hz, and rows are
+ * fused once all three queues have them. The filters of slower sensors are
+ * longer in time, so the other queues start with a lead of repeated rows
+ * that lines every sensor up on the longest delay, fusion_delay_ns.
+ */
+static int setup_resampler(struct iio_sensor_info *sensor)
+{
+    int ret = resampler_init(&sensor->resampler,
+                             sensor->iio_sample_interval_ms * 1000,
+                             fusion_rate_hz, fusion_taps);
+    if (ret)
+    {
+        fprintf(stderr, "Cannot resample %s from %d ms to %d Hz with %d taps\n",
+                sensor->sensor_name, sensor->iio_sample_interval_ms,
+                fusion_rate_hz, fusion_taps);
+        return ret;
+    }
+    fprintf(stderr, "%s: %d taps per phase\n", sensor->sensor_name, sensor->resampler.taps);
+    sensor->gap_row = -1;
+    return 0;
+}
+
+
+static int setup_fusion(void)
+{
+    int64_t row_ns = 1000000000LL / fusion_rate_hz;
+    int ret;
+    int i;
+
+    if (((ret = setup_resampler(&accel)) != 0) ||
+        ((ret = setup_resampler(&magn)) != 0) ||
+        ((ret = setup_resampler(&gyro)) != 0))
+        return ret;
+    fusion_delay_ns = max(resampler_delay_ns(&accel.resampler),
+                          max(resampler_delay_ns(&magn.resampler),
+                              resampler_delay_ns(&gyro.resampler)));
+    for (i = 0; i < 3; i++)
+    {
+        struct iio_sensor_info *sensor;
+        switch (i)
+        {
+            case 0: sensor = &accel; break;
+            case 1: sensor =  &magn; break;
+            case 2: sensor =  &gyro; break;
+            default: continue;
+        }
+        sensor->resampled_lead = (fusion_delay_ns - resampler_delay_ns(&sensor->resampler) +
+                                  row_ns / 2) / row_ns;
+        sensor->resampled_size = resampler_max_output(&sensor->resampler, BUFFER_LENGTH) +
+                                 AHRS_BATCH_MAX + sensor->resampled_lead;
+        sensor->resampled = calloc(sensor->resampled_size, sizeof(*sensor->resampled));
+        if (sensor->resampled == NULL)
+            return -ENOMEM;
+    }
+    fprintf(stderr, "Fusing at %d Hz, %.1f ms filter delay\n",
+            fusion_rate_hz, fusion_delay_ns / 1e6);
+    return 0;
+}
+
+
+static void resample_sensor(struct iio_sensor_info *sensor)
+{
+    static struct sensor_axis_t scans[BUFFER_LENGTH];
+    int num_scans = min(sensor->read_size / sensor->scan_size, BUFFER_LENGTH);
+    int needed = resampler_max_output(&sensor->resampler, num_scans) + sensor->resampled_lead;
+    struct sensor_axis_t *out;
+    int max_out;
+    int n;
+    int i;
+
+    for (i = 0; i < num_scans; i++)
+        decode_sensor_axis(sensor, sensor->data + sensor->scan_size * i, &scans[i]);
+
+    // If fusion has stalled on another sensor keep only the newest rows
+    if (sensor->resampled_count + needed > sensor->resampled_size)
+    {
+        int drop = min(sensor->resampled_count + needed - sensor->resampled_size,
+                       sensor->resampled_count);
+        sensor->resampled_count -= drop;
+        memmove(sensor->resampled, sensor->resampled + drop,
+                sensor->resampled_count * sizeof(*sensor->resampled));
+        sensor->resampled_dropped += drop;
+        if (sensor->gap_row >= 0)
+            sensor->gap_row = max(sensor->gap_row - drop, 0);
+    }
+
+    if (mark_gaps && (sensor->gap_scan >= 0))
+        sensor->gap_row = sensor->resampled_count + sensor->resampled_lead +
+                          sensor->gap_scan * sensor->resampler.interp / sensor->resampler.decim;
+
+    out = sensor->resampled + sensor->resampled_count + sensor->resampled_lead;
+    max_out = sensor->resampled_size - sensor->resampled_count - sensor->resampled_lead;
+    if (mark_gaps && (sensor->gap_scan >= 0))
+    {
+        // Restart the filter at the gap rather than smooth across it
+        n = resampler_process(&sensor->resampler, scans, sensor->gap_scan, out, max_out);
+        resampler_reset(&sensor->resampler);
+        n += resampler_process(&sensor->resampler, scans + sensor->gap_scan,
+                               num_scans - sensor->gap_scan, out + n, max_out - n);
+    }
+    else
+        n = resampler_process(&sensor->resampler, scans, num_scans, out, max_out);
+    if ((n > 0) && (sensor->resampled_lead > 0))
+    {
+        for (i = 0; i < sensor->resampled_lead; i++)
+            sensor->resampled[sensor->resampled_count + i] = out[0];
+        n += sensor->resampled_lead;
+        sensor->resampled_lead = 0;
+    }
+    sensor->resampled_count += n;
+}
+
+
+/* Moves the first num_rows resampled rows of sensor into a batch column. */
+static void take_resampled(struct iio_sensor_info *sensor,
+                           double *x, double *y, double *z,
+                           int *row_flags, int num_rows)
+{
+    int j;
+
+    for (j = 0; j < num_rows; j++)
+    {
+        x[j] = sensor->resampled[j].x;
+        y[j] = sensor->resampled[j].y;
+        z[j] = sensor->resampled[j].z;
+    }
+    if ((sensor->gap_row >= 0) && (sensor->gap_row < num_rows))
+        row_flags[sensor->gap_row] |= sensor->gap_flag;
+    sensor->gap_row = (sensor->gap_row >= num_rows) ? sensor->gap_row - num_rows : -1;
+    sensor->resampled_count -= num_rows;
+    memmove(sensor->resampled, sensor->resampled + num_rows,
+            sensor->resampled_count * sizeof(*sensor->resampled));
+}
+
+
+static struct sensor_reader *open_sensor_reader(void)
+{
+    int dev_fds[3] = { accel.dev_fd, magn.dev_fd, gyro.dev_fd };
+    char *buffers[3] = { accel.data, magn.data, gyro.data };
+    int buffer_sizes[3] =
+    {
+        BUFFER_LENGTH*accel.scan_size,
+        BUFFER_LENGTH*magn.scan_size,
+        BUFFER_LENGTH*gyro.scan_size,
+    };
+    return sensor_reader_open(reader_backend, 3, dev_fds, buffers, buffer_sizes);
+}
+
+
+/*
+ * Re-arm one sensor after a read error or a stall while the others keep
+ * running: disable its buffer, reassign its trigger, enable the buffer again
+ * and reopen the fd. The scans lost meanwhile show up as a gap in
+ * check_sample_loss. On failure dev_fd stays -1 and the next stall period
+ * tries again.
+ */
+static int recover_sensor(struct iio_sensor_info *sensor, struct iio_trigger_info *trigger)
+{
+    int ret;
+
+    sensor->loss.recoveries++;
+    close(sensor->dev_fd);
+    sensor->dev_fd = -1;
+    stop_iio_device(sensor);
+    disconnect_trigger(sensor);
+    if (((ret = assign_trigger(sensor, trigger)) != 0) ||
+        ((ret = start_iio_device(sensor)) != 0))
+    {
+        fprintf(stderr, "Failed to re-arm %s\n", sensor->sensor_name);
+        return ret;
+    }
+    fprintf(stderr, "%s re-armed\n", sensor->sensor_name);
+    return 0;
+}
+
+
 static void process_samples(void)
 {
-    struct sensor_axis_t accel_axis;
-    struct sensor_axis_t magn_axis;
-    struct sensor_axis_t gyro_axis;
+    struct sensor_axis_t accel_axis = {0, 0, 0};
+    struct sensor_axis_t magn_axis = {0, 0, 0};
+    struct sensor_axis_t gyro_axis = {0, 0, 0};
+    static struct ahrs_batch batch;
+    static struct orientation_batch orientation_out;
+    int row_flags_batch[AHRS_BATCH_MAX];
+    int print_phase = 0;
     int pressure = read_sensor_value(barometric_path);
     int raw_temperature = read_sensor_value(temperature_path);
     struct timespec pressure_sample_time;
     clock_gettime(CLOCK_MONOTONIC, &pressure_sample_time);
 
+    struct sensor_reader *reader = open_sensor_reader();
+    if (reader == NULL)
+        return;
+
+    // Wake up at least once per stall period of the fastest sensor, so a
+    // stall is noticed even when every sensor stops
+    int stall_timeout_ms = -1;
+    if (stall_periods > 0)
+        stall_timeout_ms = stall_periods * min(accel.iio_sample_interval_ms,
+                                               min(magn.iio_sample_interval_ms,
+                                                   gyro.iio_sample_interval_ms));
+    accel.last_read_ns = timespec_to_ns(&pressure_sample_time);
+    magn.last_read_ns = accel.last_read_ns;
+    gyro.last_read_ns = accel.last_read_ns;
+
     while (!terminated)
     {
-        struct pollfd fds[] =
+        struct pollfd stream_fds[SENSOR_STREAM_MAX_POLLFDS];
+        int lengths[3];
+        const int num_sensor_fds = 3;
+        int num_stream_fds = sensor_stream_pollfds(stream, stream_fds,
+                                                   SENSOR_STREAM_MAX_POLLFDS);
+        if (sensor_reader_wait(reader, lengths, stream_fds, num_stream_fds,
+                               sensor_stream_generation(stream), stall_timeout_ms) < 0)
+            break;
+        sensor_stream_handle(stream, stream_fds, num_stream_fds);
+
+        // Re-arm any sensor whose read failed or that has been silent for
+        // stall_periods trigger periods, the others carry on
+        struct timespec wake;
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+        int64_t wake_ns = timespec_to_ns(&wake);
+        int rearm[3] = {0, 0, 0};
+        int num_rearm = 0;
+        int i;
+        for (i = 0; i < num_sensor_fds; i++)
+        {
+            struct iio_sensor_info *sensor;
+            switch (i)
+            {
+                case 0: sensor = &accel; break;
+                case 1: sensor =  &magn; break;
+                case 2: sensor =  &gyro; break;
+                default: continue;
+            }
+            int64_t stall_ns = (int64_t)stall_periods * sensor->iio_sample_interval_ms * 1000000LL;
+            if (lengths[i] > 0)
+                sensor->last_read_ns = wake_ns;
+            else if (lengths[i] < 0)
+            {
+                fprintf(stderr, "%s read failed: %s\n", sensor->sensor_name, strerror(-lengths[i]));
+                rearm[i] = 1;
+            }
+            else if ((stall_periods > 0) && (wake_ns - sensor->last_read_ns > stall_ns))
+            {
+                fprintf(stderr, "%s stalled, no data for %lld ms\n", sensor->sensor_name,
+                        (long long)((wake_ns - sensor->last_read_ns) / 1000000));
+                rearm[i] = 1;
+            }
+            if (rearm[i])
+            {
+                lengths[i] = 0;
+                num_rearm++;
+            }
+        }
+        if (num_rearm)
         {
-            { .fd = accel.dev_fd, .events = POLLIN },
-            { .fd =  magn.dev_fd, .events = POLLIN },
-            { .fd =  gyro.dev_fd, .events = POLLIN },
-        };
-        poll(fds, sizeof(fds)/sizeof(struct pollfd), -1);
+            // The reader holds the old fds, and io_uring reads queued on them
+            sensor_reader_close(reader);
+            for (i = 0; i < num_sensor_fds; i++)
+            {
+                if (!rearm[i])
+                    continue;
+                switch (i)
+                {
+                    case 0: recover_sensor(&accel, &timer[0]); accel.last_read_ns = wake_ns; break;
+                    case 1: recover_sensor(&magn, &timer[1]); magn.last_read_ns = wake_ns; break;
+                    case 2: recover_sensor(&gyro, &timer[2]); gyro.last_read_ns = wake_ns; break;
+                }
+            }
+            reader = open_sensor_reader();
+            if (reader == NULL)
+                break;
+        }
 
         int num_rows = 0;
-        int i;
-        for (i = 0; i < sizeof(fds)/sizeof(struct pollfd); i++)
+        int row_interval_ms = 0;
+        accel.gap_scan = -1;
+        magn.gap_scan = -1;
+        gyro.gap_scan = -1;
+        for (i = 0; i < num_sensor_fds; i++)
         {
-            if ((fds[i].revents & POLLIN) != 0)
+            if (lengths[i] != 0)
             {
                 struct iio_sensor_info *sensor;
                 switch (i)
@@ -580,25 +1195,22 @@ static void process_samples(void)
                     case 2: sensor =  &gyro; break;
                     default: continue;
                 }
-                sensor->read_size = read(sensor->dev_fd, sensor->data, BUFFER_LENGTH*sensor->scan_size);
-		if (sensor->read_size < 0)
+                sensor->read_size = lengths[i];
+                check_sample_loss(sensor);
+                if (fusion_rate_hz > 0)
+                    resample_sensor(sensor);
+                if (sensor->read_size/sensor->scan_size > num_rows)
                 {
-                    if (errno == EAGAIN)
-                        continue;
-                    else
-                    {
-                        terminated = 1;
-                        break;
-                    }
-		}
-                num_rows = max(sensor->read_size/sensor->scan_size, num_rows);
+                    num_rows = sensor->read_size/sensor->scan_size;
+                    row_interval_ms = sensor->iio_sample_interval_ms;
+                }
             }
         }
 
         int accel_div = 1;
         int magn_div = 1;
         int gyro_div = 1;
-        for (i = 0; i < sizeof(fds)/sizeof(struct pollfd); i++)
+        for (i = 0; i < num_sensor_fds; i++)
         {
             int *div = NULL;
             struct iio_sensor_info *sensor;
@@ -631,151 +1243,345 @@ static void process_samples(void)
         int magn_read_idx = 0;
         int gyro_read_idx = 0;
         int j;
-        for (j = 0; j < num_rows; j++)
+        int64_t batch_time_ns = timespec_to_ns(&now);
+        int64_t row_interval_ns = (int64_t)row_interval_ms * 1000000LL;
+        if (fusion_rate_hz > 0)
+        {
+            // Rows from the resamplers, as many as all three sensors have
+            num_rows = min(accel.resampled_count, min(magn.resampled_count, gyro.resampled_count));
+            num_rows = min(num_rows, AHRS_BATCH_MAX);
+            memset(row_flags_batch, 0, num_rows * sizeof(row_flags_batch[0]));
+            take_resampled(&accel, batch.accel_x, batch.accel_y, batch.accel_z, row_flags_batch, num_rows);
+            take_resampled(&magn, batch.magn_x, batch.magn_y, batch.magn_z, row_flags_batch, num_rows);
+            take_resampled(&gyro, batch.gyro_x, batch.gyro_y, batch.gyro_z, row_flags_batch, num_rows);
+            row_interval_ns = 1000000000LL / fusion_rate_hz;
+            batch_time_ns -= fusion_delay_ns;
+        }
+        else
         {
-            for (i = 0; i < sizeof(fds)/sizeof(struct pollfd); i++)
+            if (num_rows > AHRS_BATCH_MAX)
+                num_rows = AHRS_BATCH_MAX;
+
+            // Align the sensors into rows, one batch per read
+            for (j = 0; j < num_rows; j++)
             {
-                int *count = NULL;
-                int *div = NULL;
-                int *read_idx = NULL;
-                struct iio_sensor_info *sensor;
-                switch (i)
+                int row_flags = 0;
+                for (i = 0; i < num_sensor_fds; i++)
                 {
-                    case 0:
-                        sensor = &accel;
-                        axis = &accel_axis;
-                        count = &accel_count;
-                        div = &accel_div;
-                        read_idx = &accel_read_idx;
-                        break;
-                    case 1:
-                        sensor = &magn;
-                        axis = &magn_axis;
-                        count = &magn_count;
-                        div = &magn_div;
-                        read_idx = &magn_read_idx;
-                        break;
-                    case 2:
-                        sensor = &gyro;
-                        axis = &gyro_axis;
-                        count = &gyro_count;
-                        div = &gyro_div;
-                        read_idx = &gyro_read_idx;
-                        break;
-                    default:
-                        continue;
-                }
-                (*count)++;
-                if (*count >= *div)
-                {
-                    *count = 0;
-                    if (*read_idx < sensor->read_size)
+                    int *count = NULL;
+                    int *div = NULL;
+                    int *read_idx = NULL;
+                    struct iio_sensor_info *sensor;
+                    switch (i)
                     {
-                        populate_sensor_axis(sensor->data + sensor->scan_size * (*read_idx),
-                                             sensor->channels,
-                                             sensor->num_channels,
-                                             sensor->channel_index_to_axis_map,
-                                             sensor->invert_axes,
-                                             axis);
-                        (*read_idx)++;
+                        case 0:
+                            sensor = &accel;
+                            axis = &accel_axis;
+                            count = &accel_count;
+                            div = &accel_div;
+                            read_idx = &accel_read_idx;
+                            break;
+                        case 1:
+                            sensor = &magn;
+                            axis = &magn_axis;
+                            count = &magn_count;
+                            div = &magn_div;
+                            read_idx = &magn_read_idx;
+                            break;
+                        case 2:
+                            sensor = &gyro;
+                            axis = &gyro_axis;
+                            count = &gyro_count;
+                            div = &gyro_div;
+                            read_idx = &gyro_read_idx;
+                            break;
+                        default:
+                            continue;
+                    }
+                    (*count)++;
+                    if (*count >= *div)
+                    {
+                        *count = 0;
+                        if (*read_idx < sensor->read_size)
+                        {
+                            if (mark_gaps && (*read_idx == sensor->gap_scan))
+                                row_flags |= sensor->gap_flag;
+                            decode_sensor_axis(sensor,
+                                               sensor->data + sensor->scan_size * (*read_idx),
+                                               axis);
+                            (*read_idx)++;
+                        }
                     }
                 }
+                batch.accel_x[j] = accel_axis.x;
+                batch.accel_y[j] = accel_axis.y;
+                batch.accel_z[j] = accel_axis.z;
+                batch.magn_x[j] = magn_axis.x;
+                batch.magn_y[j] = magn_axis.y;
+                batch.magn_z[j] = magn_axis.z;
+                batch.gyro_x[j] = gyro_axis.x;
+                batch.gyro_y[j] = gyro_axis.y;
+                batch.gyro_z[j] = gyro_axis.z;
+                row_flags_batch[j] = row_flags;
+            }
+        }
+        batch.count = num_rows;
+
+        // Fuse the whole batch at once, and only if anything uses it
+        int wanted_fields = sensor_stream_wanted_fields(stream);
+        if ((!raw_mode) || (wanted_fields & SENSOR_FIELD_ORIENTATION))
+            orientation_compute_batch(&batch, magnetic_declination_mrad, &orientation_out);
+
+        // Stream rows: jump straight to the row each client is next due
+        int64_t first_row_time_ns = batch_time_ns - (int64_t)(num_rows - 1) * row_interval_ns;
+        int64_t due_ns;
+        j = -1;
+        while ((num_rows > 0) && ((due_ns = sensor_stream_next_due(stream)) <= batch_time_ns))
+        {
+            int row = 0;
+            if ((due_ns > first_row_time_ns) && (row_interval_ns > 0))
+                row = (due_ns - first_row_time_ns + row_interval_ns - 1) / row_interval_ns;
+            j = max(row, j + 1);
+            if (j >= num_rows)
+                break;
+            struct sensor_sample_t sample =
+            {
+                .timestamp_ns = first_row_time_ns + j * row_interval_ns,
+                .accel = { batch.accel_x[j], batch.accel_y[j], batch.accel_z[j] },
+                .magn = { batch.magn_x[j], batch.magn_y[j], batch.magn_z[j] },
+                .gyro = { batch.gyro_x[j], batch.gyro_y[j], batch.gyro_z[j] },
+                .flags = row_flags_batch[j],
+                .pressure = pressure,
+                .temperature = ((double)raw_temperature)/10,
+            };
+            if (wanted_fields & SENSOR_FIELD_ORIENTATION)
+            {
+                sample.orientation.roll = orientation_out.roll[j];
+                sample.orientation.pitch = orientation_out.pitch[j];
+                sample.orientation.yaw = orientation_out.yaw[j];
             }
+            sensor_stream_publish(stream, &sample);
+        }
 
+        // Console rows: every RAW_PRINT_DIVIDER'th or SHOW_PRINT_DIVIDER'th
+        // row, carrying the phase over from the last batch
+        int print_divider = raw_mode ? RAW_PRINT_DIVIDER : SHOW_PRINT_DIVIDER;
+        for (j = print_divider - 1 - print_phase; j < num_rows; j += print_divider)
+        {
             if (raw_mode)
             {
-                static int print_rate_divider = 0;
-                print_rate_divider++;
-                if (print_rate_divider >= 8)
-                {
-                    print_rate_divider = 0;
-                    print_raw_axis(stdout, &accel_axis);
-                    print_raw_axis(stdout, &magn_axis);
-                    print_raw_axis(stdout, &gyro_axis);
-                    fprintf(stdout, "%8d %6.1f", pressure, ((double)raw_temperature)/10);
-                    fprintf(stdout, "\n");
-                }
+                struct sensor_axis_t a = { batch.accel_x[j], batch.accel_y[j], batch.accel_z[j] };
+                struct sensor_axis_t m = { batch.magn_x[j], batch.magn_y[j], batch.magn_z[j] };
+                struct sensor_axis_t g = { batch.gyro_x[j], batch.gyro_y[j], batch.gyro_z[j] };
+                print_raw_axis(stdout, &a);
+                print_raw_axis(stdout, &m);
+                print_raw_axis(stdout, &g);
+                fprintf(stdout, "%8d %6.1f", pressure, ((double)raw_temperature)/10);
+                fprintf(stdout, "\n");
             }
             else
-                orientation_show(&accel_axis, &gyro_axis, &magn_axis, magnetic_declination_mrad, pressure, ((double)raw_temperature)/10);
+            {
+                struct orientation_t orientation =
+                {
+                    orientation_out.roll[j], orientation_out.pitch[j], orientation_out.yaw[j]
+                };
+                orientation_show(&orientation, pressure, ((double)raw_temperature)/10);
+            }
         }
+        print_phase = (print_phase + num_rows) % print_divider;
+
+        // Batch all frames queued for this read into one write per client
+        sensor_stream_flush(stream);
     }
+    sensor_reader_close(reader);
 }
 
 
-static int calibrate_sensor(struct iio_sensor_info *sensor)
+/*
+ * Gyroscope rows are only kept while the device is still: a row is written
+ * once the STILL_WINDOW_MS of rows starting with it all stay within
+ * STILL_MAX_RATE of zero and STILL_MAX_STDDEV of their mean, so rows on
+ * either side of a movement are dropped too. Pushes one row and returns 1
+ * if the oldest, copied to *oldest, is to be written, 0 if it is dropped
+ * and -1 while the window is still filling.
+ */
+static int still_window_push(struct still_window *window,
+                             const struct sensor_axis_t *axis,
+                             struct sensor_axis_t *oldest)
 {
-    if (sensor->sample_out_file == NULL)
-        return 0;
+    double sum[3] = {0, 0, 0};
+    double sum_sq[3] = {0, 0, 0};
+    int still = 1;
+    int j;
+    int k;
 
-    int print_rate_divider = 1;
-    int print_rate_counter = 0;
-    while (sensor->iio_sample_interval_ms * print_rate_divider < 1000 / MAX_PRINT_RATE_HZ)
-        print_rate_divider++;
+    window->rows[(window->head + window->count) % window->size] = *axis;
+    if (++window->count < window->size)
+        return -1;
 
+    for (j = 0; j < window->size; j++)
+    {
+        const struct sensor_axis_t *row = &window->rows[j];
+        double v[3] = { row->x, row->y, row->z };
+        for (k = 0; k < 3; k++)
+        {
+            sum[k] += v[k];
+            sum_sq[k] += v[k] * v[k];
+        }
+    }
+    for (k = 0; k < 3; k++)
+    {
+        double mean = sum[k] / window->size;
+        double variance = sum_sq[k] / window->size - mean * mean;
+        if ((fabs(mean) > STILL_MAX_RATE) || (variance > STILL_MAX_STDDEV * STILL_MAX_STDDEV))
+            still = 0;
+    }
+
+    *oldest = window->rows[window->head];
+    window->head = (window->head + 1) % window->size;
+    window->count--;
+    return still;
+}
+
+
+/*
+ * Capture every sensor given -M/-A/-G at once, each to its own file, in one
+ * event loop, so one movement session covers magnetometer and accelerometer
+ * and no idle buffer fills up meanwhile. When the gyroscope is captured
+ * together with another sensor only its still periods are written.
+ */
+static int calibrate_sensors(void)
+{
+    struct calibration_capture captures[3];
+    int num_capturing = 0;
     int ret = 0;
-    int num_lines = 0;
-    FILE *fp = fopen(sensor->sample_out_file, "w");
-    if (fp == NULL)
+    int i;
+
+    memset(captures, 0, sizeof(captures));
+    for (i = 0; i < 3; i++)
     {
-        ret = -errno;
-        fprintf(stderr, "Failed to open %s\n", sensor->sample_out_file);
-        return ret;
+        struct calibration_capture *capture = &captures[i];
+        switch (i)
+        {
+            case 0: capture->sensor = &accel; break;
+            case 1: capture->sensor =  &magn; break;
+            case 2: capture->sensor =  &gyro; break;
+        }
+        if (capture->sensor->sample_out_file == NULL)
+            continue;
+        capture->fp = fopen(capture->sensor->sample_out_file, "w");
+        if (capture->fp == NULL)
+        {
+            ret = -errno;
+            fprintf(stderr, "Failed to open %s\n", capture->sensor->sample_out_file);
+            goto out;
+        }
+        num_capturing++;
     }
 
-    while (!terminated)
+    for (i = 0; i < 3; i++)
     {
-        struct pollfd fdp =
+        struct calibration_capture *capture = &captures[i];
+        if (capture->fp == NULL)
+            continue;
+        // Share MAX_PRINT_RATE_HZ of console output between the sensors
+        capture->print_rate_divider = 1;
+        while (capture->sensor->iio_sample_interval_ms * capture->print_rate_divider <
+               1000 * num_capturing / MAX_PRINT_RATE_HZ)
+            capture->print_rate_divider++;
+        if ((capture->sensor == &gyro) && (num_capturing > 1))
         {
-            .fd = sensor->dev_fd,
-            .events = POLLIN
-        };
-        poll(&fdp, 1, -1);
+            capture->still.size = min(STILL_WINDOW_MS / gyro.iio_sample_interval_ms, STILL_WINDOW_MAX);
+            fprintf(stdout, "%s: only still periods are kept\n", capture->sensor->sensor_name);
+        }
+    }
 
-        int i;
-        if ((fdp.revents & POLLIN) != 0)
+    struct sensor_reader *reader = open_sensor_reader();
+    if (reader == NULL)
+    {
+        ret = -1;
+        goto out;
+    }
+
+    while ((!terminated) && num_capturing)
+    {
+        int lengths[3];
+        if ((ret = sensor_reader_wait(reader, lengths, NULL, 0, 0, -1)) < 0)
+            break;
+        ret = 0;
+
+        for (i = 0; i < 3; i++)
         {
-            sensor->read_size = read(sensor->dev_fd, sensor->data, BUFFER_LENGTH*sensor->scan_size);
-            if (sensor->read_size < 0)
+            struct calibration_capture *capture = &captures[i];
+            struct iio_sensor_info *sensor = capture->sensor;
+            if ((capture->fp == NULL) || (lengths[i] == 0))
+                continue;
+            if (lengths[i] < 0)
             {
-                if (errno == EAGAIN)
-                    continue;
-                else
-                {
-                    ret = -errno;
-                    terminated = 1;
-                    break;
-                }
+                fprintf(stderr, "%s read failed: %s\n", sensor->sensor_name, strerror(-lengths[i]));
+                ret = lengths[i];
+                terminated = 1;
+                break;
             }
-            struct sensor_axis_t axis;
+            sensor->read_size = lengths[i];
+            check_sample_loss(sensor);
+
             int num_rows = sensor->read_size/sensor->scan_size;
             int j;
-            for (j = 0; j < num_rows; j++)
+            for (j = 0; (j < num_rows) && capture->fp; j++)
             {
-                print_rate_counter++;
-                if (print_rate_counter >= print_rate_divider)
+                struct sensor_axis_t axis;
+                decode_sensor_axis(sensor, sensor->data + sensor->scan_size * j, &axis);
+                if (capture->still.size)
                 {
-                    print_rate_counter = 0;
-                    populate_sensor_axis(sensor->data + sensor->scan_size * j,
-                                         sensor->channels,
-                                         sensor->num_channels,
-                                         sensor->channel_index_to_axis_map,
-                                         sensor->invert_axes,
-                                         &axis);
+                    // A gap breaks the window, restart it
+                    if (j == sensor->gap_scan)
+                        capture->still.count = 0;
+                    if (still_window_push(&capture->still, &axis, &axis) <= 0)
+                    {
+                        capture->num_skipped++;
+                        continue;
+                    }
+                }
+
+                print_raw_axis(capture->fp, &axis);
+                fprintf(capture->fp, "\n");
+                capture->num_lines++;
+                capture->print_rate_counter++;
+                if (capture->print_rate_counter >= capture->print_rate_divider)
+                {
+                    capture->print_rate_counter = 0;
+                    fprintf(stdout, "%-5s ", sensor == &accel ? "accel" : sensor == &magn ? "magn" : "gyro");
                     print_raw_axis(stdout, &axis);
                     fprintf(stdout, "\n");
-                    print_raw_axis(fp, &axis);
-                    fprintf(fp, "\n");
-
-                    num_lines++;
-                    if (num_lines >= 0xFFFF)
-                        terminated = 1;
+                }
+                if (capture->num_lines >= 0xFFFF)
+                {
+                    fprintf(stdout, "%s: sample limit reached\n", sensor->sensor_name);
+                    fclose(capture->fp);
+                    capture->fp = NULL;
+                    num_capturing--;
                 }
             }
         }
     }
+    sensor_reader_close(reader);
 
-    fclose(fp);
+out:
+    for (i = 0; i < 3; i++)
+    {
+        struct calibration_capture *capture = &captures[i];
+        // a failed open leaves the sensors after it unassigned
+        if ((capture->sensor == NULL) || (capture->sensor->sample_out_file == NULL))
+            continue;
+        if (capture->fp)
+            fclose(capture->fp);
+        fprintf(stdout, "%s: %d samples written to %s", capture->sensor->sensor_name,
+                capture->num_lines, capture->sensor->sample_out_file);
+        if (capture->still.size)
+            fprintf(stdout, ", %d skipped while moving", capture->num_skipped);
+        fprintf(stdout, "\n");
+    }
     return ret;
 }
 
@@ -793,11 +1599,30 @@ void syntax(void)
     fprintf(stderr, " -C            Apply calibration data in calibration mode\n");
     fprintf(stderr, " -c <path>     Calibration data (default %s)\n", calibration_data_file);
     fprintf(stderr, " -r            Raw data mode\n");
+    fprintf(stderr, " -q            Decode and calibrate samples in fixed point\n");
+    fprintf(stderr, " -Q            Compare fixed point against double decoding, report on exit\n");
+    fprintf(stderr, " -g            Flag the first sample after a gap in a sensor's data\n"
+                    "               (SENSOR_SAMPLE_GAP_*) and restart the -F filter there\n"
+                    "               instead of fusing across it\n");
+    fprintf(stderr, " -s <path>     Serve sensor data on unix socket <path> (e.g. %s)\n", SENSOR_STREAM_DEFAULT_PATH);
+    fprintf(stderr, " -F <hz>[:<taps>]\n"
+                    "               Low pass filter and resample every sensor to <hz> before\n"
+                    "               fusion, <taps> per filter phase (default %d, more when\n"
+                    "               decimating), instead of\n"
+                    "               picking whole samples\n", RESAMPLE_DEFAULT_TAPS);
+    fprintf(stderr, " -b <backend>  How to wait for and read the sensors: poll (default), epoll\n"
+#ifdef HAVE_IO_URING
+                    "               or uring\n"
+#endif
+                    );
+    fprintf(stderr, " -S <periods>  Re-arm a sensor that sent nothing for <periods> trigger periods\n"
+                    "               (default %d, 0 never), or whose read failed\n", STALL_PERIODS);
     fprintf(stderr, " -h            display this information\n");
     fprintf(stderr, "\n");
-    fprintf(stderr, "When calibrating more than one sensor, the magnetometer calibration will run\n"
-                    "first, followed by accelerometer, then gyroscope. Hit ctrl-C to complete the\n"
-                    "current calibration.\n");
+    fprintf(stderr, "When calibrating more than one sensor, all of them are captured at once until\n"
+                    "ctrl-C. Magnetometer and accelerometer can share one rotation session. With\n"
+                    "either of them the gyroscope only keeps the periods the sensor is held still,\n"
+                    "so pause between rotations.\n");
     fprintf(stderr, "How to calibrate magnetometer:\n"
                     "\t- Rotate sensor around the XYZ axes slowly\n");
     fprintf(stderr, "How to calibrate accelerometer:\n"
@@ -816,7 +1641,7 @@ int main(int argc, char *argv[])
 
     progname = argv[0];
 
-    while ((opt = getopt (argc, argv, "M:A:G:c:Crh")) != -1)
+    while ((opt = getopt (argc, argv, "M:A:G:c:CrgqQs:F:b:S:h")) != -1)
     {
         switch (opt)
         {
@@ -825,7 +1650,22 @@ int main(int argc, char *argv[])
             case 'G': gyro.sample_out_file = optarg; if (strlen(gyro.sample_out_file) == 0) syntax(); break;
             case 'c': calibration_data_file = optarg; if (strlen(calibration_data_file) == 0) syntax(); break;
             case 'r': raw_mode = 1; break;
+            case 'g': mark_gaps = 1; break;
+            case 'q': fixed_mode = 1; break;
+            case 'Q': precision_report = 1; break;
             case 'C': apply_calibration_in_capture = 1; break;
+            case 's': stream_socket_path = optarg; if (strlen(stream_socket_path) == 0) syntax(); break;
+            case 'b':
+                reader_backend = sensor_reader_backend_from_name(optarg);
+                if (reader_backend < 0)
+                    syntax();
+                break;
+            case 'S': stall_periods = atoi(optarg); if (stall_periods < 0) syntax(); break;
+            case 'F':
+                if ((sscanf(optarg, "%d:%d", &fusion_rate_hz, &fusion_taps) < 1) ||
+                    (fusion_rate_hz <= 0) || (fusion_taps <= 0))
+                    syntax();
+                break;
             case 'h': // fall through
             default:
                 syntax();
@@ -878,6 +1718,7 @@ int main(int argc, char *argv[])
 
     signal(SIGINT, handle_terminate_signal);
     signal(SIGTERM, handle_terminate_signal);
+    signal(SIGPIPE, SIG_IGN);
 
     if (((ret = start_iio_device(&accel)) != 0) ||
         ((ret = start_iio_device(&magn)) != 0) ||
@@ -886,37 +1727,37 @@ int main(int argc, char *argv[])
 
     if (calibration_mode)
     {
-        if (!terminated)
-        {
-            fprintf(stdout, "\n");
-            fprintf(stdout, "***********************************************\n");
-            fprintf(stdout, "          M A G N E T O M E T E R\n");
-            fprintf(stdout, "***********************************************\n");
-            if (calibrate_sensor(&magn) == 0)
-                terminated = 0;
-        }
-        if (!terminated)
-        {
-            fprintf(stdout, "\n");
-            fprintf(stdout, "***********************************************\n");
-            fprintf(stdout, "         A C C E L E R O M E T E R\n");
-            fprintf(stdout, "***********************************************\n");
-            if (calibrate_sensor(&accel) == 0)
-                terminated = 0;
-        }
-        if (!terminated)
-        {
-            fprintf(stdout, "\n");
-            fprintf(stdout, "***********************************************\n");
-            fprintf(stdout, "             G Y R O S C O P E\n");
-            fprintf(stdout, "***********************************************\n");
-            if (calibrate_sensor(&gyro) == 0)
-                terminated = 0;
-        }
+        ret = calibrate_sensors();
     }
     else
+    {
+        if ((fusion_rate_hz > 0) && ((ret = setup_fusion()) != 0))
+            goto error_stop;
+        if (stream_socket_path)
+        {
+            stream = sensor_stream_open(stream_socket_path);
+            if (stream == NULL)
+            {
+                ret = -1;
+                goto error_stop;
+            }
+        }
         process_samples();
+        sensor_stream_close(stream);
+        stream = NULL;
+    }
+
+error_stop:
 
+    print_sample_loss(&accel);
+    print_sample_loss(&magn);
+    print_sample_loss(&gyro);
+    if (precision_report)
+    {
+        print_precision_report(&accel);
+        print_precision_report(&magn);
+        print_precision_report(&gyro);
+    }
     stop_iio_device(&accel);
     stop_iio_device(&magn);
     stop_iio_device(&gyro);
@@ -0,0 +1,208 @@
+// Live sensor telemetry for the browsers.
+//
+// Subscribes to the sensor stream socket of test_iio_sensors -s for the
+// orientation and pressure fields, and optionally watches gpsd for the fix.
+// The latest values are kept and packed on demand into one small little
+// endian message, the same Buffer is then sent to every client as a binary
+// socket.io event, so no JSON is built per sample:
+//
+//   offset  type     value
+//        0  uint8    version (1)
+//        1  uint8    valid: 1 attitude, 2 pressure, 4 GPS fix
+//        2  uint16   sample flags (SENSOR_SAMPLE_GAP_*)
+//        4  uint32   sample sequence number
+//        8  float64  time the sample was received (ms since the epoch)
+//       16  float32  roll, pitch, yaw (degrees)
+//       28  float32  pressure (Pa), temperature (C)
+//       36  float64  latitude, longitude (degrees)
+//       52  float32  altitude (m), speed (m/s), track (degrees)
+//
+// 'update' is emitted whenever a new sample or fix arrives.
+
+var net = require('net');
+var util = require('util');
+var EventEmitter = require('events').EventEmitter;
+
+var stream_magic = 0x53524E53;
+var stream_header_size = 32;
+var field_blocks = [12, 12, 12, 12, 8];
+var field_orientation = 1 << 3;
+var field_pressure = 1 << 4;
+var valid_attitude = 1;
+var valid_pressure = 2;
+var valid_gps = 4;
+var message_version = 1;
+var message_size = 64;
+var gpsd_port = 2947;
+
+
+function Telemetry(path, options) {
+  EventEmitter.call(this);
+  options = options || {};
+  this.path = path;
+  this.retryInterval = options.retryInterval || 5000;
+  this.gpsd = options.gpsd || false;
+  this.rate = 0;
+  this.stream = null;
+  this.pending = null;
+  this.valid = 0;
+  this.flags = 0;
+  this.seq = 0;
+  this.time = 0;
+  this.orientation = [0, 0, 0];
+  this.pressure = 0;
+  this.temperature = 0;
+  this.gps = null;
+  this.message = null;
+  this.connect();
+  if (this.gpsd)
+    this.connectGpsd();
+}
+util.inherits(Telemetry, EventEmitter);
+
+
+// Rate of the sensor stream subscription, 0 pauses it.
+Telemetry.prototype.setRate = function(rate) {
+  this.rate = rate;
+  if (this.stream)
+    this.stream.write('rate=' + rate + ' fields=orientation,pressure\n');
+};
+
+
+Telemetry.prototype.connect = function() {
+  var self = this;
+  var stream = net.connect(this.path);
+  stream.on('connect', function() {
+    self.stream = stream;
+    self.pending = null;
+    self.setRate(self.rate);
+  });
+  stream.on('data', function(data) {
+    self.parse(data);
+  });
+  stream.on('error', function() {});
+  stream.on('close', function() {
+    self.stream = null;
+    self.valid &= ~(valid_attitude | valid_pressure);
+    setTimeout(function() { self.connect(); }, self.retryInterval);
+  });
+};
+
+
+Telemetry.prototype.parse = function(data) {
+  var buf = this.pending ? Buffer.concat([this.pending, data]) : data;
+  var offset = 0;
+  var updated = false;
+  while (buf.length - offset >= stream_header_size) {
+    var length = buf.readUInt16LE(offset + 8);
+    if ((buf.readUInt32LE(offset) !== stream_magic) || (length < stream_header_size)) {
+      // out of step, the stream cannot be resynchronised reliably
+      this.stream.destroy();
+      return;
+    }
+    if (buf.length - offset < length)
+      break;
+    this.frame(buf, offset);
+    updated = true;
+    offset += length;
+  }
+  this.pending = (offset < buf.length) ? buf.slice(offset) : null;
+  if (updated) {
+    this.message = null;
+    this.emit('update');
+  }
+};
+
+
+Telemetry.prototype.frame = function(buf, offset) {
+  var fields = buf.readUInt16LE(offset + 6);
+  var pos = offset + stream_header_size;
+  this.flags = buf.readUInt16LE(offset + 10);
+  this.seq = buf.readUInt32LE(offset + 12);
+  this.time = Date.now();
+  for (var i = 0; i < field_blocks.length; i++) {
+    var field = 1 << i;
+    if (!(fields & field))
+      continue;
+    if (field === field_orientation) {
+      this.orientation[0] = buf.readFloatLE(pos);
+      this.orientation[1] = buf.readFloatLE(pos + 4);
+      this.orientation[2] = buf.readFloatLE(pos + 8);
+      this.valid |= valid_attitude;
+    } else if (field === field_pressure) {
+      this.pressure = buf.readInt32LE(pos);
+      this.temperature = buf.readFloatLE(pos + 4);
+      this.valid |= valid_pressure;
+    }
+    pos += field_blocks[i];
+  }
+};
+
+
+// gpsd reports about once a second, its JSON is cheap at that rate.
+Telemetry.prototype.connectGpsd = function() {
+  var self = this;
+  var gpsd = net.connect(gpsd_port, 'localhost');
+  var pending = '';
+  gpsd.on('connect', function() {
+    gpsd.write('?WATCH={"enable":true,"json":true};\n');
+  });
+  gpsd.on('data', function(data) {
+    pending += data.toString();
+    var lines = pending.split('\n');
+    pending = lines.pop();
+    lines.forEach(function(line) {
+      var report;
+      try {
+        report = JSON.parse(line);
+      } catch (e) {
+        return;
+      }
+      if (report['class'] !== 'TPV')
+        return;
+      if ((report.mode >= 2) && ('lat' in report) && ('lon' in report))
+        self.gps = report;
+      else
+        self.gps = null;
+      self.message = null;
+      self.emit('update');
+    });
+  });
+  gpsd.on('error', function() {});
+  gpsd.on('close', function() {
+    self.gps = null;
+    setTimeout(function() { self.connectGpsd(); }, self.retryInterval);
+  });
+};
+
+
+// The packed latest values, built at most once per update.
+Telemetry.prototype.encode = function() {
+  if (this.message)
+    return this.message;
+  var buf = new Buffer(message_size);
+  var gps = this.gps;
+  buf.fill(0);
+  buf.writeUInt8(message_version, 0);
+  buf.writeUInt8(this.valid | (gps ? valid_gps : 0), 1);
+  buf.writeUInt16LE(this.flags, 2);
+  buf.writeUInt32LE(this.seq, 4);
+  buf.writeDoubleLE(this.time, 8);
+  buf.writeFloatLE(this.orientation[0], 16);
+  buf.writeFloatLE(this.orientation[1], 20);
+  buf.writeFloatLE(this.orientation[2], 24);
+  buf.writeFloatLE(this.pressure, 28);
+  buf.writeFloatLE(this.temperature, 32);
+  if (gps) {
+    buf.writeDoubleLE(gps.lat, 36);
+    buf.writeDoubleLE(gps.lon, 44);
+    buf.writeFloatLE(gps.alt || 0, 52);
+    buf.writeFloatLE(gps.speed || 0, 56);
+    buf.writeFloatLE(gps.track || 0, 60);
+  }
+  this.message = buf;
+  return buf;
+};
+
+
+module.exports = Telemetry;